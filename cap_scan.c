@@ -0,0 +1,364 @@
+/* cap_scan.c
+ *
+ * Report the capability sets of every process on the system, grouped by
+ * user namespace, as demo_userns.c does for itself with cap_get_proc(),
+ * fast enough for hosts with 100k+ processes.
+ *
+ * /proc is listed with getdents64() into one buffer. A set of
+ * worker threads, taking PIDs from a shared index in chunks, read each
+ * process's user namespace link (readlinkat()) and the Cap* lines of its
+ * /proc/PID/status, parsed in a fixed buffer on the stack. capget() would
+ * not do: it has no bounding or ambient set. Nothing is allocated per
+ * process; the per-process array is only grown, by doubling. Processes
+ * are then grouped by user namespace and capability sets with one sort,
+ * and the sets decoded into names, again into a fixed buffer.
+ *
+ * Build with: cc -o cap_scan cap_scan.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+// Capability names, by number, without the "cap_" prefix
+static const char *cap_names[] = {
+	"chown", "dac_override", "dac_read_search", "fowner", "fsetid",
+	"kill", "setgid", "setuid", "setpcap", "linux_immutable",
+	"net_bind_service", "net_broadcast", "net_admin", "net_raw",
+	"ipc_lock", "ipc_owner", "sys_module", "sys_rawio", "sys_chroot",
+	"sys_ptrace", "sys_pacct", "sys_admin", "sys_boot", "sys_nice",
+	"sys_resource", "sys_time", "sys_tty_config", "mknod", "lease",
+	"audit_write", "audit_control", "setfcap", "mac_override",
+	"mac_admin", "syslog", "wake_alarm", "block_suspend", "audit_read",
+	"perfmon", "bpf", "checkpoint_restore",
+};
+#define NCAP_NAMES	((int) (sizeof(cap_names) / sizeof(cap_names[0])))
+
+// The status lines we read, in the order of struct proc_caps.set[]
+static const char *set_names[] = {
+	"CapEff:", "CapPrm:", "CapInh:", "CapBnd:", "CapAmb:",
+};
+#define NSETS		((int) (sizeof(set_names) / sizeof(set_names[0])))
+#define ALL_FOUND	((1 << (NSETS + 1)) - 1)	// the sets and the ns
+
+#define LINE_SIZE	1024		// status lines longer than this are skipped
+
+// What was found for one process
+struct proc_caps {
+	pid_t	pid;
+	uint32_t	found;		// bit per set[] entry, then the ns
+	ino_t	userns;
+	uint64_t	set[NSETS];
+};
+
+struct scan {
+	int	proc_fd;
+	struct proc_caps	*procs;
+	int	nprocs, size;
+};
+
+static uint64_t	full_set;		// every capability this kernel has
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-j n	 scan with `n` threads (default: one per CPU)\n");
+	fprintf(stderr, "	-p	 list every process instead of grouping\n");
+	fprintf(stderr, "	-x	 print the sets as hex masks, not names\n");
+	fprintf(stderr, "	-s	 only output the scan statistics\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Add `pid` to procs[]
+static void add_pid(pid_t pid, void *arg) {
+	struct scan *s = arg;
+
+	if (s->nprocs == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->procs = realloc(s->procs, s->size * sizeof(struct proc_caps));
+		if (s->procs == NULL)
+			bail("realloc");
+	}
+	s->procs[s->nprocs].pid = pid;
+	s->procs[s->nprocs].found = 0;
+	s->nprocs++;
+}
+
+// Parse one status line, "CapEff:\t000001ffffffffff"
+static void parse_line(char *line, struct proc_caps *pc) {
+	int j;
+
+	if (strncmp(line, "Cap", 3) != 0)
+		return;
+	for (j = 0; j < NSETS; j++)
+		if (strncmp(line, set_names[j], 7) == 0) {
+			pc->set[j] = strtoull(line + 7, NULL, 16);
+			pc->found |= 1 << j;
+			return;
+		}
+}
+
+/* Read the Cap* lines of an open status file. Lines are taken from a
+   buffer that is refilled as it empties; one that does not fit (a long
+   Groups line) is skipped */
+static void parse_status(int fd, struct proc_caps *pc) {
+	char	buf[LINE_SIZE], *p, *nl;
+	size_t	len;
+	ssize_t	n;
+	int skipping;
+
+	len = 0;
+	skipping = 0;
+	while ((pc->found & ((1 << NSETS) - 1)) != (1 << NSETS) - 1 &&
+	       (n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+		len += n;
+		for (p = buf; (nl = memchr(p, '\n', buf + len - p)) != NULL;
+		     p = nl + 1) {
+			*nl = '\0';
+			if (!skipping)
+				parse_line(p, pc);
+			skipping = 0;
+		}
+
+		len = buf + len - p;
+		if (len == sizeof(buf)) {
+			skipping = 1;
+			len = 0;
+		} else {
+			memmove(buf, p, len);
+		}
+	}
+}
+
+// Fill in `pc` from its status file and user namespace link
+static void scan_proc(struct scan *s, struct proc_caps *pc) {
+	char	path[32], target[64], *p;
+	ssize_t	n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%d/ns/user", (int) pc->pid);
+	n = readlinkat(s->proc_fd, path, target, sizeof(target) - 1);
+	if (n <= 0)
+		return;			// gone already, or not ours to see
+	target[n] = '\0';
+	p = strchr(target, '[');
+	if (p == NULL)
+		return;
+	pc->userns = strtoull(p + 1, NULL, 10);
+	pc->found |= 1 << NSETS;
+
+	snprintf(path, sizeof(path), "%d/status", (int) pc->pid);
+	fd = openat(s->proc_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	parse_status(fd, pc);
+	close(fd);
+}
+
+static void scan_one(int j, void *arg) {
+	struct scan *s = arg;
+
+	scan_proc(s, &s->procs[j]);
+}
+
+// Order by user namespace, then capability sets, then PID
+static int cmp_proc(const void *a, const void *b) {
+	const struct proc_caps *x = a, *y = b;
+	int j;
+
+	if (x->userns != y->userns)
+		return (x->userns > y->userns) - (x->userns < y->userns);
+	for (j = 0; j < NSETS; j++)
+		if (x->set[j] != y->set[j])
+			return (x->set[j] > y->set[j]) - (x->set[j] < y->set[j]);
+	return x->pid - y->pid;
+}
+
+static int same_sets(const struct proc_caps *x, const struct proc_caps *y) {
+	return x->userns == y->userns &&
+	       memcmp(x->set, y->set, sizeof(x->set)) == 0;
+}
+
+// Append capability `cap`'s name to `buf`, after `sep`
+static size_t append_cap(char *buf, size_t len, size_t size, const char *sep,
+			 int cap) {
+	if (len >= size)
+		return len;
+	if (cap < NCAP_NAMES)
+		return len + snprintf(buf + len, size - len, "%s%s", sep,
+				      cap_names[cap]);
+	return len + snprintf(buf + len, size - len, "%s%d", sep, cap);
+}
+
+/* Decode a set into `buf`: "none", names joined by ',', or, for a set
+   holding most capabilities, "full" followed by the missing ones, as in
+   "full,-sys_admin". With `hex`, just the mask */
+static char *decode(uint64_t set, int hex, char *buf, size_t size) {
+	size_t	len;
+	int cap, inverse;
+
+	if (hex) {
+		snprintf(buf, size, "%016llx", (unsigned long long) set);
+		return buf;
+	}
+	if (set == 0) {
+		snprintf(buf, size, "none");
+		return buf;
+	}
+
+	inverse = __builtin_popcountll(set & full_set) >
+		  __builtin_popcountll(full_set) / 2;
+	len = inverse ? snprintf(buf, size, "full") : 0;
+	buf[len] = '\0';
+	for (cap = 0; cap < 64; cap++) {
+		if (inverse && (full_set & (1ULL << cap)) && !(set & (1ULL << cap)))
+			len = append_cap(buf, len, size, ",-", cap);
+		else if ((!inverse || !(full_set & (1ULL << cap))) &&
+			 (set & (1ULL << cap)))
+			len = append_cap(buf, len, size, len ? "," : "", cap);
+	}
+	return buf;
+}
+
+static void print_sets(const struct proc_caps *pc, int hex) {
+	char	buf[1024];
+	int j;
+
+	for (j = 0; j < NSETS; j++)
+		printf(" %.3s=%s", set_names[j] + 3,
+		       decode(pc->set[j], hex, buf, sizeof(buf)));
+	printf("\n");
+}
+
+/* Group the processes by user namespace and capability sets and print
+   them, or every process if `per_process`. Returns the number of user
+   namespaces */
+static int report(struct scan *s, int per_process, int hex, int quiet) {
+	struct proc_caps	*pc;
+	int n, j, k, nns;
+
+	// Drop the processes that could not be read in full
+	for (n = 0, j = 0; j < s->nprocs; j++)
+		if (s->procs[j].found == ALL_FOUND)
+			s->procs[n++] = s->procs[j];
+	s->nprocs = n;
+	qsort(s->procs, n, sizeof(struct proc_caps), cmp_proc);
+
+	for (nns = 0, j = 0; j < n; j = k) {
+		pc = &s->procs[j];
+		if (j == 0 || pc->userns != s->procs[j - 1].userns) {
+			nns++;
+			for (k = j + 1; k < n && s->procs[k].userns == pc->userns; k++)
+				continue;
+			if (!quiet)
+				printf("userns %llu: %d processes\n",
+				       (unsigned long long) pc->userns, k - j);
+		}
+
+		if (per_process) {
+			k = j + 1;
+			if (!quiet) {
+				printf("  pid %7d", (int) pc->pid);
+				print_sets(pc, hex);
+			}
+			continue;
+		}
+
+		for (k = j + 1; k < n && same_sets(&s->procs[k], pc); k++)
+			continue;
+		if (!quiet) {
+			printf("  %7d x pid %7d", k - j, (int) pc->pid);
+			print_sets(pc, hex);
+		}
+	}
+
+	return nns;
+}
+
+// Find the highest capability this kernel knows of
+static void read_last_cap(void) {
+	char	buf[16];
+	ssize_t	n;
+	int fd, last;
+
+	last = NCAP_NAMES - 1;
+	fd = open("/proc/sys/kernel/cap_last_cap", O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		n = read(fd, buf, sizeof(buf) - 1);
+		if (n > 0) {
+			buf[n] = '\0';
+			last = atoi(buf);
+		}
+		close(fd);
+	}
+	full_set = (last >= 63) ? ~0ULL : (1ULL << (last + 1)) - 1;
+}
+
+int main(int argc, char **argv) {
+	int opt, per_process, hex, stats_only, nworkers, found, nns;
+	struct scan	s;
+	double	start, list_us, scan_us, report_us;
+
+	per_process = 0;
+	hex = 0;
+	stats_only = 0;
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	memset(&s, 0, sizeof(s));
+
+	while ((opt = getopt(argc, argv, "j:pxs")) != -1) {
+		switch (opt) {
+		case 'j': nworkers = atoi(optarg);	break;
+		case 'p': per_process = 1;		break;
+		case 'x': hex = 1;			break;
+		case 's': stats_only = 1;		break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || nworkers < 1)
+		usage(argv[0]);
+
+	read_last_cap();
+	s.proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (s.proc_fd == -1)
+		bail("open /proc");
+
+	start = now_us();
+	s.nprocs = 0;
+	if (ns_list_pids(s.proc_fd, add_pid, &s) == -1) {
+		fprintf(stderr, "%s\n", ns_error());
+		exit(EXIT_FAILURE);
+	}
+	list_us = now_us() - start;
+	ns_parallel(s.nprocs, nworkers, scan_one, &s);
+	scan_us = now_us() - start - list_us;
+	found = s.nprocs;
+	nns = report(&s, per_process, hex, stats_only);
+	report_us = now_us() - start - list_us - scan_us;
+
+	printf("# %d processes, %d read, %d user namespaces, list %.3f ms, "
+	       "scan %.3f ms, report %.3f ms, %d workers\n", found, s.nprocs,
+	       nns, list_us / 1e3, scan_us / 1e3, report_us / 1e3, nworkers);
+	exit(EXIT_SUCCESS);
+}
@@ -25,12 +25,16 @@
 // Startup funciton for cloned child
 static int childFunc(void *arg) {
 	cap_t	caps;
+	char	*text;
 
 	for(;;) {
 		printf("eUID = %ld; eGID = %ld ", (long)geteuid(), (long)getegid());
 
 		caps = cap_get_proc();
-		printf("capabilities: %s\n", cap_to_text(caps, NULL));
+		text = cap_to_text(caps, NULL);
+		printf("capabilities: %s\n", text);
+		cap_free(text);
+		cap_free(caps);
 
 		if (arg == NULL)
 			break;
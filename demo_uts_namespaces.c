@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include "ns_sync.h"
 
 
 /* A simple error-handling function: print an error message based
@@ -21,18 +22,26 @@
 	} while (0)
 
 
+static struct ns_sync *handshake;		// handshake with the parent
+
 /* Start function for cloned child */
 static int childFunc(void *arg) {
 	struct utsname uts;
 
 	// change hostname in UTS namespace of child
-	if (sethostname(arg, strlen(arg)) == -1)
+	if (sethostname(arg, strlen(arg)) == -1) {
+		ns_sync_fail(handshake, errno, "sethostname");
 		bail("sethostname");
+	}
 
 	// retriveve and dispaly hostname
 	if (uname(&uts) == -1)
 		bail("uname");
 	printf("uts.nodename in child: %s\n", uts.nodename);
+	fflush(stdout);
+
+	// tell the parent that the hostname has been changed
+	ns_sync_post(handshake, NS_SYNC_CHILD_READY);
 
 	// keep the namespace open for a while, by sleeping
 	// this is allows some experimentation: for example, another
@@ -55,6 +64,10 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	handshake = ns_sync_create();
+	if (handshake == NULL)
+		bail("ns_sync_create");
+
 	// create child taht has its own UTS namespace;
 	// child commences excution in childFunc()
 	child_pid = clone(childFunc, child_stack + STACK_SIZE, CLONE_NEWUTS | SIGCHLD, argv[1]);
@@ -65,7 +78,12 @@ int main(int argc, char **argv) {
 
 	// Parent falls through to here
 
-	sleep(1);		// give child time to change its hostname
+	// wait for the child to change its hostname
+	if (ns_sync_wait(handshake, NS_SYNC_CHILD_READY, child_pid) == -1) {
+		fprintf(stderr, "child failed: %s: %s\n", ns_sync_error(handshake),
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
 	// display hostname in parent's UTS namespace, This will be different
 	// from hostname in child's UTS namespace
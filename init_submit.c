@@ -0,0 +1,98 @@
+/* init_submit.c
+ *
+ * Submit a command to a simple_init running in supervisor mode (-s), wait
+ * for it to be run, and report its exit status and resource usage.
+ * We exit with the exit status of the job.
+ **/
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+#define	CMD_SIZE	10000		// as in simple_init.c
+
+/* Append `arg` to `buf` in single quotes, so that the word expansion done
+   by simple_init gives back exactly `arg`. Returns the new length of the
+   string in `buf`, or -1 if it doesn't fit. simple_init reads at most
+   CMD_SIZE - 1 bytes, and we always keep room for the closing quote and
+   the space */
+static int append_quoted(char *buf, int len, char *arg) {
+	if (len + 3 >= CMD_SIZE)
+		return -1;
+	for (buf[len++] = '\''; *arg != '\0'; arg++) {
+		if (len + 6 >= CMD_SIZE)
+			return -1;
+		if (*arg == '\'') {		// ' becomes '\''
+			memcpy(buf + len, "'\\''", 4);
+			len += 4;
+		} else {
+			buf[len++] = *arg;
+		}
+	}
+	buf[len++] = '\'';
+	buf[len++] = ' ';
+
+	return len;
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_un	addr;
+	char	cmd[CMD_SIZE], result[256];
+	int sfd, len, j, status;
+	ssize_t	n;
+	char	*p;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s socket-path cmd [arg...]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	len = 0;
+	for (j = 2; j < argc; j++) {
+		len = append_quoted(cmd, len, argv[j]);
+		if (len == -1) {
+			fprintf(stderr, "command too long\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	sfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sfd == -1)
+		bail("socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+	if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		bail("connect");
+
+	if (send(sfd, cmd, len, 0) != len)
+		bail("send");
+
+	// Blocks until the job has been run
+	n = recv(sfd, result, sizeof(result) - 1, 0);
+	if (n == -1)
+		bail("recv");
+	if (n == 0) {
+		fprintf(stderr, "init closed the connection without a result\n");
+		exit(EXIT_FAILURE);
+	}
+	result[n] = '\0';
+	printf("%s", result);
+
+	p = strstr(result, "status=");
+	status = (p != NULL) ? atoi(p + strlen("status=")) : EXIT_FAILURE;
+	exit(status);
+}
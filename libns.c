@@ -0,0 +1,1863 @@
+/* libns.c
+ *
+ * Code shared by the launchers; see libns.h
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include "libns.h"
+
+static __thread char error_buf[256];
+
+const char *ns_error(void) {
+	return error_buf;
+}
+
+// Record a failure: message from `fmt`, and errno set to `err`
+static void set_error(int err, const char *fmt, ...) {
+	va_list	ap;
+
+	va_start(ap, fmt);
+	vsnprintf(error_buf, sizeof(error_buf), fmt, ap);
+	va_end(ap);
+	errno = err;
+}
+
+/* Stack pools */
+
+struct ns_stack_pool {
+	pthread_mutex_t	lock;
+	size_t	size;		// usable size of each stack
+	size_t	guard;		// size of the guard area below it
+	int	nfree;
+	int	max_free;
+	void	**free;		// released stacks, ready for reuse
+};
+
+struct ns_stack_pool *ns_stack_pool_create(size_t stack_size, int max_free) {
+	struct ns_stack_pool *pool;
+	long page;
+
+	page = sysconf(_SC_PAGESIZE);
+	pool = calloc(1, sizeof(struct ns_stack_pool));
+	if (pool == NULL || max_free < 0) {
+		free(pool);
+		set_error(pool ? EINVAL : ENOMEM, "cannot create stack pool");
+		return NULL;
+	}
+
+	pool->size = (stack_size + page - 1) / page * page;
+	pool->guard = page;
+	pool->max_free = max_free;
+	pool->free = calloc(max_free > 0 ? max_free : 1, sizeof(void *));
+	if (pool->free == NULL) {
+		free(pool);
+		set_error(ENOMEM, "cannot create stack pool");
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+void ns_stack_pool_destroy(struct ns_stack_pool *pool) {
+	int j;
+
+	for (j = 0; j < pool->nfree; j++)
+		munmap((char *) pool->free[j] - pool->guard,
+		       pool->guard + pool->size);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->free);
+	free(pool);
+}
+
+void *ns_stack_get(struct ns_stack_pool *pool) {
+	char *mem;
+
+	pthread_mutex_lock(&pool->lock);
+	mem = (pool->nfree > 0) ? pool->free[--pool->nfree] : NULL;
+	pthread_mutex_unlock(&pool->lock);
+	if (mem != NULL)
+		return mem;
+
+	// A new stack: the guard page below it catches overflows, which
+	// would otherwise run silently into whatever is mapped there
+	mem = mmap(NULL, pool->guard + pool->size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (mem == MAP_FAILED) {
+		set_error(errno, "mmap stack: %s", strerror(errno));
+		return NULL;
+	}
+	if (mprotect(mem, pool->guard, PROT_NONE) == -1) {
+		set_error(errno, "mprotect guard page: %s", strerror(errno));
+		munmap(mem, pool->guard + pool->size);
+		return NULL;
+	}
+
+	return mem + pool->guard;
+}
+
+void ns_stack_put(struct ns_stack_pool *pool, void *stack) {
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nfree < pool->max_free) {
+		pool->free[pool->nfree++] = stack;
+		stack = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (stack != NULL)
+		munmap((char *) stack - pool->guard, pool->guard + pool->size);
+}
+
+size_t ns_stack_size(struct ns_stack_pool *pool) {
+	return pool->size;
+}
+
+static struct ns_stack_pool *default_pool;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void default_init(void) {
+	default_pool = ns_stack_pool_create(NS_STACK_SIZE, 64);
+}
+
+struct ns_stack_pool *ns_default_stacks(void) {
+	pthread_once(&default_once, default_init);
+	if (default_pool == NULL)
+		set_error(ENOMEM, "cannot create stack pool");
+	return default_pool;
+}
+
+pid_t ns_clone(int (*fn)(void *), void *arg, int flags) {
+	struct ns_stack_pool *pool;
+	char	*stack;
+	pid_t	pid;
+	int saved_errno;
+
+	if ((flags & CLONE_VM) && !(flags & CLONE_VFORK)) {
+		set_error(EINVAL, "CLONE_VM needs CLONE_VFORK");
+		return -1;
+	}
+
+	pool = ns_default_stacks();
+	if (pool == NULL)
+		return -1;
+	stack = ns_stack_get(pool);
+	if (stack == NULL)
+		return -1;
+
+	pid = clone(fn, stack + pool->size, flags | SIGCHLD, arg);
+	saved_errno = errno;
+	ns_stack_put(pool, stack);
+
+	if (pid == -1)
+		set_error(saved_errno, "clone: %s", strerror(saved_errno));
+	return pid;
+}
+
+/* Namespace types */
+
+const struct ns_type ns_types[NS_TYPES] = {
+	{ 'U', CLONE_NEWUSER,	"user" },
+	{ 'c', CLONE_NEWCGROUP,	"cgroup" },
+	{ 'i', CLONE_NEWIPC,	"ipc" },
+	{ 'u', CLONE_NEWUTS,	"uts" },
+	{ 'n', CLONE_NEWNET,	"net" },
+	{ 'p', CLONE_NEWPID,	"pid" },
+	{ 'T', CLONE_NEWTIME,	"time" },
+	{ 'm', CLONE_NEWNS,	"mnt" },
+};
+
+int ns_parse_letters(const char *letters, int allowed) {
+	int flags, j;
+
+	for (flags = 0; *letters != '\0'; letters++) {
+		for (j = 0; j < NS_TYPES && ns_types[j].letter != *letters; j++)
+			continue;
+		if (j == NS_TYPES || !(ns_types[j].flag & allowed)) {
+			set_error(EINVAL, "bad namespace type '%c'", *letters);
+			return -1;
+		}
+		flags |= ns_types[j].flag;
+	}
+
+	return flags;
+}
+
+int ns_foreign(pid_t pid, int flags) {
+	char	path[64];
+	struct stat	self, other;
+	int j;
+
+	for (j = 0; j < NS_TYPES; j++) {
+		if (!(flags & ns_types[j].flag))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/self/ns/%s", ns_types[j].name);
+		if (stat(path, &self) == -1) {
+			if (errno == ENOENT)		// not in this kernel
+				flags &= ~ns_types[j].flag;
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%ld/ns/%s", (long) pid,
+			 ns_types[j].name);
+		if (stat(path, &other) == 0 && self.st_dev == other.st_dev &&
+		    self.st_ino == other.st_ino)
+			flags &= ~ns_types[j].flag;
+	}
+
+	return flags;
+}
+
+int ns_open(pid_t pid, int flags, int fds[NS_TYPES]) {
+	char	path[64];
+	int j, saved_errno;
+
+	for (j = 0; j < NS_TYPES; j++)
+		fds[j] = -1;
+
+	for (j = 0; j < NS_TYPES; j++) {
+		if (!(flags & ns_types[j].flag))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%ld/ns/%s", (long) pid,
+			 ns_types[j].name);
+		fds[j] = open(path, O_RDONLY | O_CLOEXEC);
+		if (fds[j] == -1) {
+			saved_errno = errno;
+			while (--j >= 0)
+				if (fds[j] != -1) {
+					close(fds[j]);
+					fds[j] = -1;
+				}
+			set_error(saved_errno, "open %s: %s", path,
+				  strerror(saved_errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int join_by_files(pid_t pid, int flags) {
+	int fds[NS_TYPES];
+	int j, ret;
+
+	if (ns_open(pid, flags, fds) == -1)
+		return -1;
+
+	for (ret = 0, j = 0; j < NS_TYPES; j++) {
+		if (fds[j] == -1)
+			continue;
+		if (ret == 0 && setns(fds[j], ns_types[j].flag) == -1) {
+			set_error(errno, "setns %s: %s", ns_types[j].name,
+				  strerror(errno));
+			ret = -1;
+		}
+		close(fds[j]);
+	}
+
+	return ret;
+}
+
+/* Returns 0, 1 if the kernel can't join through a pidfd (no pidfd_open(),
+   or a setns() that wants a namespace file), or -1 */
+static int join_by_pidfd(pid_t pid, int flags) {
+	int pidfd, ret, saved_errno;
+
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd == -1) {
+		set_error(errno, "pidfd_open: %s", strerror(errno));
+		return (errno == ENOSYS) ? 1 : -1;
+	}
+
+	ret = setns(pidfd, flags);
+	saved_errno = errno;
+	close(pidfd);
+
+	if (ret == -1) {
+		set_error(saved_errno, "setns on pidfd: %s", strerror(saved_errno));
+		return (saved_errno == EINVAL) ? 1 : -1;
+	}
+	return 0;
+}
+
+int ns_join(pid_t pid, int flags, int how) {
+	int ret;
+
+	if (flags == 0)
+		return 0;
+
+	ret = 1;
+	if (how & NS_JOIN_PIDFD)
+		ret = join_by_pidfd(pid, flags);
+	if (ret == 1 && (how & NS_JOIN_FILES))
+		ret = join_by_files(pid, flags);
+
+	return (ret == 0) ? 0 : -1;
+}
+
+/* Processes */
+
+#define DENTS_SIZE	(256 * 1024)	// getdents64() buffer
+
+struct linux_dirent64 {
+	ino64_t	d_ino;
+	off64_t	d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char	d_name[];
+};
+
+int ns_list_pids(int proc_fd, void (*fn)(pid_t pid, void *arg), void *arg) {
+	struct linux_dirent64	*d;
+	char	*dents, *p;
+	long	n, off;
+	pid_t	pid;
+
+	if (lseek(proc_fd, 0, SEEK_SET) == -1) {
+		set_error(errno, "lseek /proc: %s", strerror(errno));
+		return -1;
+	}
+	dents = malloc(DENTS_SIZE);
+	if (dents == NULL) {
+		set_error(ENOMEM, "out of memory");
+		return -1;
+	}
+
+	while ((n = syscall(SYS_getdents64, proc_fd, dents, DENTS_SIZE)) > 0) {
+		for (off = 0; off < n; off += d->d_reclen) {
+			d = (struct linux_dirent64 *) (dents + off);
+			if (d->d_name[0] < '1' || d->d_name[0] > '9')
+				continue;
+			for (pid = 0, p = d->d_name; *p >= '0' && *p <= '9'; p++)
+				pid = pid * 10 + *p - '0';
+			if (*p == '\0')
+				fn(pid, arg);
+		}
+	}
+	if (n == -1)
+		set_error(errno, "getdents64 /proc: %s", strerror(errno));
+
+	free(dents);
+	return (n == -1) ? -1 : 0;
+}
+
+struct parallel {
+	int	n;
+	int	next;			// next index to take
+	void	(*fn)(int j, void *arg);
+	void	*arg;
+};
+
+static void *parallel_worker(void *arg) {
+	struct parallel *pl = arg;
+	int j, end;
+
+	while ((j = __atomic_fetch_add(&pl->next, NS_CHUNK, __ATOMIC_RELAXED)) <
+	       pl->n) {
+		end = (j + NS_CHUNK < pl->n) ? j + NS_CHUNK : pl->n;
+		for (; j < end; j++)
+			pl->fn(j, pl->arg);
+	}
+
+	return NULL;
+}
+
+void ns_parallel(int n, int nthreads, void (*fn)(int j, void *arg),
+		 void *arg) {
+	struct parallel	pl = { n, 0, fn, arg };
+	pthread_t	*tids;
+	int j, started;
+
+	tids = (nthreads > 1) ? calloc(nthreads, sizeof(pthread_t)) : NULL;
+	for (started = 0, j = 1; tids != NULL && j < nthreads; j++)
+		if (pthread_create(&tids[started], NULL, parallel_worker, &pl) == 0)
+			started++;
+	parallel_worker(&pl);
+	for (j = 0; j < started; j++)
+		pthread_join(tids[j], NULL);
+
+	free(tids);
+}
+
+/* UID and GID maps. Records are parsed into extents, sorted and merged
+   where they are adjacent or overlap consistently, checked against the
+   kernel's rules (and optionally /etc/subuid-style allowances), and
+   formatted so that they can be written to a map file in a single
+   write(). Fewer extents also keep the kernel's ID translation cheap. */
+
+struct id_extent {
+	uint32_t	inside;
+	uint32_t	outside;
+	uint64_t	count;		// 64 bits, so that ends don't overflow
+};
+
+// Parse the map string `spec` into a malloc()ed array; returns its length
+static int parse_map(const char *spec, struct id_extent **extp) {
+	struct id_extent	*ext, *bigger;
+	unsigned long long	in, out, cnt;
+	char	*copy, *rec, *saveptr, *end;
+	int n, size;
+
+	copy = strdup(spec);
+	if (copy == NULL) {
+		set_error(ENOMEM, "out of memory");
+		return -1;
+	}
+
+	ext = NULL;
+	n = size = 0;
+	for (rec = strtok_r(copy, ",\n", &saveptr); rec != NULL;
+	     rec = strtok_r(NULL, ",\n", &saveptr)) {
+		if (strspn(rec, " \t") == strlen(rec))
+			continue;
+
+		errno = 0;
+		in = strtoull(rec, &end, 10);
+		out = strtoull(end, &end, 10);
+		cnt = strtoull(end, &end, 10);
+		if (errno != 0 || *end != '\0' || strchr(rec, '-') != NULL) {
+			set_error(EINVAL, "bad record: '%s'", rec);
+			goto fail;
+		}
+		// The kernel wants first + count to fit in 32 bits, on both sides
+		if (cnt == 0 || in + cnt >= 1ULL << 32 || out + cnt >= 1ULL << 32) {
+			set_error(EINVAL, "range out of bounds: '%s'", rec);
+			goto fail;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			bigger = realloc(ext, size * sizeof(struct id_extent));
+			if (bigger == NULL) {
+				set_error(ENOMEM, "out of memory");
+				goto fail;
+			}
+			ext = bigger;
+		}
+		ext[n].inside = in;
+		ext[n].outside = out;
+		ext[n].count = cnt;
+		n++;
+	}
+
+	free(copy);
+	if (n == 0) {
+		set_error(EINVAL, "empty map");
+		free(ext);
+		return -1;
+	}
+
+	*extp = ext;
+	return n;
+
+fail:
+	free(copy);
+	free(ext);
+	return -1;
+}
+
+static int cmp_inside(const void *a, const void *b) {
+	const struct id_extent *x = a, *y = b;
+
+	return (x->inside > y->inside) - (x->inside < y->inside);
+}
+
+static int cmp_outside(const void *a, const void *b) {
+	const struct id_extent *x = a, *y = b;
+
+	return (x->outside > y->outside) - (x->outside < y->outside);
+}
+
+/* Sort `ext` by inside ID and merge extents that are adjacent, or
+   overlap, on both sides with the same offset. Anything else that
+   overlaps would be rejected by the kernel, so we reject it here, with a
+   better message. Returns the new number of extents */
+static int merge_map(struct id_extent *ext, int n) {
+	struct id_extent	*last;
+	uint64_t	end;
+	int j, m;
+
+	qsort(ext, n, sizeof(struct id_extent), cmp_inside);
+
+	for (m = 0, j = 0; j < n; j++) {
+		last = (m > 0) ? &ext[m - 1] : NULL;
+		if (last != NULL && last->inside + last->count >= ext[j].inside &&
+		    (int64_t) last->outside - last->inside ==
+		    (int64_t) ext[j].outside - ext[j].inside) {
+			end = ext[j].inside + ext[j].count;
+			if (end > last->inside + last->count)
+				last->count = end - last->inside;
+			continue;
+		}
+		if (last != NULL && last->inside + last->count > ext[j].inside) {
+			set_error(EINVAL, "inside ranges overlap");
+			return -1;
+		}
+		ext[m++] = ext[j];
+	}
+
+	// Merged extents can't overlap inside; they still must not outside
+	qsort(ext, m, sizeof(struct id_extent), cmp_outside);
+	for (j = 1; j < m; j++) {
+		if (ext[j - 1].outside + ext[j - 1].count > ext[j].outside) {
+			set_error(EINVAL, "outside ranges overlap");
+			return -1;
+		}
+	}
+
+	if (m > NS_MAP_MAX_EXTENTS) {
+		set_error(E2BIG, "%d extents after merging, the kernel allows %d",
+			  m, NS_MAP_MAX_EXTENTS);
+		return -1;
+	}
+
+	qsort(ext, m, sizeof(struct id_extent), cmp_inside);
+	return m;
+}
+
+/* Check that each outside range of `ext` is covered by `own_id` or by the
+   ranges given to the calling user in `allow_file` (/etc/subuid or
+   /etc/subgid, lines of the form "user:first:count") */
+static int check_allowed(struct id_extent *ext, int n,
+			 const char *allow_file, uid_t own_id) {
+	struct id_extent	allow[NS_MAP_MAX_EXTENTS + 1];
+	char	line[256], user[64], *name, *p;
+	unsigned long long	first, cnt;
+	struct passwd	*pw;
+	uint64_t	pos, end;
+	FILE	*fp;
+	int na, j, k;
+
+	pw = getpwuid(getuid());
+	snprintf(user, sizeof(user), "%ld", (long) getuid());
+
+	allow[0].outside = own_id;
+	allow[0].count = 1;
+	na = 1;
+
+	fp = fopen(allow_file, "r");
+	if (fp == NULL && errno != ENOENT) {
+		set_error(errno, "%s: %s", allow_file, strerror(errno));
+		return -1;
+	}
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL &&
+	       na <= NS_MAP_MAX_EXTENTS) {
+		name = strtok_r(line, ":", &p);
+		if (name == NULL || (strcmp(name, user) != 0 &&
+				     (pw == NULL || strcmp(name, pw->pw_name) != 0)))
+			continue;
+		if (sscanf(p, "%llu:%llu", &first, &cnt) != 2 || cnt == 0 ||
+		    first + cnt > 1ULL << 32)
+			continue;
+		allow[na].outside = first;
+		allow[na].count = cnt;
+		na++;
+	}
+	if (fp != NULL)
+		fclose(fp);
+
+	qsort(allow, na, sizeof(struct id_extent), cmp_outside);
+
+	// Walk each extent forward through the sorted allowances
+	for (j = 0; j < n; j++) {
+		pos = ext[j].outside;
+		end = pos + ext[j].count;
+		for (k = 0; k < na && pos < end; k++)
+			if (allow[k].outside <= pos &&
+			    allow[k].outside + allow[k].count > pos)
+				pos = allow[k].outside + allow[k].count;
+		if (pos < end) {
+			set_error(EPERM, "outside IDs %llu-%llu are not allowed by %s",
+				  (unsigned long long) pos,
+				  (unsigned long long) end - 1, allow_file);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+char *ns_map_build(const char *spec, const char *allow_file, uid_t own_id,
+		   int *nrecords, int *nextents) {
+	struct id_extent	*ext;
+	size_t	size, len;
+	char	*text;
+	int n, m, j;
+
+	n = parse_map(spec, &ext);
+	if (n == -1)
+		return NULL;
+	m = merge_map(ext, n);
+	if (m == -1 || (allow_file != NULL &&
+			check_allowed(ext, m, allow_file, own_id) == -1)) {
+		free(ext);
+		return NULL;
+	}
+
+	size = (size_t) m * 34 + 1;		// "%u %u %llu\n" at most
+	text = malloc(size);
+	if (text == NULL) {
+		set_error(ENOMEM, "out of memory");
+		free(ext);
+		return NULL;
+	}
+	for (len = 0, j = 0; j < m; j++)
+		len += snprintf(text + len, size - len, "%u %u %llu\n",
+				ext[j].inside, ext[j].outside,
+				(unsigned long long) ext[j].count);
+	free(ext);
+
+	// The kernel takes the whole map in one write() of less than a page
+	if (len >= (size_t) sysconf(_SC_PAGESIZE)) {
+		set_error(E2BIG, "map text is %zu bytes, more than fits in one write",
+			  len);
+		free(text);
+		return NULL;
+	}
+
+	if (nrecords != NULL)
+		*nrecords = n;
+	if (nextents != NULL)
+		*nextents = m;
+	return text;
+}
+
+/* Network setup. Requests are built back to back in one buffer, each
+   with NLM_F_ACK, sent with a single sendmsg() and acknowledged in order;
+   the kernel handles the messages of a datagram one after the other, so
+   later requests can rely on earlier ones. The child end of the veth
+   pair is created with a fixed interface index, which is free in a new
+   namespace, so that the requests after it can refer to it. */
+
+#define NL_BATCH_SIZE	4096
+#define NL_BATCH_MAX	8		// requests in one batch
+#define CHILD_IFINDEX	1000		// index of NS_NET_CHILD_IF
+#define LOOPBACK_IFINDEX	1	// always lo's index in a namespace
+
+struct nl_batch {
+	char	buf[NL_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	size_t	len;
+	int	nmsgs;
+	const char	*what[NL_BATCH_MAX];	// each request, for errors
+};
+
+// Start a new request of `type` whose fixed part is `body`
+static struct nlmsghdr *nl_msg(struct nl_batch *b, int type, int flags,
+			       const void *body, size_t len, const char *what) {
+	struct nlmsghdr *h;
+
+	h = (struct nlmsghdr *) (b->buf + b->len);
+	h->nlmsg_len = NLMSG_LENGTH(len);
+	h->nlmsg_type = type;
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	h->nlmsg_seq = b->nmsgs;
+	h->nlmsg_pid = 0;
+	memcpy(NLMSG_DATA(h), body, len);
+
+	b->what[b->nmsgs++] = what;
+	b->len += NLMSG_ALIGN(h->nlmsg_len);
+	return h;
+}
+
+/* Append an attribute to request `h`, the last one in the batch. A
+   nested attribute is opened with `data` NULL and closed by nl_end() */
+static struct rtattr *nl_attr(struct nl_batch *b, struct nlmsghdr *h,
+			      int type, const void *data, size_t len) {
+	struct rtattr *rta;
+
+	rta = (struct rtattr *) ((char *) h + NLMSG_ALIGN(h->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (data != NULL)
+		memcpy(RTA_DATA(rta), data, len);
+
+	h->nlmsg_len = NLMSG_ALIGN(h->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	b->len = (char *) h - b->buf + NLMSG_ALIGN(h->nlmsg_len);
+	return rta;
+}
+
+static void nl_end(struct nlmsghdr *h, struct rtattr *nest) {
+	nest->rta_len = (char *) h + h->nlmsg_len - (char *) nest;
+}
+
+// Set the link `index` up
+static void nl_link_up(struct nl_batch *b, int index, const char *what) {
+	struct ifinfomsg ifi;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = index;
+	ifi.ifi_flags = IFF_UP;
+	ifi.ifi_change = IFF_UP;
+	nl_msg(b, RTM_NEWLINK, 0, &ifi, sizeof(ifi), what);
+}
+
+static void nl_addr(struct nl_batch *b, int index, struct in_addr addr,
+		    int prefix, const char *what) {
+	struct ifaddrmsg ifa;
+	struct nlmsghdr	*h;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = AF_INET;
+	ifa.ifa_prefixlen = prefix;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = index;
+	h = nl_msg(b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, &ifa, sizeof(ifa),
+		   what);
+	nl_attr(b, h, IFA_LOCAL, &addr, sizeof(addr));
+	nl_attr(b, h, IFA_ADDRESS, &addr, sizeof(addr));
+}
+
+/* Send the batch on `fd` and collect one acknowledgement per request.
+   Returns 0, or -1 for the first request that failed */
+static int nl_run(int fd, struct nl_batch *b) {
+	struct sockaddr_nl	kernel = { .nl_family = AF_NETLINK };
+	char	reply[NL_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsgerr	*e;
+	struct nlmsghdr	*h;
+	ssize_t	n;
+	int acked, err;
+
+	if (sendto(fd, b->buf, b->len, 0, (struct sockaddr *) &kernel,
+		   sizeof(kernel)) != (ssize_t) b->len) {
+		set_error(errno, "netlink send: %s", strerror(errno));
+		return -1;
+	}
+
+	err = 0;
+	for (acked = 0; acked < b->nmsgs; ) {
+		n = recv(fd, reply, sizeof(reply), 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			set_error(errno, "netlink receive: %s", strerror(errno));
+			return -1;
+		}
+		for (h = (struct nlmsghdr *) reply; NLMSG_OK(h, n);
+		     h = NLMSG_NEXT(h, n)) {
+			if (h->nlmsg_type != NLMSG_ERROR)
+				continue;
+			acked++;
+			e = NLMSG_DATA(h);
+			if (e->error != 0 && err == 0 &&
+			    h->nlmsg_seq < (unsigned) b->nmsgs) {
+				err = -e->error;
+				set_error(err, "%s: %s", b->what[h->nlmsg_seq],
+					  strerror(err));
+			}
+		}
+	}
+
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int nl_open(void) {
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+		set_error(errno, "netlink socket: %s", strerror(errno));
+	return fd;
+}
+
+int ns_net_parse(const char *spec, struct ns_net *net) {
+	char	copy[128], *field[4] = { NULL }, *slash, *saveptr;
+	int n;
+
+	memset(net, 0, sizeof(struct ns_net));
+	if (strcmp(spec, "lo") == 0)
+		return 0;
+
+	if (strlen(spec) >= sizeof(copy))
+		goto bad;
+	strcpy(copy, spec);
+	field[0] = strtok_r(copy, ":", &saveptr);
+	for (n = 1; n < 4 && field[n - 1] != NULL; n++)
+		field[n] = strtok_r(NULL, ":", &saveptr);
+	if (field[3] == NULL || strtok_r(NULL, ":", &saveptr) != NULL ||
+	    strcmp(field[0], "veth") != 0)
+		goto bad;
+
+	if (strlen(field[1]) >= IFNAMSIZ) {
+		set_error(EINVAL, "interface name too long: '%s'", field[1]);
+		return -1;
+	}
+	strcpy(net->host_if, field[1]);
+
+	slash = strchr(field[2], '/');
+	if (slash == NULL)
+		goto bad;
+	*slash = '\0';
+	net->prefix = atoi(slash + 1);
+	if (inet_pton(AF_INET, field[2], &net->addr) != 1 ||
+	    inet_pton(AF_INET, field[3], &net->gateway) != 1 ||
+	    net->prefix < 1 || net->prefix > 30)
+		goto bad;
+
+	net->veth = 1;
+	return 0;
+
+bad:
+	set_error(EINVAL, "bad network spec: '%s'", spec);
+	return -1;
+}
+
+// The host end's name for child `pid`: the first "%d" becomes the PID
+static int host_if_name(const struct ns_net *net, pid_t pid,
+			char name[IFNAMSIZ]) {
+	const char *p;
+	int n;
+
+	p = strstr(net->host_if, "%d");
+	if (p == NULL)
+		n = snprintf(name, IFNAMSIZ, "%s", net->host_if);
+	else
+		n = snprintf(name, IFNAMSIZ, "%.*s%ld%s", (int) (p - net->host_if),
+			     net->host_if, (long) pid, p + 2);
+	if (n >= IFNAMSIZ) {
+		set_error(EINVAL, "interface name too long for PID %ld",
+			  (long) pid);
+		return -1;
+	}
+	return 0;
+}
+
+/* Open a NETLINK_ROUTE socket in the network namespace of `pid`. The
+   socket stays in that namespace after we have switched back */
+static int nl_open_in(pid_t pid, int self_fd) {
+	char	path[64];
+	int ns_fd, fd, saved_errno;
+
+	snprintf(path, sizeof(path), "/proc/%ld/ns/net", (long) pid);
+	ns_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (ns_fd == -1) {
+		set_error(errno, "open %s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (setns(ns_fd, CLONE_NEWNET) == -1) {
+		set_error(errno, "setns %s: %s", path, strerror(errno));
+		close(ns_fd);
+		return -1;
+	}
+	close(ns_fd);
+
+	fd = nl_open();
+	saved_errno = errno;
+	if (setns(self_fd, CLONE_NEWNET) == -1) {
+		// We can't go on in the wrong namespace
+		perror("setns back to our network namespace");
+		abort();
+	}
+	errno = saved_errno;
+
+	return fd;
+}
+
+int ns_net_setup(pid_t pid, const struct ns_net *net) {
+	struct nl_batch	*b;
+	struct ifinfomsg	ifi;
+	struct rtmsg	rtm;
+	struct nlmsghdr	*h;
+	struct rtattr	*linkinfo, *data, *peer;
+	char	host_if[IFNAMSIZ];
+	int self_fd, fd, ret, host_index, child_index;
+
+	if (net->veth && host_if_name(net, pid, host_if) == -1)
+		return -1;
+
+	b = malloc(sizeof(struct nl_batch));
+	if (b == NULL) {
+		set_error(ENOMEM, "out of memory");
+		return -1;
+	}
+
+	ret = -1;
+	fd = -1;
+	self_fd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+	if (self_fd == -1) {
+		set_error(errno, "open /proc/thread-self/ns/net: %s",
+			  strerror(errno));
+		goto out;
+	}
+	fd = nl_open_in(pid, self_fd);
+	if (fd == -1)
+		goto out;
+
+	// Everything inside the namespace: one batch
+	memset(b, 0, sizeof(struct nl_batch));
+	nl_link_up(b, LOOPBACK_IFINDEX, "lo up");
+
+	if (net->veth) {
+		// The pair is created in there, and its peer pushed out to us
+		child_index = CHILD_IFINDEX;
+		memset(&ifi, 0, sizeof(ifi));
+		ifi.ifi_family = AF_UNSPEC;
+		ifi.ifi_index = child_index;
+		h = nl_msg(b, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &ifi,
+			   sizeof(ifi), "create veth pair");
+		nl_attr(b, h, IFLA_IFNAME, NS_NET_CHILD_IF,
+			sizeof(NS_NET_CHILD_IF));
+		linkinfo = nl_attr(b, h, IFLA_LINKINFO, NULL, 0);
+		nl_attr(b, h, IFLA_INFO_KIND, "veth", sizeof("veth"));
+		data = nl_attr(b, h, IFLA_INFO_DATA, NULL, 0);
+		ifi.ifi_index = 0;
+		peer = nl_attr(b, h, VETH_INFO_PEER, &ifi, sizeof(ifi));
+		nl_attr(b, h, IFLA_IFNAME, host_if, strlen(host_if) + 1);
+		nl_attr(b, h, IFLA_NET_NS_FD, &self_fd, sizeof(self_fd));
+		nl_end(h, peer);
+		nl_end(h, data);
+		nl_end(h, linkinfo);
+
+		nl_addr(b, child_index, net->addr, net->prefix,
+			"address " NS_NET_CHILD_IF);
+		nl_link_up(b, child_index, NS_NET_CHILD_IF " up");
+
+		memset(&rtm, 0, sizeof(rtm));
+		rtm.rtm_family = AF_INET;
+		rtm.rtm_table = RT_TABLE_MAIN;
+		rtm.rtm_protocol = RTPROT_BOOT;
+		rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+		rtm.rtm_type = RTN_UNICAST;
+		h = nl_msg(b, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, &rtm,
+			   sizeof(rtm), "default route");
+		nl_attr(b, h, RTA_GATEWAY, &net->gateway, sizeof(net->gateway));
+		nl_attr(b, h, RTA_OIF, &child_index, sizeof(child_index));
+	}
+
+	if (nl_run(fd, b) == -1)
+		goto out;
+
+	if (net->veth) {
+		// The host end: a second batch, on a socket of our own
+		close(fd);
+		fd = nl_open();
+		host_index = if_nametoindex(host_if);
+		if (fd == -1 || host_index == 0) {
+			if (fd != -1)
+				set_error(errno, "%s: %s", host_if, strerror(errno));
+			goto out;
+		}
+
+		memset(b, 0, sizeof(struct nl_batch));
+		nl_addr(b, host_index, net->gateway, net->prefix, "address host end");
+		nl_link_up(b, host_index, "host end up");
+		if (nl_run(fd, b) == -1)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	if (fd != -1)
+		close(fd);
+	if (self_fd != -1)
+		close(self_fd);
+	free(b);
+	return ret;
+}
+
+/* Root filesystems */
+
+struct ns_mount {
+	char	*type;		// filesystem type, or NULL for a bind mount
+	char	*source;
+	char	*target;
+	char	*options;	// filesystem options, comma separated, or NULL
+	unsigned	attr;	// MOUNT_ATTR_* flags
+	int	recursive;	// rbind
+};
+
+struct ns_rootfs {
+	int	n;
+	struct ns_mount	m[NS_ROOTFS_MAX];
+	char	*text;		// the list, which the fields above point into
+};
+
+static const struct {
+	const char	*name;
+	unsigned	attr;		// for the new mount API
+	unsigned long	ms;		// for mount(2)
+} mount_attrs[] = {
+	{ "ro",		MOUNT_ATTR_RDONLY,	MS_RDONLY },
+	{ "nosuid",	MOUNT_ATTR_NOSUID,	MS_NOSUID },
+	{ "nodev",	MOUNT_ATTR_NODEV,	MS_NODEV },
+	{ "noexec",	MOUNT_ATTR_NOEXEC,	MS_NOEXEC },
+	{ "noatime",	MOUNT_ATTR_NOATIME,	MS_NOATIME },
+};
+#define NATTRS	(sizeof(mount_attrs) / sizeof(mount_attrs[0]))
+
+/* Split OPTIONS into mount attributes and filesystem options; the latter
+   are compacted in place */
+static int parse_mount_options(struct ns_mount *m, char *opts, int line) {
+	char	*opt, *saveptr, *out;
+	size_t	j;
+
+	m->options = NULL;
+	if (opts == NULL || strcmp(opts, "-") == 0)
+		return 0;
+
+	out = opts;
+	for (opt = strtok_r(opts, ",", &saveptr); opt != NULL;
+	     opt = strtok_r(NULL, ",", &saveptr)) {
+		for (j = 0; j < NATTRS; j++)
+			if (strcmp(opt, mount_attrs[j].name) == 0)
+				break;
+		if (j < NATTRS) {
+			m->attr |= mount_attrs[j].attr;
+			continue;
+		}
+		if (m->type == NULL) {
+			set_error(EINVAL, "line %d: bind mounts take no option '%s'",
+				  line, opt);
+			return -1;
+		}
+		if (out != opts)
+			*out++ = ',';
+		memmove(out, opt, strlen(opt) + 1);
+		out += strlen(out);
+		m->options = opts;
+	}
+
+	return 0;
+}
+
+/* Read the file `path` into a malloc()ed, NUL-terminated string. Returns
+   NULL on failure */
+static char *read_text(const char *path) {
+	char	*text;
+	FILE	*fp;
+	long	size;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		set_error(errno, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+	text = NULL;
+	if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1 ||
+	    fseek(fp, 0, SEEK_SET) == -1 ||
+	    (text = malloc(size + 1)) == NULL ||
+	    fread(text, 1, size, fp) != (size_t) size) {
+		set_error(EIO, "%s: cannot read", path);
+		free(text);
+		text = NULL;
+	} else {
+		text[size] = '\0';
+	}
+	fclose(fp);
+	return text;
+}
+
+/* Parse the mount list in fs->text, which the mounts then point into.
+   `path` names the list in messages */
+static int rootfs_parse(struct ns_rootfs *fs, const char *path) {
+	struct ns_mount	*m;
+	char	*line, *next, *field[5], *saveptr;
+	int lineno, n;
+
+	for (line = fs->text, lineno = 1; line != NULL; line = next, lineno++) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		memset(field, 0, sizeof(field));
+		field[0] = strtok_r(line, " \t", &saveptr);
+		if (field[0] == NULL || field[0][0] == '#')
+			continue;
+		for (n = 1; n < 5 && field[n - 1] != NULL; n++)
+			field[n] = strtok_r(NULL, " \t", &saveptr);
+		if (field[2] == NULL || field[4] != NULL || field[2][0] != '/') {
+			set_error(EINVAL, "%s:%d: expected TYPE SOURCE /TARGET [OPTIONS]",
+				  path, lineno);
+			return -1;
+		}
+		if ((fs->n == 0) != (strcmp(field[2], "/") == 0)) {
+			set_error(EINVAL, "%s:%d: the first mount, and only it, "
+				  "must be the root", path, lineno);
+			return -1;
+		}
+		if (fs->n == NS_ROOTFS_MAX) {
+			set_error(E2BIG, "%s: more than %d mounts", path,
+				  NS_ROOTFS_MAX);
+			return -1;
+		}
+
+		m = &fs->m[fs->n++];
+		m->recursive = strcmp(field[0], "rbind") == 0;
+		m->type = (m->recursive || strcmp(field[0], "bind") == 0) ?
+			  NULL : field[0];
+		m->source = field[1];
+		m->target = field[2];
+		if (parse_mount_options(m, field[3], lineno) == -1)
+			return -1;
+	}
+
+	if (fs->n == 0) {
+		set_error(EINVAL, "%s: no mounts", path);
+		return -1;
+	}
+	return 0;
+}
+
+struct ns_rootfs *ns_rootfs_load(const char *path) {
+	struct ns_rootfs	*fs;
+
+	fs = calloc(1, sizeof(struct ns_rootfs));
+	if (fs == NULL) {
+		set_error(ENOMEM, "%s: out of memory", path);
+		return NULL;
+	}
+	fs->text = read_text(path);
+	if (fs->text == NULL || rootfs_parse(fs, path) == -1) {
+		ns_rootfs_free(fs);
+		return NULL;
+	}
+	return fs;
+}
+
+void ns_rootfs_free(struct ns_rootfs *fs) {
+	free(fs->text);
+	free(fs);
+}
+
+// Create directory `path` (relative, "a/b/c") below `dirfd`, as mkdir -p
+static int mkdir_below(int dirfd, const char *path) {
+	char	buf[PATH_MAX], *p;
+
+	if (strlen(path) >= sizeof(buf)) {
+		set_error(ENAMETOOLONG, "%s: path too long", path);
+		return -1;
+	}
+	strcpy(buf, path);
+	for (p = strchr(buf, '/'); ; p = strchr(p + 1, '/')) {
+		if (p != NULL)
+			*p = '\0';
+		if (buf[0] != '\0' && mkdirat(dirfd, buf, 0755) == -1 &&
+		    errno != EEXIST) {
+			set_error(errno, "mkdir %s: %s", buf, strerror(errno));
+			return -1;
+		}
+		if (p == NULL)
+			return 0;
+		*p = '/';
+	}
+}
+
+// Make the mount list's mount `m`, detached; returns a mount fd
+static int make_mount(const struct ns_mount *m) {
+	struct mount_attr	attr;
+	char	*opts, *opt, *eq, *saveptr;
+	char	buf[PATH_MAX];
+	int fsfd, mfd;
+
+	if (m->type == NULL) {
+		mfd = open_tree(AT_FDCWD, m->source, OPEN_TREE_CLONE |
+				OPEN_TREE_CLOEXEC | (m->recursive ? AT_RECURSIVE : 0));
+		if (mfd == -1) {
+			set_error(errno, "open_tree %s: %s", m->source,
+				  strerror(errno));
+			return -1;
+		}
+		memset(&attr, 0, sizeof(attr));
+		attr.attr_set = m->attr;
+		if (m->attr != 0 &&
+		    mount_setattr(mfd, "", AT_EMPTY_PATH |
+				  (m->recursive ? AT_RECURSIVE : 0),
+				  &attr, sizeof(attr)) == -1) {
+			set_error(errno, "mount_setattr %s: %s", m->target,
+				  strerror(errno));
+			close(mfd);
+			return -1;
+		}
+		return mfd;
+	}
+
+	fsfd = fsopen(m->type, FSOPEN_CLOEXEC);
+	if (fsfd == -1) {
+		set_error(errno, "fsopen %s: %s", m->type, strerror(errno));
+		return -1;
+	}
+	if (fsconfig(fsfd, FSCONFIG_SET_STRING,
+		     strcmp(m->type, "overlay") == 0 ? "lowerdir" : "source",
+		     m->source, 0) == -1)
+		goto fail;
+
+	// Each filesystem option is its own fsconfig() call
+	if (m->options != NULL) {
+		if (strlen(m->options) >= sizeof(buf)) {
+			errno = E2BIG;
+			goto fail;
+		}
+		opts = strcpy(buf, m->options);
+		for (opt = strtok_r(opts, ",", &saveptr); opt != NULL;
+		     opt = strtok_r(NULL, ",", &saveptr)) {
+			eq = strchr(opt, '=');
+			if (eq != NULL)
+				*eq++ = '\0';
+			if (fsconfig(fsfd, eq ? FSCONFIG_SET_STRING : FSCONFIG_SET_FLAG,
+				     opt, eq, 0) == -1)
+				goto fail;
+		}
+	}
+	if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1)
+		goto fail;
+
+	mfd = fsmount(fsfd, FSMOUNT_CLOEXEC, m->attr);
+	if (mfd == -1)
+		goto fail;
+	close(fsfd);
+	return mfd;
+
+fail:
+	set_error(errno, "%s on %s: %s", m->type, m->target, strerror(errno));
+	close(fsfd);
+	return -1;
+}
+
+/* Make mount `m` with mount(2) on `path`. Attributes of a bind mount
+   take a second, remounting call */
+static int legacy_mount(const struct ns_mount *m, const char *path) {
+	char	data[PATH_MAX];
+	unsigned long	flags;
+	size_t	j;
+
+	for (flags = 0, j = 0; j < NATTRS; j++)
+		if (m->attr & mount_attrs[j].attr)
+			flags |= mount_attrs[j].ms;
+
+	if (m->type == NULL) {
+		if (mount(m->source, path, NULL,
+			  MS_BIND | (m->recursive ? MS_REC : 0), NULL) == -1 ||
+		    (flags != 0 && mount(NULL, path, NULL,
+					 MS_REMOUNT | MS_BIND | flags, NULL) == -1))
+			goto fail;
+		return 0;
+	}
+
+	if (strcmp(m->type, "overlay") == 0)
+		j = snprintf(data, sizeof(data), "lowerdir=%s%s%s", m->source,
+			     m->options ? "," : "", m->options ? m->options : "");
+	else
+		j = snprintf(data, sizeof(data), "%s",
+			     m->options ? m->options : "");
+	if (j >= sizeof(data)) {
+		errno = E2BIG;
+		goto fail;
+	}
+	if (mount(m->source, path, m->type, flags, data) == -1)
+		goto fail;
+	return 0;
+
+fail:
+	set_error(errno, "mount %s: %s", m->target, strerror(errno));
+	return -1;
+}
+
+int ns_rootfs_setup(const struct ns_rootfs *fs, int flags) {
+	struct mount_attr	attr;
+	char	path[PATH_MAX];
+	int mfd[NS_ROOTFS_MAX];
+	int j, n, stage, ret;
+
+	ret = -1;
+	stage = -1;
+	n = 0;
+
+	// Nothing we do may propagate back to the parent's namespace
+	if (flags & NS_ROOTFS_LEGACY) {
+		if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1) {
+			set_error(errno, "make / private: %s", strerror(errno));
+			return -1;
+		}
+		if (legacy_mount(&fs->m[0], NS_ROOTFS_STAGE) == -1)
+			return -1;
+	} else {
+		memset(&attr, 0, sizeof(attr));
+		attr.propagation = MS_PRIVATE;
+		if (mount_setattr(AT_FDCWD, "/", AT_RECURSIVE, &attr,
+				  sizeof(attr)) == -1) {
+			set_error(errno, "make / private: %s", strerror(errno));
+			return -1;
+		}
+
+		// Everything is resolved and created before anything is attached
+		// (a list has at least the root)
+		do {
+			mfd[n] = make_mount(&fs->m[n]);
+			if (mfd[n] == -1)
+				goto out;
+		} while (++n < fs->n);
+		if (move_mount(mfd[0], "", AT_FDCWD, NS_ROOTFS_STAGE,
+			       MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+			set_error(errno, "move_mount root: %s", strerror(errno));
+			goto out;
+		}
+	}
+
+	stage = open(NS_ROOTFS_STAGE, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (stage == -1) {
+		set_error(errno, "open %s: %s", NS_ROOTFS_STAGE, strerror(errno));
+		goto out;
+	}
+
+	for (j = 1; j < fs->n; j++) {
+		if (mkdir_below(stage, fs->m[j].target + 1) == -1)
+			goto out;
+		if (flags & NS_ROOTFS_LEGACY) {
+			snprintf(path, sizeof(path), "%s%s", NS_ROOTFS_STAGE,
+				 fs->m[j].target);
+			if (legacy_mount(&fs->m[j], path) == -1)
+				goto out;
+		} else if (move_mount(mfd[j], "", stage, fs->m[j].target + 1,
+				      MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+			set_error(errno, "move_mount %s: %s", fs->m[j].target,
+				  strerror(errno));
+			goto out;
+		}
+	}
+
+	// Stack the old root under the new one, then detach it
+	if (fchdir(stage) == -1 ||
+	    syscall(SYS_pivot_root, ".", ".") == -1 ||
+	    umount2(".", MNT_DETACH) == -1 || chdir("/") == -1) {
+		set_error(errno, "pivot_root: %s", strerror(errno));
+		goto out;
+	}
+	ret = 0;
+
+out:
+	for (j = 0; j < n; j++)
+		close(mfd[j]);
+	if (stage != -1)
+		close(stage);
+	return ret;
+}
+
+/* Sandbox specs. A compiled spec is a header followed by the records and
+   strings it refers to, by byte offset from the start of the file (0
+   meaning none), each aligned to 8 bytes */
+
+#define SPEC_MAGIC	0x5053534e		// "NSSP"
+
+struct spec_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;		// of the whole file, a multiple of 8
+	uint32_t	checksum;	// see spec_checksum()
+	int32_t	flags;
+	uint32_t	uid_map, gid_map, hostname;	// strings
+	uint32_t	net;		// a struct spec_net
+	uint32_t	mounts, nmounts;	// struct spec_mount[]
+	uint32_t	limits, nlimits;	// struct spec_limit[]
+	uint32_t	pad;
+};
+
+struct spec_net {
+	uint32_t	veth;
+	uint32_t	prefix;
+	uint32_t	addr, gateway;	// network byte order
+	char	host_if[IFNAMSIZ];
+};
+
+struct spec_mount {
+	uint32_t	type, source, target, options;	// strings
+	uint32_t	attr;
+	uint32_t	recursive;
+};
+
+struct spec_limit {
+	uint32_t	resource;
+	uint32_t	pad;
+	uint64_t	cur, max;
+};
+
+// An open spec: what ns_spec_open() returns is its first member
+struct spec_handle {
+	struct ns_spec	spec;
+	void	*map;
+	size_t	size;
+	struct ns_net	net;
+	struct ns_rootfs	rootfs;
+	struct ns_limit	limits[NS_SPEC_LIMITS];
+};
+
+static const struct {
+	const char	*name;
+	int	resource;
+} spec_limit_names[] = {
+	{ "as", RLIMIT_AS }, { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU },
+	{ "data", RLIMIT_DATA }, { "fsize", RLIMIT_FSIZE },
+	{ "memlock", RLIMIT_MEMLOCK }, { "msgqueue", RLIMIT_MSGQUEUE },
+	{ "nice", RLIMIT_NICE }, { "nofile", RLIMIT_NOFILE },
+	{ "nproc", RLIMIT_NPROC }, { "rss", RLIMIT_RSS },
+	{ "rtprio", RLIMIT_RTPRIO }, { "rttime", RLIMIT_RTTIME },
+	{ "sigpending", RLIMIT_SIGPENDING }, { "stack", RLIMIT_STACK },
+};
+#define NLIMIT_NAMES	(sizeof(spec_limit_names) / sizeof(spec_limit_names[0]))
+
+/* Checksum of a whole compiled spec, `len` bytes (a multiple of 8), with
+   the header's checksum field taken as zero: FNV-1a taken a 64-bit word
+   at a time, which is several times faster than byte by byte and as good
+   at catching a damaged file */
+static uint32_t spec_checksum(const char *p, size_t len) {
+	const size_t	at = offsetof(struct spec_header, checksum);
+	uint64_t	h, w;
+	size_t	off;
+
+	h = 14695981039346656037ULL;
+	for (off = 0; off + 8 <= len; off += 8) {
+		memcpy(&w, p + off, 8);
+		if (off == at / 8 * 8)
+			memset((char *) &w + at % 8, 0, sizeof(uint32_t));
+		h = (h ^ w) * 1099511628211ULL;
+	}
+	return h ^ (h >> 32);
+}
+
+// A compiled spec being built
+struct spec_buf {
+	char	*data;
+	size_t	len, size;
+	int	nomem;		// an append failed
+};
+
+/* Append `len` bytes at `p` (or zeroes, if `p` is NULL) to `b`. Returns
+   their offset, or 0 (and sets b->nomem) if out of memory */
+static uint32_t spec_put(struct spec_buf *b, const void *p, size_t len) {
+	size_t	off;
+	char	*data;
+
+	off = (b->len + 7) & ~(size_t) 7;
+	if (b->nomem)
+		return 0;
+	if (off + len > b->size) {
+		data = realloc(b->data, (off + len) * 2);
+		if (data == NULL) {
+			b->nomem = 1;
+			return 0;
+		}
+		b->data = data;
+		b->size = (off + len) * 2;
+	}
+	memset(b->data + b->len, 0, off - b->len);
+	if (p != NULL)
+		memcpy(b->data + off, p, len);
+	else
+		memset(b->data + off, 0, len);
+	b->len = off + len;
+	return off;
+}
+
+// Append string `str` to `b` (NULL is none); 0 if out of memory
+static uint32_t spec_string(struct spec_buf *b, const char *str) {
+	return str ? spec_put(b, str, strlen(str) + 1) : 0;
+}
+
+// Prefix the last error with the spec line it is about
+static void spec_line_error(const char *path, int lineno) {
+	char	msg[sizeof(error_buf)];
+	int err = errno;
+
+	snprintf(msg, sizeof(msg), "%s", error_buf);
+	set_error(err, "%s:%d: %s", path, lineno, msg);
+}
+
+static int parse_limit(const char *path, int lineno, char *arg,
+		       struct spec_limit *l) {
+	char	*field[3], *saveptr, *end;
+	uint64_t	*value;
+	size_t	j;
+	int n;
+
+	for (n = 0; n < 3; n++)
+		field[n] = strtok_r(n ? NULL : arg, " \t", &saveptr);
+	if (field[2] == NULL || strtok_r(NULL, " \t", &saveptr) != NULL)
+		goto bad;
+
+	for (j = 0; j < NLIMIT_NAMES; j++)
+		if (strcmp(field[0], spec_limit_names[j].name) == 0)
+			break;
+	if (j == NLIMIT_NAMES)
+		goto bad;
+	l->resource = spec_limit_names[j].resource;
+
+	for (n = 1; n < 3; n++) {
+		value = (n == 1) ? &l->cur : &l->max;
+		if (strcmp(field[n], "unlimited") == 0) {
+			*value = RLIM_INFINITY;
+			continue;
+		}
+		errno = 0;
+		*value = strtoull(field[n], &end, 10);
+		if (errno != 0 || *end != '\0' || end == field[n])
+			goto bad;
+	}
+	if (l->cur > l->max)
+		goto bad;
+	return 0;
+
+bad:
+	set_error(EINVAL, "%s:%d: expected `limit RESOURCE SOFT HARD`, "
+		  "SOFT <= HARD", path, lineno);
+	return -1;
+}
+
+int ns_spec_compile(const char *text_path, const char *out_path) {
+	struct spec_header	hdr;
+	struct spec_limit	limits[NS_SPEC_LIMITS];
+	struct spec_mount	mounts[NS_ROOTFS_MAX];
+	struct spec_net	sn;
+	struct spec_buf	b;
+	struct ns_rootfs	*fs;
+	struct ns_net	net;
+	const char	*hostname;
+	char	*text, *line, *next, *key, *arg, *mline, *maps[2], tmp[PATH_MAX];
+	int lineno, nlimits, has_net, fd, ret, m, flags;
+
+	ret = -1;
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&b, 0, sizeof(b));
+	maps[0] = maps[1] = NULL;
+	hostname = NULL;
+	nlimits = 0;
+	has_net = 0;
+	fd = -1;
+
+	fs = calloc(1, sizeof(struct ns_rootfs));
+	text = read_text(text_path);
+	if (fs == NULL || text == NULL) {
+		if (fs == NULL)
+			set_error(ENOMEM, "out of memory");
+		goto out;
+	}
+
+	/* The mount lines are copied to a mount list of their own, with the
+	   other lines left empty, so that its line numbers are the spec's */
+	fs->text = calloc(1, strlen(text) + 2);
+	if (fs->text == NULL) {
+		set_error(ENOMEM, "out of memory");
+		goto out;
+	}
+	mline = fs->text;
+
+	for (line = text, lineno = 1; line != NULL; line = next, lineno++) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		key = line + strspn(line, " \t");
+		arg = key + strcspn(key, " \t");
+		if (*arg != '\0')
+			*arg++ = '\0';
+		arg += strspn(arg, " \t");
+
+		if (strcmp(key, "mount") == 0) {
+			strcpy(mline, arg);
+			mline += strlen(arg);
+		}
+		*mline++ = '\n';
+
+		if (key[0] == '\0' || key[0] == '#' || strcmp(key, "mount") == 0)
+			continue;
+
+		if (strcmp(key, "namespaces") == 0) {
+			flags = ns_parse_letters(arg, NS_CLONE);
+			if (flags == -1) {
+				spec_line_error(text_path, lineno);
+				goto out;
+			}
+			hdr.flags |= flags;
+		} else if (strcmp(key, "uid_map") == 0 ||
+			   strcmp(key, "gid_map") == 0) {
+			m = (key[0] == 'g');
+			free(maps[m]);
+			maps[m] = ns_map_build(arg, NULL, 0, NULL, NULL);
+			if (maps[m] == NULL) {
+				spec_line_error(text_path, lineno);
+				goto out;
+			}
+		} else if (strcmp(key, "hostname") == 0) {
+			if (arg[0] == '\0' || strlen(arg) > HOST_NAME_MAX) {
+				set_error(EINVAL, "%s:%d: bad hostname", text_path,
+					  lineno);
+				goto out;
+			}
+			hostname = arg;
+		} else if (strcmp(key, "net") == 0) {
+			if (ns_net_parse(arg, &net) == -1) {
+				spec_line_error(text_path, lineno);
+				goto out;
+			}
+			has_net = 1;
+		} else if (strcmp(key, "limit") == 0) {
+			if (nlimits == NS_SPEC_LIMITS) {
+				set_error(E2BIG, "%s: more than %d limits",
+					  text_path, NS_SPEC_LIMITS);
+				goto out;
+			}
+			if (parse_limit(text_path, lineno, arg,
+					&limits[nlimits++]) == -1)
+				goto out;
+		} else {
+			set_error(EINVAL, "%s:%d: unknown setting `%s`", text_path,
+				  lineno, key);
+			goto out;
+		}
+	}
+	*mline = '\0';
+
+	if (strspn(fs->text, "\n") != strlen(fs->text) &&
+	    rootfs_parse(fs, text_path) == -1)
+		goto out;
+
+	// Each setting needs the namespace it applies to
+	if (((maps[0] || maps[1]) && !(hdr.flags & CLONE_NEWUSER)) ||
+	    (hostname && !(hdr.flags & CLONE_NEWUTS)) ||
+	    (has_net && !(hdr.flags & CLONE_NEWNET)) ||
+	    (fs->n > 0 && !(hdr.flags & CLONE_NEWNS))) {
+		set_error(EINVAL, "%s: a setting lacks its namespace", text_path);
+		goto out;
+	}
+
+	// Lay out the file
+	spec_put(&b, NULL, sizeof(hdr));
+	if (has_net) {
+		memset(&sn, 0, sizeof(sn));
+		sn.veth = net.veth;
+		sn.prefix = net.prefix;
+		sn.addr = net.addr.s_addr;
+		sn.gateway = net.gateway.s_addr;
+		memcpy(sn.host_if, net.host_if, IFNAMSIZ);
+		hdr.net = spec_put(&b, &sn, sizeof(sn));
+	}
+	if (nlimits > 0) {
+		hdr.nlimits = nlimits;
+		hdr.limits = spec_put(&b, limits, nlimits * sizeof(limits[0]));
+	}
+	if (fs->n > 0) {
+		memset(mounts, 0, sizeof(mounts));
+		for (m = 0; m < fs->n; m++) {
+			mounts[m].type = spec_string(&b, fs->m[m].type);
+			mounts[m].source = spec_string(&b, fs->m[m].source);
+			mounts[m].target = spec_string(&b, fs->m[m].target);
+			mounts[m].options = spec_string(&b, fs->m[m].options);
+			mounts[m].attr = fs->m[m].attr;
+			mounts[m].recursive = fs->m[m].recursive;
+		}
+		hdr.nmounts = fs->n;
+		hdr.mounts = spec_put(&b, mounts, fs->n * sizeof(mounts[0]));
+	}
+	hdr.uid_map = spec_string(&b, maps[0]);
+	hdr.gid_map = spec_string(&b, maps[1]);
+	hdr.hostname = spec_string(&b, hostname);
+	spec_put(&b, NULL, 0);		// pad to a multiple of 8
+	if (b.nomem) {
+		set_error(ENOMEM, "out of memory");
+		goto out;
+	}
+
+	hdr.magic = SPEC_MAGIC;
+	hdr.version = NS_SPEC_VERSION;
+	hdr.size = b.len;
+	memcpy(b.data, &hdr, sizeof(hdr));
+	hdr.checksum = spec_checksum(b.data, b.len);
+	memcpy(b.data, &hdr, sizeof(hdr));
+
+	// Write a new file and rename it over the old one
+	if (out_path == NULL) {
+		ret = 0;
+		goto out;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%ld", out_path, (long) getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1 || write(fd, b.data, b.len) != (ssize_t) b.len ||
+	    fsync(fd) == -1 || rename(tmp, out_path) == -1) {
+		set_error(errno, "%s: %s", out_path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	if (fd != -1)
+		close(fd);
+	if (fs != NULL)
+		ns_rootfs_free(fs);
+	free(text);
+	free(maps[0]);
+	free(maps[1]);
+	free(b.data);
+	return ret;
+}
+
+/* Check that offset `off` of an open spec holds a NUL-terminated string,
+   and point `*str` at it (NULL for offset 0). Returns 0 or -1 */
+static int spec_str(struct spec_handle *h, uint32_t off, const char **str) {
+	*str = NULL;
+	if (off == 0)
+		return 0;
+	if (off < sizeof(struct spec_header) || off >= h->size ||
+	    memchr((char *) h->map + off, '\0', h->size - off) == NULL)
+		return -1;
+	*str = (char *) h->map + off;
+	return 0;
+}
+
+// Check that `n` records of `size` bytes fit at offset `off`
+static int spec_array(struct spec_handle *h, uint32_t off, uint32_t n,
+		      size_t size) {
+	return (off < sizeof(struct spec_header) || off >= h->size ||
+		off % 8 != 0 || (uint64_t) n * size > h->size - off) ? -1 : 0;
+}
+
+const struct ns_spec *ns_spec_open(const char *path) {
+	const struct spec_header	*hdr;
+	const struct spec_mount	*sm;
+	const struct spec_limit	*sl;
+	const struct spec_net	*sn;
+	struct spec_handle	*h;
+	struct ns_mount	*m;
+	struct stat	st;
+	uint32_t	j;
+	int fd;
+
+	h = calloc(1, sizeof(struct spec_handle));
+	if (h == NULL) {
+		set_error(ENOMEM, "out of memory");
+		return NULL;
+	}
+	h->map = MAP_FAILED;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		set_error(errno, "%s: %s", path, strerror(errno));
+		goto fail;
+	}
+	h->size = st.st_size;
+	if (h->size < sizeof(struct spec_header))
+		goto bad;
+	h->map = mmap(NULL, h->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (h->map == MAP_FAILED) {
+		set_error(errno, "%s: mmap: %s", path, strerror(errno));
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+
+	hdr = h->map;
+	if (hdr->magic != SPEC_MAGIC)
+		goto bad;
+	if (hdr->version != NS_SPEC_VERSION) {
+		set_error(EINVAL, "%s: spec version %u, expected %d", path,
+			  hdr->version, NS_SPEC_VERSION);
+		goto fail;
+	}
+	if (hdr->size != h->size || h->size % 8 != 0 ||
+	    hdr->checksum != spec_checksum(h->map, h->size)) {
+		set_error(EINVAL, "%s: bad checksum", path);
+		goto fail;
+	}
+
+	if (hdr->flags & ~NS_CLONE)
+		goto bad;
+	h->spec.flags = hdr->flags;
+	if (spec_str(h, hdr->uid_map, &h->spec.uid_map) == -1 ||
+	    spec_str(h, hdr->gid_map, &h->spec.gid_map) == -1 ||
+	    spec_str(h, hdr->hostname, &h->spec.hostname) == -1)
+		goto bad;
+
+	if (hdr->net != 0) {
+		if (spec_array(h, hdr->net, 1, sizeof(struct spec_net)) == -1)
+			goto bad;
+		sn = (const struct spec_net *) ((char *) h->map + hdr->net);
+		h->net.veth = sn->veth;
+		h->net.prefix = sn->prefix;
+		h->net.addr.s_addr = sn->addr;
+		h->net.gateway.s_addr = sn->gateway;
+		memcpy(h->net.host_if, sn->host_if, IFNAMSIZ);
+		h->net.host_if[IFNAMSIZ - 1] = '\0';
+		h->spec.net = &h->net;
+	}
+
+	if (hdr->nlimits > NS_SPEC_LIMITS ||
+	    (hdr->nlimits > 0 && spec_array(h, hdr->limits, hdr->nlimits,
+					    sizeof(struct spec_limit)) == -1))
+		goto bad;
+	sl = (const struct spec_limit *) ((char *) h->map + hdr->limits);
+	for (j = 0; j < hdr->nlimits; j++) {
+		if (sl[j].resource >= RLIM_NLIMITS)
+			goto bad;
+		h->limits[j].resource = sl[j].resource;
+		h->limits[j].rlim.rlim_cur = sl[j].cur;
+		h->limits[j].rlim.rlim_max = sl[j].max;
+	}
+	h->spec.limits = h->limits;
+	h->spec.nlimits = hdr->nlimits;
+
+	// The mounts point into the mapping, which ns_rootfs_setup() only reads
+	if (hdr->nmounts > NS_ROOTFS_MAX ||
+	    (hdr->nmounts > 0 && spec_array(h, hdr->mounts, hdr->nmounts,
+					    sizeof(struct spec_mount)) == -1))
+		goto bad;
+	sm = (const struct spec_mount *) ((char *) h->map + hdr->mounts);
+	for (j = 0; j < hdr->nmounts; j++) {
+		m = &h->rootfs.m[j];
+		m->attr = sm[j].attr;
+		m->recursive = sm[j].recursive;
+		if (spec_str(h, sm[j].type, (const char **) &m->type) == -1 ||
+		    spec_str(h, sm[j].source, (const char **) &m->source) == -1 ||
+		    spec_str(h, sm[j].target, (const char **) &m->target) == -1 ||
+		    spec_str(h, sm[j].options, (const char **) &m->options) == -1 ||
+		    m->source == NULL || m->target == NULL ||
+		    m->target[0] != '/' || (j == 0) != (strcmp(m->target, "/") == 0))
+			goto bad;
+	}
+	h->rootfs.n = hdr->nmounts;
+	if (h->rootfs.n > 0)
+		h->spec.rootfs = &h->rootfs;
+
+	return &h->spec;
+
+bad:
+	set_error(EINVAL, "%s: not a valid compiled spec", path);
+fail:
+	if (fd != -1)
+		close(fd);
+	if (h->map != MAP_FAILED)
+		munmap(h->map, h->size);
+	free(h);
+	return NULL;
+}
+
+void ns_spec_close(const struct ns_spec *spec) {
+	struct spec_handle *h = (struct spec_handle *) spec;
+
+	munmap(h->map, h->size);
+	free(h);
+}
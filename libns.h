@@ -0,0 +1,262 @@
+/* libns.h
+ *
+ * Code shared by the launchers in this directory (userns_child_exec,
+ * ns_child_exec, ns_run, ns_exec, simple_init and ns_holder) and by the
+ * tools that inspect or measure namespaces:
+ *
+ *   - the namespace types, with their letters, flags and /proc names,
+ *     and joining the namespaces of a process, in one setns() on a pidfd
+ *     or file by file
+ *   - listing the PIDs in /proc, and spreading per-process work over
+ *     threads
+ *   - a pool of mmap'd stacks for clone(), each with a guard page below
+ *     it, recycled across launches and safe to use from several threads,
+ *     so that a process can have any number of clone() children in flight
+ *     without a static 1 MiB stack per program
+ *   - ns_clone(), clone() on a pooled stack
+ *   - the UID/GID map engine: parse, merge, validate and format maps
+ *   - network bring-up for a child's new network namespace over rtnetlink
+ *   - root filesystem construction from a declarative mount list
+ *   - compiled sandbox specs, mmap()ed read-only by the launchers
+ *
+ * Functions return -1 (or NULL) on failure, with errno set and a message
+ * available from ns_error(); they never exit.
+ *
+ * The library is a single file. Programs can build it in:
+ *
+ *     cc -o ns_child_exec ns_child_exec.c libns.c -pthread
+ *
+ * or link it as a static or shared library, which `make` builds (and
+ * `make check` tests, running libns_test against each):
+ *
+ *     cc -o ns_child_exec ns_child_exec.c -L. -lns -pthread
+ *
+ * The programs from the articles are left self-contained.
+ **/
+
+#ifndef LIBNS_H
+#define LIBNS_H
+
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#define NS_STACK_SIZE		(1024 * 1024)
+#define NS_MAP_MAX_EXTENTS	340	// UID/GID map extents the kernel allows
+
+#ifndef CLONE_NEWTIME
+#define CLONE_NEWTIME		0x00000080	// Linux 5.6
+#endif
+
+// Message describing the last failure in this thread
+const char *ns_error(void);
+
+/* The namespace types, in the order they are joined: user first, since
+   joining it may grant the capabilities needed for the others, and mount
+   last, since it changes what /proc refers to */
+struct ns_type {
+	char	letter;		// as in option strings such as "Uun"
+	int	flag;		// CLONE_NEW*
+	const char	*name;	// name of the /proc/PID/ns file
+};
+
+#define NS_TYPES		8
+#define NS_ALL			(CLONE_NEWUSER | CLONE_NEWCGROUP | CLONE_NEWIPC | \
+				 CLONE_NEWUTS | CLONE_NEWNET | CLONE_NEWPID | \
+				 CLONE_NEWTIME | CLONE_NEWNS)
+// The types clone() can create: CLONE_NEWTIME is one of its signal bits
+#define NS_CLONE		(NS_ALL & ~CLONE_NEWTIME)
+
+extern const struct ns_type ns_types[NS_TYPES];
+
+/* Turn namespace letters (U c i u n p T m, as in ns_types[]) into
+   CLONE_NEW* flags. Returns -1 for a letter that is unknown or whose
+   flag is not in `allowed` */
+int ns_parse_letters(const char *letters, int allowed);
+
+/* The types among `flags` in which process `pid` is not in our own
+   namespace, leaving out those this kernel doesn't have. Joining our own
+   user namespace fails, so this is what to join when asked for "all the
+   namespaces" of a process, as nsenter(1) does */
+int ns_foreign(pid_t pid, int flags);
+
+/* Open the /proc/PID/ns files of `pid` for the types in `flags` into
+   fds[], indexed as ns_types[], with -1 for the other types. On failure,
+   nothing is left open */
+int ns_open(pid_t pid, int flags, int fds[NS_TYPES]);
+
+/* Join the namespaces of `pid` of the types in `flags`. NS_JOIN_PIDFD
+   does it in one setns() on a pidfd (Linux 5.8 and later), which the
+   kernel performs atomically; NS_JOIN_FILES opens all the /proc/PID/ns
+   files first, so that the process can't go away half way through, and
+   then joins them in ns_types[] order. With both, the files are used
+   only if the kernel can't take a pidfd */
+#define NS_JOIN_PIDFD		1
+#define NS_JOIN_FILES		2
+
+int ns_join(pid_t pid, int flags, int how);
+
+/* Call `fn` for every PID in /proc, open on `proc_fd`, in ascending
+   order. The directory is read with getdents64() into one buffer, with
+   nothing allocated per process */
+int ns_list_pids(int proc_fd, void (*fn)(pid_t pid, void *arg), void *arg);
+
+/* Call `fn` for every index in [0, n) from `nthreads` threads, the caller
+   being one; threads take indices in chunks of NS_CHUNK, so that a slow
+   process doesn't hold the others up. Should a thread not be created,
+   the others do its share. Returns once every index has been done */
+#define NS_CHUNK		64
+
+void ns_parallel(int n, int nthreads, void (*fn)(int j, void *arg),
+		 void *arg);
+
+/* Stack pools. A pool keeps up to `max_free` released stacks for reuse;
+   stacks beyond that are unmapped when released. ns_stack_get() returns
+   the lowest usable address; the stack's top is that plus the pool's
+   stack size */
+struct ns_stack_pool;
+
+struct ns_stack_pool *ns_stack_pool_create(size_t stack_size, int max_free);
+void ns_stack_pool_destroy(struct ns_stack_pool *pool);
+void *ns_stack_get(struct ns_stack_pool *pool);
+void ns_stack_put(struct ns_stack_pool *pool, void *stack);
+size_t ns_stack_size(struct ns_stack_pool *pool);
+
+// The process-wide pool used by ns_clone(): NS_STACK_SIZE stacks
+struct ns_stack_pool *ns_default_stacks(void);
+
+/* clone() a child that runs `fn(arg)` with CLONE_* `flags` (SIGCHLD is
+   added). The stack goes back to the pool as soon as clone() returns:
+   without CLONE_VM, the child has its own copy of it, and with CLONE_VM
+   the caller must also pass CLONE_VFORK, so that the child has exec'd or
+   exited by then. CLONE_VM without CLONE_VFORK fails with EINVAL */
+pid_t ns_clone(int (*fn)(void *), void *arg, int flags);
+
+/* Turn a map string `spec` (records "inside outside count", separated by
+   commas or newlines) into the text for a uid_map or gid_map file:
+   sorted, with adjacent and consistently overlapping extents merged, and
+   checked against the kernel's rules. If `allow_file` isn't NULL, the
+   outside IDs must also be `own_id` or allowed to the calling user by
+   that file (/etc/subuid or /etc/subgid). The counts of records and of
+   resulting extents go to `nrecords` and `nextents` when not NULL.
+   Returns a malloc()ed string */
+char *ns_map_build(const char *spec, const char *allow_file, uid_t own_id,
+		   int *nrecords, int *nextents);
+
+/* Network setup for a new network namespace, parsed from a spec that is
+   either "lo", to bring the loopback interface up, or
+
+       veth:HOSTIF:ADDR/PREFIX:GATEWAY
+
+   to also create a veth pair: NS_NET_CHILD_IF with ADDR/PREFIX and a
+   default route via GATEWAY in the namespace, and HOSTIF with GATEWAY in
+   ours. A "%d" in HOSTIF is replaced by the child's PID, so that several
+   children can get their own pair */
+#define NS_NET_CHILD_IF		"eth0"
+
+struct ns_net {
+	int	veth;			// create the veth pair
+	char	host_if[IFNAMSIZ];	// host end; may contain "%d"
+	struct in_addr	addr;		// child end's address
+	struct in_addr	gateway;	// host end's address
+	int	prefix;
+};
+
+int ns_net_parse(const char *spec, struct ns_net *net);
+
+/* Apply `net` to the network namespace of process `pid`, which must be a
+   new one (only its loopback interface exists). Everything done inside
+   that namespace is sent as one batch of rtnetlink requests, on a socket
+   opened there, and acknowledged in one pass; the host end, if any, takes
+   a second batch on a socket of our own. The calling thread briefly
+   joins the child's network namespace, so other threads are unaffected */
+int ns_net_setup(pid_t pid, const struct ns_net *net);
+
+/* Root filesystems. A mount list has one mount per line:
+
+       TYPE     SOURCE            TARGET  [OPTIONS]
+
+   TYPE is a filesystem type, or `bind` or `rbind` (recursive) for a bind
+   mount of SOURCE. For `overlay`, SOURCE is the lowerdir list. OPTIONS
+   are comma separated: ro, nosuid, nodev, noexec and noatime apply to the
+   mount, anything else (key or key=value) is passed to the filesystem.
+   The first line must mount the new root, "/"; the other targets are
+   inside it, mounted in order and created if missing. Empty lines and
+   lines starting with `#` are skipped.
+
+   Setting up, in a child with a new mount namespace, makes our mounts
+   private, builds the new root at NS_ROOTFS_STAGE and pivot_root()s
+   into it, detaching the old root. With the new mount API (the default)
+   every mount is first created detached, with fsopen()/fsmount() or
+   open_tree(), so sources are resolved in the old root, and is then
+   attached with move_mount(). NS_ROOTFS_LEGACY does the same with
+   mount(2) calls, for comparison and for kernels before 5.2 */
+#define NS_ROOTFS_MAX		64		// mounts in a list
+#define NS_ROOTFS_STAGE		"/mnt"
+#define NS_ROOTFS_LEGACY	1
+
+struct ns_rootfs;
+
+struct ns_rootfs *ns_rootfs_load(const char *path);
+void ns_rootfs_free(struct ns_rootfs *fs);
+
+/* Build the root filesystem `fs` and switch to it. Allocates nothing, so
+   it can run in a CLONE_VM child */
+int ns_rootfs_setup(const struct ns_rootfs *fs, int flags);
+
+/* Sandbox specs. A spec holds all the settings of a sandbox, in text
+   form one per line:
+
+       namespaces  LETTERS          as for ns_parse_letters(), but
+                                    without T: clone() can't take it
+       uid_map     MAP              as for ns_map_build(), comma separated
+       gid_map     MAP
+       hostname    NAME             needs u
+       net         SPEC             as for ns_net_parse(); needs n
+       mount       TYPE SOURCE TARGET [OPTIONS]
+                                    a mount list line; needs m
+       limit       RESOURCE SOFT HARD
+                                    an rlimit by its name in lower case
+                                    without RLIMIT_ (nofile, nproc, ...),
+                                    `unlimited` for RLIM_INFINITY
+
+   with empty lines and lines starting with `#` skipped. ns_spec_compile()
+   parses and validates it once, and writes it in binary form: maps as
+   the text to write to the map files, the network setup and mounts
+   parsed, everything in one block behind a header with a magic number,
+   a version and a checksum. The file is replaced by rename(), never
+   rewritten in place, so processes that have it mapped are unaffected.
+   With a NULL `out_path`, the spec is only checked.
+
+   ns_spec_open() maps a compiled spec read-only, checks its header, the
+   checksum of the whole file, its flags, limits and offsets, and returns
+   the settings, with the strings and mounts pointing into the mapping:
+   opening a spec parses nothing, and every process using it shares the
+   page cache's copy */
+#define NS_SPEC_VERSION		2
+#define NS_SPEC_LIMITS		16		// limit lines in a spec
+
+struct ns_limit {
+	int	resource;		// RLIMIT_*
+	struct rlimit	rlim;
+};
+
+struct ns_spec {
+	int	flags;			// CLONE_NEW*
+	const char	*uid_map;	// uid_map text, ready to write, or NULL
+	const char	*gid_map;	// gid_map text, or NULL
+	const char	*hostname;	// or NULL
+	const struct ns_net	*net;	// or NULL
+	const struct ns_rootfs	*rootfs;	// or NULL
+	const struct ns_limit	*limits;
+	int	nlimits;
+};
+
+int ns_spec_compile(const char *text_path, const char *out_path);
+const struct ns_spec *ns_spec_open(const char *path);
+void ns_spec_close(const struct ns_spec *spec);
+
+#endif
@@ -0,0 +1,253 @@
+/* libns_test.c
+ *
+ * Check libns's parsers (namespace letters, UID/GID maps, network specs
+ * and mount lists) against specs that must be accepted and specs that
+ * must be rejected, and that a damaged compiled sandbox spec is refused.
+ * Needs no privileges and changes nothing: each failing case is printed,
+ * and we exit with a failure status if there were any.
+ *
+ * Build with: cc -o libns_test libns_test.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "libns.h"
+
+static int failures;
+
+// `spec` should have been accepted by `what`
+static void accepted(int ok, const char *what, const char *spec) {
+	if (!ok) {
+		printf("FAIL %s: '%s': %s\n", what, spec, ns_error());
+		failures++;
+	}
+}
+
+static void rejected(int ok, const char *what, const char *spec) {
+	if (!ok) {
+		printf("FAIL %s: '%s' was accepted\n", what, spec);
+		failures++;
+	}
+}
+
+static void test_parse_letters(void) {
+	static const struct {
+		const char	*letters;
+		int	allowed, flags;
+	} good[] = {
+		{ "", NS_ALL, 0 },
+		{ "nu", NS_CLONE, CLONE_NEWNET | CLONE_NEWUTS },
+		{ "UciunpTm", NS_ALL, NS_ALL },
+		{ "Uciunpm", NS_CLONE, NS_CLONE },
+		{ "uu", NS_CLONE, CLONE_NEWUTS },
+	};
+	static const struct {
+		const char	*letters;
+		int	allowed;
+	} bad[] = {
+		{ "x", NS_ALL }, { "nx", NS_ALL }, { "T", NS_CLONE },
+		{ "n", CLONE_NEWUTS }, { "N", NS_ALL },
+	};
+	size_t	j;
+	int flags;
+
+	for (j = 0; j < sizeof(good) / sizeof(good[0]); j++) {
+		flags = ns_parse_letters(good[j].letters, good[j].allowed);
+		accepted(flags != -1, "ns_parse_letters", good[j].letters);
+		if (flags != -1 && flags != good[j].flags) {
+			printf("FAIL ns_parse_letters: '%s': gave %#x\n",
+			       good[j].letters, flags);
+			failures++;
+		}
+	}
+	for (j = 0; j < sizeof(bad) / sizeof(bad[0]); j++)
+		rejected(ns_parse_letters(bad[j].letters, bad[j].allowed) == -1,
+			 "ns_parse_letters", bad[j].letters);
+}
+
+static void test_net_parse(void) {
+	static const char *good[] = {
+		"lo",
+		"veth:h%d:10.0.0.2/24:10.0.0.1",
+	};
+	static const char *bad[] = {
+		"", "veth", "veth:", "veth:x", "veth:x:10.0.0.2/24",
+		"veth:x:10.0.0.2:10.0.0.1", "veth:x:10.0.0.2/24:",
+		"veth:x:10.0.0.2/24:10.0.0.1:y", "veth:x:10.0.0.2/0:10.0.0.1",
+		"veth:x:10.0.0.2/31:10.0.0.1", "veth:x:10.0.0/24:10.0.0.1",
+		"veth:x:10.0.0.2/24:gw", "tap:x:10.0.0.2/24:10.0.0.1",
+		"veth:0123456789abcdef:10.0.0.2/24:10.0.0.1", "lo:",
+	};
+	struct ns_net	net;
+	size_t	j;
+
+	for (j = 0; j < sizeof(good) / sizeof(good[0]); j++)
+		accepted(ns_net_parse(good[j], &net) == 0, "ns_net_parse",
+			 good[j]);
+	for (j = 0; j < sizeof(bad) / sizeof(bad[0]); j++)
+		rejected(ns_net_parse(bad[j], &net) == -1, "ns_net_parse",
+			 bad[j]);
+}
+
+static void test_map_build(void) {
+	static const struct {
+		const char	*spec, *text;
+	} good[] = {
+		{ "0 1000 1", "0 1000 1\n" },
+		{ "0 0 4294967295", "0 0 4294967295\n" },
+		{ "4294967294 4294967294 1", "4294967294 4294967294 1\n" },
+		{ "10 110 5,0 100 10", "0 100 15\n" },
+		{ "0 0 2147483648,2147483648 2147483648 2147483647",
+		  "0 0 4294967295\n" },
+		{ "0 100 10\n\n20 300 1\n", "0 100 10\n20 300 1\n" },
+	};
+	static const char *bad[] = {
+		"", ",", "0 1000", "0 1000 0", "-1 0 1", "0 0 1 1", "x 0 1",
+		"1 1 4294967295", "0 0 4294967296", "4294967295 0 1",
+		"0 4294967295 1", "0 1 4294967295",
+		"0 0 2147483648,2147483648 2147483648 2147483648",
+		"0 0 10,5 100 10", "0 0 10,100 5 10",
+	};
+	char	*text;
+	size_t	j;
+
+	for (j = 0; j < sizeof(good) / sizeof(good[0]); j++) {
+		text = ns_map_build(good[j].spec, NULL, 0, NULL, NULL);
+		accepted(text != NULL, "ns_map_build", good[j].spec);
+		if (text != NULL && strcmp(text, good[j].text) != 0) {
+			printf("FAIL ns_map_build: '%s': gave '%s'\n",
+			       good[j].spec, text);
+			failures++;
+		}
+		free(text);
+	}
+	for (j = 0; j < sizeof(bad) / sizeof(bad[0]); j++) {
+		text = ns_map_build(bad[j], NULL, 0, NULL, NULL);
+		rejected(text == NULL, "ns_map_build", bad[j]);
+		free(text);
+	}
+}
+
+// Load mount list `text` from a temporary file; 0 if it was accepted
+static int load_rootfs(const char *text) {
+	struct ns_rootfs	*fs;
+	char	path[] = "/tmp/libns_test.XXXXXX";
+	ssize_t	len = strlen(text);
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd == -1 || write(fd, text, len) != len) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	fs = ns_rootfs_load(path);
+	unlink(path);
+	if (fs == NULL)
+		return -1;
+	ns_rootfs_free(fs);
+	return 0;
+}
+
+static void test_rootfs(void) {
+	static const char *good[] = {
+		"tmpfs none /",
+		"tmpfs none /\nbind /usr /usr\nproc proc /proc\n",
+		"tmpfs none / size=1m,ro\nbind /usr /usr ro\n",
+		"# root\n\ntmpfs none / mode=755\nrbind /dev /dev\n"
+		"tmpfs t /tmp\n",
+		"overlay /a:/b / upperdir=/u,workdir=/w\n",
+	};
+	static const char *bad[] = {
+		"", "# nothing\n", "tmpfs", "tmpfs none", "tmpfs none tmp",
+		"tmpfs none / ro extra", "bind /usr /usr\n",
+		"tmpfs none /\ntmpfs none /\n", "tmpfs none /\nproc proc\n",
+		"tmpfs none /\nbind /usr /usr size=1m\n",
+	};
+	size_t	j;
+
+	for (j = 0; j < sizeof(good) / sizeof(good[0]); j++)
+		accepted(load_rootfs(good[j]) == 0, "ns_rootfs_load", good[j]);
+	for (j = 0; j < sizeof(bad) / sizeof(bad[0]); j++)
+		rejected(load_rootfs(bad[j]) == -1, "ns_rootfs_load", bad[j]);
+}
+
+/* Compile a sandbox spec, then flip each bit of the compiled file in
+   turn: ns_spec_open() must refuse every one of the damaged files */
+static void test_spec(void) {
+	static const char	text[] =
+		"namespaces Uun\nuid_map 0 1000 1\nhostname box\n"
+		"limit nofile 64 64\n";
+	char	src[] = "/tmp/libns_test.XXXXXX", bin[sizeof(src) + 4];
+	const struct ns_spec	*spec;
+	unsigned char	*data;
+	off_t	size, j;
+	int fd, bit;
+
+	fd = mkstemp(src);
+	if (fd == -1 || write(fd, text, sizeof(text) - 1) !=
+	    (ssize_t) sizeof(text) - 1) {
+		perror("mkstemp");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	snprintf(bin, sizeof(bin), "%s.bin", src);
+
+	spec = NULL;
+	if (ns_spec_compile(src, bin) == 0)
+		spec = ns_spec_open(bin);
+	accepted(spec != NULL, "ns_spec_open", text);
+	if (spec == NULL)
+		goto out;
+	ns_spec_close(spec);
+
+	fd = open(bin, O_RDWR);
+	size = lseek(fd, 0, SEEK_END);
+	data = malloc(size);
+	if (fd == -1 || data == NULL || pread(fd, data, size, 0) != size) {
+		perror(bin);
+		exit(EXIT_FAILURE);
+	}
+	for (j = 0; j < size; j++) {
+		for (bit = 0; bit < 8; bit++) {
+			data[j] ^= 1 << bit;
+			if (pwrite(fd, data, size, 0) != size) {
+				perror(bin);
+				exit(EXIT_FAILURE);
+			}
+			data[j] ^= 1 << bit;
+			spec = ns_spec_open(bin);
+			if (spec != NULL) {
+				printf("FAIL ns_spec_open: byte %ld bit %d "
+				       "flipped was accepted\n", (long) j, bit);
+				failures++;
+				ns_spec_close(spec);
+			}
+		}
+	}
+	free(data);
+	close(fd);
+
+out:
+	unlink(src);
+	unlink(bin);
+}
+
+int main(int argc, char **argv) {
+	test_parse_letters();
+	test_map_build();
+	test_net_parse();
+	test_rootfs();
+	test_spec();
+
+	if (failures > 0) {
+		printf("%d failures\n", failures);
+		exit(EXIT_FAILURE);
+	}
+	printf("all passed\n");
+	exit(EXIT_SUCCESS);
+}
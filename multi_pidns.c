@@ -1,6 +1,16 @@
 /* multi_pidns.c
  *
  * Create a series of child process in nested PID namespaces
+ *
+ * With -B, measure instead how process operations behave as PID
+ * namespaces nest deeper (up to the kernel's limit of 32 levels) and
+ * wider: each level's init holds `breadth` idle sibling PID namespaces
+ * and then times fork(), clone(CLONE_NEWPID), getpid(), kill(), waitpid()
+ * and mounting a procfs instance, before creating the next level. Level
+ * 0 is the PID namespace we start in; at the deepest level, no further
+ * namespace (and so no clone(CLONE_NEWPID) time) is possible. Output is
+ * one tab-separated line per level; the procfs mounts are made in a
+ * private mount namespace.
  */
 #define _GNU_SOURCE
 #include <sys/wait.h>
@@ -14,6 +24,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
 
 
 /* A simple error-handling function: print an error message based
@@ -72,10 +86,252 @@ static int childFunc(void *arg) {
 	return 0;
 }
 
+#define MAX_DEPTH	32	// nesting limit of PID namespaces
+
+static char bench_dir[] = "/tmp/multi_pidns.XXXXXX";	// for procfs mounts
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* fork() with the given clone flags (0 or CLONE_NEWPID), through clone3()
+   so that no separate stack is needed: like fork(), returns 0 in the
+   child. In a new PID namespace the child is that namespace's init */
+static pid_t fork_flags(int flags) {
+	struct clone_args	args;
+
+	memset(&args, 0, sizeof(args));
+	args.flags = flags;
+	args.exit_signal = SIGCHLD;
+	return syscall(SYS_clone3, &args, sizeof(args));
+}
+
+/* Mean time of creating a child that exits at once; reaping isn't timed.
+   Returns -1 if a new PID namespace can't be nested any deeper */
+static double time_fork(int flags, int iterations) {
+	double	start, total;
+	pid_t	pid;
+	int j;
+
+	for (total = 0, j = 0; j < iterations; j++) {
+		start = now_us();
+		pid = fork_flags(flags);
+		if (pid == -1 && errno == ENOSPC && (flags & CLONE_NEWPID))
+			return -1;
+		if (pid == -1)
+			bail("clone3");
+		if (pid == 0)
+			_exit(EXIT_SUCCESS);
+		total += now_us() - start;
+
+		if (waitpid(pid, NULL, 0) == -1)
+			bail("waitpid");
+	}
+
+	return total / iterations;
+}
+
+// Mean time of reaping a child that has already terminated
+static double time_waitpid(int iterations) {
+	double	start, total;
+	siginfo_t	info;
+	pid_t	pid;
+	int j;
+
+	for (total = 0, j = 0; j < iterations; j++) {
+		pid = fork();
+		if (pid == -1)
+			bail("fork");
+		if (pid == 0)
+			_exit(EXIT_SUCCESS);
+
+		// Wait until it is a zombie, without reaping it
+		if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+			bail("waitid");
+
+		start = now_us();
+		if (waitpid(pid, NULL, 0) == -1)
+			bail("waitpid");
+		total += now_us() - start;
+	}
+
+	return total / iterations;
+}
+
+// Mean time of mounting (and then unmounting) a procfs for this level
+static double time_mount(int level, int iterations) {
+	char	mount_point[PATH_MAX];
+	double	start, total;
+	int j;
+
+	snprintf(mount_point, PATH_MAX, "%s/proc%d", bench_dir, level);
+	if (mkdir(mount_point, 0555) == -1 && errno != EEXIST)
+		bail("mkdir");
+
+	for (total = 0, j = 0; j < iterations; j++) {
+		start = now_us();
+		if (mount("proc", mount_point, "proc", 0, NULL) == -1)
+			bail("mount");
+		total += now_us() - start;
+		if (umount(mount_point) == -1)
+			bail("umount");
+	}
+
+	return total / iterations;
+}
+
+/* Measure one level, then create the next one as a child in a new PID
+   namespace. Returns the exit status for the level's process */
+static int bench_level(int level, int depth, int breadth, int iterations) {
+	pid_t	siblings[breadth > 0 ? breadth : 1], pid, target;
+	double	fork_us, clone_us, getpid_ns, kill_ns, wait_us, mount_us, start;
+	int status, j, loops;
+
+	// The siblings: idle PID namespaces whose init just waits. At the
+	// deepest level there can be none
+	for (j = 0; j < breadth; j++) {
+		siblings[j] = fork_flags(CLONE_NEWPID);
+		if (siblings[j] == -1 && errno == ENOSPC) {
+			breadth = j;
+			break;
+		}
+		if (siblings[j] == -1)
+			bail("clone3");
+		if (siblings[j] == 0) {
+			while (1)
+				pause();
+		}
+	}
+
+	fork_us = time_fork(0, iterations);
+	clone_us = time_fork(CLONE_NEWPID, iterations);
+	wait_us = time_waitpid(iterations);
+	mount_us = time_mount(level, iterations);
+
+	loops = iterations * 100;
+	start = now_us();
+	for (j = 0; j < loops; j++)
+		getpid();
+	getpid_ns = (now_us() - start) * 1000 / loops;
+
+	// Signal 0 to a process at this level: lookup and permission check
+	target = fork();
+	if (target == -1)
+		bail("fork");
+	if (target == 0) {
+		while (1)
+			pause();
+	}
+	start = now_us();
+	for (j = 0; j < loops; j++)
+		if (kill(target, 0) == -1)
+			bail("kill");
+	kill_ns = (now_us() - start) * 1000 / loops;
+	kill(target, SIGKILL);
+	waitpid(target, NULL, 0);
+
+	printf("%d\t%d\t%.1f\t", level, breadth, fork_us);
+	if (clone_us < 0)
+		printf("-\t");
+	else
+		printf("%.1f\t", clone_us);
+	printf("%.1f\t%.1f\t%.1f\t%.1f\n", getpid_ns, kill_ns, wait_us, mount_us);
+	fflush(stdout);
+
+	status = EXIT_SUCCESS;
+	if (level < depth) {
+		pid = fork_flags(CLONE_NEWPID);
+		if (pid == -1) {
+			// We may have started out in a nested PID namespace
+			if (errno == ENOSPC)
+				fprintf(stderr, "PID namespace nesting limit reached "
+					"at level %d\n", level);
+			else
+				perror("clone3");
+			status = EXIT_FAILURE;
+		} else if (pid == 0) {
+			exit(bench_level(level + 1, depth, breadth, iterations));
+		} else {
+			if (waitpid(pid, &status, 0) == -1)
+				bail("waitpid");
+			status = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+		}
+	}
+
+	for (j = 0; j < breadth; j++) {
+		kill(siblings[j], SIGKILL);
+		waitpid(siblings[j], NULL, 0);
+	}
+
+	return status;
+}
+
+static void bench(int depth, int breadth, int iterations) {
+	char	mount_point[PATH_MAX];
+	int status, j;
+
+	// Keep our procfs mounts out of everyone else's sight
+	if (unshare(CLONE_NEWNS) == -1)
+		bail("unshare");
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1)
+		bail("mount");
+	if (mkdtemp(bench_dir) == NULL)
+		bail("mkdtemp");
+
+	printf("# level\tbreadth\tfork_us\tclone_newpid_us\tgetpid_ns\tkill_ns\t"
+	       "waitpid_us\tmount_proc_us\n");
+	status = bench_level(0, depth, breadth, iterations);
+
+	for (j = 0; j <= depth; j++) {
+		snprintf(mount_point, PATH_MAX, "%s/proc%d", bench_dir, j);
+		rmdir(mount_point);
+	}
+	rmdir(bench_dir);
+
+	exit(status);
+}
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [levels]\n", name);
+	fprintf(stderr, "       %s -B [-d depth] [-w breadth] [-n iterations]\n", name);
+	fprintf(stderr, "	-B		 Benchmark nested PID namespaces\n");
+	fprintf(stderr, "	-d depth	 Nesting depth, up to %d (default: %d)\n",
+		MAX_DEPTH, MAX_DEPTH);
+	fprintf(stderr, "	-w breadth	 Idle sibling namespaces per level (default: 0)\n");
+	fprintf(stderr, "	-n iterations	 Samples per operation (default: 200)\n");
+	exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
 	long	levels;
+	int	opt, do_bench, depth, breadth, iterations;
+
+	do_bench = 0;
+	depth = MAX_DEPTH;
+	breadth = 0;
+	iterations = 200;
+
+	while ((opt = getopt(argc, argv, "Bd:w:n:")) != -1) {
+		switch (opt) {
+		case 'B': do_bench = 1;			break;
+		case 'd': depth = atoi(optarg);		break;
+		case 'w': breadth = atoi(optarg);	break;
+		case 'n': iterations = atoi(optarg);	break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (do_bench) {
+		if (optind != argc || depth < 0 || depth > MAX_DEPTH ||
+		    breadth < 0 || iterations < 1)
+			usage(argv[0]);
+		bench(depth, breadth, iterations);
+	}
 
-	levels = (argc > 1) ? atoi(argv[1]) : 5;
+	levels = (optind < argc) ? atoi(argv[optind]) : 5;
 	childFunc((void *)levels);
 
 	exit(EXIT_SUCCESS);
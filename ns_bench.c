@@ -0,0 +1,337 @@
+/* ns_bench.c
+ *
+ * Measure the latency of creating namespaces, for every combination of
+ * the -i -m -n -p -u -U flags understood by ns_child_exec, unshare and
+ * userns_child_exec.
+ *
+ * Two operations are timed:
+ *
+ *   clone    clone() a child into new namespaces, have it execute a
+ *            command (default: /bin/true), and wait for it to exit
+ *   unshare  the unshare() call alone, made in a freshly forked child so
+ *            that the benchmark itself never changes namespaces
+ *
+ * The first samples of each combination are reported separately as the
+ * "cold" phase; the rest are the "warm" phase. With -t, several threads
+ * run the same combination at once, which exposes kernel serialization
+ * such as that of network namespace creation.
+ *
+ * Output is one tab-separated line per (operation, flags, threads, phase),
+ * with latencies in microseconds, so that runs can be diffed.
+ *
+ * Build with: cc -o ns_bench ns_bench.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+// The namespaces measured unless -f says otherwise
+#define DEFAULT_FLAGS	(CLONE_NEWIPC | CLONE_NEWNS | CLONE_NEWNET | \
+			 CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWUSER)
+
+#define OP_CLONE	1
+#define OP_UNSHARE	2
+
+// Everything one measuring thread needs
+struct run {
+	pthread_t	thread_id;
+	int	op;
+	int	flags;
+	int	samples;	// samples taken by this thread
+	double	*lat;		// where this thread stores its samples (us)
+	int	failed;		// errno of a failed sample, or 0
+	pthread_barrier_t	*start;
+};
+
+static char *cmd_argv[2] = { "/bin/true", NULL };
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-o op	 clone, unshare or both (default: both)\n");
+	fprintf(stderr, "	-n num	 warm samples per combination (default: 200)\n");
+	fprintf(stderr, "	-w num	 cold samples per combination (default: 10)\n");
+	fprintf(stderr, "	-t list	 comma-separated numbers of concurrent\n");
+	fprintf(stderr, "		 callers to measure (default: 1)\n");
+	fprintf(stderr, "	-f flags only measure combinations of these letters\n");
+	fprintf(stderr, "		 out of `imnpuUc` (default: all 64 of `imnpuU`)\n");
+	fprintf(stderr, "	-c cmd	 command executed by clone()d children\n");
+	fprintf(stderr, "		 (default: /bin/true)\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int childFunc(void *arg) {
+	execv(cmd_argv[0], cmd_argv);
+	_exit(127);
+}
+
+// clone()+exec+exit round trip; returns latency in us or -1 on failure
+static double sample_clone(struct run *r) {
+	double	start;
+	pid_t	pid;
+	int status;
+
+	start = now_us();
+	pid = ns_clone(childFunc, NULL, r->flags);
+	if (pid == -1)
+		return -1;
+	if (waitpid(pid, &status, 0) == -1)
+		bail("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errno = ENOEXEC;
+		return -1;
+	}
+
+	return now_us() - start;
+}
+
+/* unshare() latency, measured inside a forked child that reports it
+   back over a pipe; returns latency in us or -1 on failure */
+static double sample_unshare(struct run *r) {
+	int pfd[2];
+	double	lat, start;
+	pid_t	pid;
+
+	if (pipe(pfd) == -1)
+		bail("pipe");
+
+	pid = fork();
+	if (pid == -1)
+		bail("fork");
+
+	if (pid == 0) {
+		close(pfd[0]);
+		start = now_us();
+		lat = (unshare(r->flags) == -1) ? -errno : now_us() - start;
+		if (write(pfd[1], &lat, sizeof(lat)) != sizeof(lat))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pfd[1]);
+	if (read(pfd[0], &lat, sizeof(lat)) != sizeof(lat))
+		lat = -EIO;
+	close(pfd[0]);
+	if (waitpid(pid, NULL, 0) == -1)
+		bail("waitpid");
+
+	if (lat < 0) {
+		errno = -lat;
+		return -1;
+	}
+	return lat;
+}
+
+static void *run_thread(void *arg) {
+	struct run *r = arg;
+	int j;
+
+	pthread_barrier_wait(r->start);
+
+	for (j = 0; j < r->samples; j++) {
+		r->lat[j] = (r->op == OP_CLONE) ? sample_clone(r) : sample_unshare(r);
+		if (r->lat[j] < 0) {
+			r->failed = errno;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+// The value at percentile `p` (0..1) of the sorted array `v`
+static double pct(double *v, int n, double p) {
+	int i = (int) (p * n + 0.999999) - 1;
+
+	return v[i < 0 ? 0 : i];
+}
+
+static void flags_str(int flags, char *buf) {
+	int j;
+
+	for (j = 0; j < NS_TYPES; j++)
+		if (flags & ns_types[j].flag)
+			*buf++ = ns_types[j].letter;
+	if (flags == 0)
+		*buf++ = '-';
+	*buf = '\0';
+}
+
+static void report(int op, int flags, int nthreads, char *phase,
+		   double *v, int n) {
+	char	fs[NS_TYPES + 1];
+	double	sum;
+	int j;
+
+	qsort(v, n, sizeof(double), cmp_double);
+	for (sum = 0, j = 0; j < n; j++)
+		sum += v[j];
+
+	flags_str(flags, fs);
+	printf("%s\t%s\t%d\t%s\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+	       op == OP_CLONE ? "clone" : "unshare", fs, nthreads, phase, n,
+	       v[0], pct(v, n, 0.5), pct(v, n, 0.9), pct(v, n, 0.99),
+	       pct(v, n, 0.999), v[n - 1], sum / n);
+	fflush(stdout);
+}
+
+/* Measure one (operation, flags) combination with `nthreads` concurrent
+   callers. Each thread takes `cold` + `warm` samples; the first `cold`
+   samples of every thread form the cold phase */
+static void measure(int op, int flags, int nthreads, int cold, int warm) {
+	pthread_barrier_t	start;
+	struct run	*runs;
+	double	*lat, *cv, *wv;
+	int j, k, per, failed, s;
+	char	fs[NS_TYPES + 1];
+
+	per = cold + warm;
+	runs = calloc(nthreads, sizeof(struct run));
+	lat = calloc((size_t) nthreads * per, sizeof(double));
+	cv = calloc((size_t) nthreads * per, sizeof(double));
+	wv = calloc((size_t) nthreads * per, sizeof(double));
+	if (runs == NULL || lat == NULL || cv == NULL || wv == NULL)
+		bail("calloc");
+
+	pthread_barrier_init(&start, NULL, nthreads);
+	for (j = 0; j < nthreads; j++) {
+		runs[j].op = op;
+		runs[j].flags = flags;
+		runs[j].samples = per;
+		runs[j].lat = lat + (size_t) j * per;
+		runs[j].start = &start;
+
+		s = pthread_create(&runs[j].thread_id, NULL, run_thread, &runs[j]);
+		if (s != 0) {
+			errno = s;
+			bail("pthread_create");
+		}
+	}
+
+	failed = 0;
+	for (j = 0; j < nthreads; j++) {
+		pthread_join(runs[j].thread_id, NULL);
+		if (runs[j].failed)
+			failed = runs[j].failed;
+	}
+	pthread_barrier_destroy(&start);
+
+	if (failed) {
+		flags_str(flags, fs);
+		printf("%s\t%s\t%d\terror\t%s\n", op == OP_CLONE ? "clone" : "unshare",
+		       fs, nthreads, strerror(failed));
+	} else {
+		for (j = 0; j < nthreads; j++) {
+			for (k = 0; k < cold; k++)
+				cv[j * cold + k] = runs[j].lat[k];
+			for (k = 0; k < warm; k++)
+				wv[j * warm + k] = runs[j].lat[cold + k];
+		}
+		if (cold > 0)
+			report(op, flags, nthreads, "cold", cv, nthreads * cold);
+		if (warm > 0)
+			report(op, flags, nthreads, "warm", wv, nthreads * warm);
+	}
+
+	free(runs);
+	free(lat);
+	free(cv);
+	free(wv);
+}
+
+int main(int argc, char **argv) {
+	int opt, ops, mask, allowed, warm, cold, flags, j, n;
+	int threads[64], nthreads;
+	char	*p, *tok;
+
+	ops = OP_CLONE | OP_UNSHARE;
+	allowed = DEFAULT_FLAGS;
+	warm = 200;
+	cold = 10;
+	threads[0] = 1;
+	nthreads = 1;
+
+	while ((opt = getopt(argc, argv, "o:n:w:t:f:c:")) != -1) {
+		switch (opt) {
+		case 'o':
+			if (strcmp(optarg, "clone") == 0)
+				ops = OP_CLONE;
+			else if (strcmp(optarg, "unshare") == 0)
+				ops = OP_UNSHARE;
+			else if (strcmp(optarg, "both") != 0)
+				usage(argv[0]);
+			break;
+		case 'n': warm = atoi(optarg);		break;
+		case 'w': cold = atoi(optarg);		break;
+		case 't':
+			nthreads = 0;
+			for (tok = strtok_r(optarg, ",", &p); tok != NULL && nthreads < 64;
+			     tok = strtok_r(NULL, ",", &p))
+				if ((threads[nthreads++] = atoi(tok)) < 1)
+					usage(argv[0]);
+			break;
+		case 'f':
+			allowed = ns_parse_letters(optarg, NS_CLONE);
+			if (allowed == -1)
+				usage(argv[0]);
+			break;
+		case 'c': cmd_argv[0] = optarg;		break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || warm < 0 || cold < 0 || warm + cold == 0 ||
+	    nthreads == 0)
+		usage(argv[0]);
+
+	printf("# op\tflags\tthreads\tphase\tsamples\tmin\tp50\tp90\tp99\tp999\tmax\tmean\n");
+
+	for (n = 0; n < nthreads; n++) {
+		for (mask = 0; mask < (1 << NS_TYPES); mask++) {
+			flags = 0;
+			for (j = 0; j < NS_TYPES; j++)
+				if (mask & (1 << j))
+					flags |= ns_types[j].flag;
+			if ((flags & ~allowed) != 0)
+				continue;
+
+			if (ops & OP_CLONE)
+				measure(OP_CLONE, flags, threads[n], cold, warm);
+			if (ops & OP_UNSHARE)
+				measure(OP_UNSHARE, flags, threads[n], cold, warm);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -1,15 +1,43 @@
 /* ns_child_exec.c
  *
  * Create a child process that executes a shell command in new namespaces
+ *
+ * The child is created with clone3(), which hands back a pidfd for it
+ * (CLONE_PIDFD) and can place it directly into a cgroup v2 directory
+ * (CLONE_INTO_CGROUP). On kernels without clone3() we fall back to clone()
+ * on a stack from libns's pool.
+ *
+ * In batch mode (-f) the commands listed in a manifest file are run
+ * concurrently by a set of worker threads, each job in its own new
+ * namespaces.
+ *
+ * With -N, the child's new network namespace is set up (loopback up, and
+ * optionally a veth pair with addresses and a default route) over
+ * rtnetlink before the command runs, instead of the command shelling out
+ * to ip(8). With -R, the child builds its root filesystem from a mount
+ * list (see ns_rootfs_load() in libns.h) and pivots into it, using the
+ * new mount API, instead of a script of mount(8) calls.
+ *
+ * Build with: cc -o ns_child_exec ns_child_exec.c libns.c -pthread
  **/
 
 #define _GNU_SOURCE
 #include <sched.h>
+#include <linux/sched.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <pthread.h>
+#include "libns.h"
+#include "ns_sync.h"
 
 /* A simple error-handling function: print an error message based
    on the value `errno` and terminate the calling process
@@ -28,26 +56,577 @@ static void usage(char *name) {
 	fprintf(stderr, "	-p new PID namespace\n");
 	fprintf(stderr, "	-u new UTS namespace\n");
 	fprintf(stderr, "	-U new user namespace\n");
+	fprintf(stderr, "	-c dir  create child in cgroup v2 directory `dir`\n");
+	fprintf(stderr, "	-L use legacy clone() even if clone3() is available\n");
+	fprintf(stderr, "	-V create the child with CLONE_VM|CLONE_VFORK, so our\n");
+	fprintf(stderr, "	   page tables are not copied (implies -L)\n");
+	fprintf(stderr, "	-B n run cmd `n` times through clone3(), clone() and\n");
+	fprintf(stderr, "	     -V, and report the launch latency of each\n");
+	fprintf(stderr, "	-f file run every command in manifest `file` (one\n");
+	fprintf(stderr, "	     per line) instead of cmd; a line may start with\n");
+	fprintf(stderr, "	     `+FLAGS` (e.g. `+nu`) to pick its own namespaces\n");
+	fprintf(stderr, "	-j n run batch jobs on `n` workers (default: one per CPU)\n");
+	fprintf(stderr, "	-J   run the batch with 1, 2, 4, ... workers and report\n");
+	fprintf(stderr, "	     throughput for each worker count\n");
+	fprintf(stderr, "	-N spec set up the new network namespace (needs -n)\n");
+	fprintf(stderr, "	     before cmd runs: `lo` brings loopback up, and\n");
+	fprintf(stderr, "	     `veth:HOSTIF:ADDR/PREFIX:GW` also creates a veth\n");
+	fprintf(stderr, "	     pair, " NS_NET_CHILD_IF " with ADDR inside and HOSTIF with GW\n");
+	fprintf(stderr, "	     outside (\"%%d\" in HOSTIF becomes the child's PID)\n");
+	fprintf(stderr, "	-R list build the root filesystem from mount list\n");
+	fprintf(stderr, "	     `list` and pivot into it (needs -m, and `m` on\n");
+	fprintf(stderr, "	     every manifest line with +FLAGS); with -B,\n");
+	fprintf(stderr, "	     also compare against no rootfs and against -O\n");
+	fprintf(stderr, "	-O build it with mount(2) instead of the new mount API\n");
 	fprintf(stderr, "	-v Display verbose message\n");
 	exit(EXIT_FAILURE);
 }
 
-// Start function for cloned child
+// A launched child: its PID and, if clone3() was used, a pidfd for it
+struct child {
+	pid_t	pid;
+	int	pidfd;		// -1 when created by the legacy path
+};
+
+// What the child needs to know
+struct child_args {
+	char	**argv;
+	int	cgroup_fd;	// cgroup directory to move into, or -1
+	struct ns_net	*net;	// network setup to do before exec, or NULL
+	struct ns_sync	*sync;	// handshake for it, set by launch()
+	struct ns_rootfs	*rootfs;	// root filesystem to build, or NULL
+	int	rootfs_flags;	// NS_ROOTFS_* flags for it
+};
+
+static int use_legacy;		// clone3() unavailable, or -L given
+static int use_vfork;		// -V given
+
+/* Move the calling process into the cgroup open on `cgroup_fd`. This is
+   what CLONE_INTO_CGROUP does for us on the clone3() path; writing "0"
+   to cgroup.procs moves the writer itself, so there is no window where
+   the command runs outside the cgroup. Returns 0, or -1 on error */
+static int join_cgroup(int cgroup_fd) {
+	int fd;
+
+	fd = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("open cgroup.procs");
+		return -1;
+	}
+	if (write(fd, "0", 1) != 1) {
+		perror("write cgroup.procs");
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+// In the child: build the root filesystem, if there is one
+static int setup_rootfs(struct child_args *args) {
+	if (args->rootfs == NULL)
+		return 0;
+	if (ns_rootfs_setup(args->rootfs, args->rootfs_flags) == -1) {
+		fprintf(stderr, "Failure in child: rootfs: %s\n", ns_error());
+		return -1;
+	}
+	return 0;
+}
+
+// In the child: wait for the parent's network setup, if there is any
+static int wait_net(struct child_args *args) {
+	if (args->sync == NULL)
+		return 0;
+	if (ns_sync_wait(args->sync, NS_SYNC_EXEC, NS_SYNC_PARENT) == -1) {
+		fprintf(stderr, "Failure in child: parent: %s: %s\n",
+			ns_sync_error(args->sync), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Start function for cloned child. With -V the child shares our memory
+   until it execs, so it must not call exit() (which would flush our
+   stdio buffers); on failure it returns, and clone() then terminates
+   the child with _exit() */
 static int childFunc(void *arg) {
-	char **argv = arg;
-	execvp(argv[0], &argv[0]);
-	bail("execvp");
+	struct child_args *args = arg;
+
+	if (args->cgroup_fd != -1 && join_cgroup(args->cgroup_fd) == -1)
+		return EXIT_FAILURE;
+	if (setup_rootfs(args) == -1 || wait_net(args) == -1)
+		return EXIT_FAILURE;
+
+	execvp(args->argv[0], &args->argv[0]);
+	perror("execvp");
+	return 127;			// as on the clone3() path
+}
+
+/* Create a child with clone(), on a stack from libns's pool, so several
+   children can be in flight at once (see ns_clone()).
+
+   With -V the child is created with CLONE_VM|CLONE_VFORK, as vfork() and
+   posix_spawn() do: it borrows our address space until it execs, and we
+   are suspended until then. That skips copying our page tables, which
+   is what makes fork() slow in a process with a large RSS. We install no
+   signal handlers, so none can run on our memory in the child */
+static void launch_legacy(int flags, struct child_args *args, struct child *ch) {
+	if (use_vfork)
+		flags |= CLONE_VM | CLONE_VFORK;
+
+	ch->pidfd = -1;
+	ch->pid = ns_clone(childFunc, args, flags);
+	if (ch->pid == -1)
+		bail("clone");
+}
+
+/* Create a child with clone3(). Without CLONE_VM the child runs on a
+   copy of our own stack, exactly as after fork(), so no stack has to be
+   supplied. Returns 0 on success, or -1 if clone3() (or one of the
+   features we asked of it) is not supported by the running kernel */
+static int launch_clone3(int flags, struct child_args *args, struct child *ch) {
+	struct clone_args cl_args;
+	long	ret;
+
+	memset(&cl_args, 0, sizeof(cl_args));
+	cl_args.flags = flags | CLONE_PIDFD;
+	cl_args.pidfd = (unsigned long) &ch->pidfd;
+	cl_args.exit_signal = SIGCHLD;
+	if (args->cgroup_fd != -1) {
+		cl_args.flags |= CLONE_INTO_CGROUP;
+		cl_args.cgroup = args->cgroup_fd;
+	}
+
+	ret = syscall(SYS_clone3, &cl_args, sizeof(cl_args));
+	if (ret == -1) {
+		// ENOSYS: no clone3(); E2BIG/EINVAL: no CLONE_INTO_CGROUP
+		if (errno == ENOSYS || errno == E2BIG ||
+		    (errno == EINVAL && args->cgroup_fd != -1))
+			return -1;
+		bail("clone3");
+	}
+
+	if (ret == 0) {			// child
+		if (setup_rootfs(args) == -1 || wait_net(args) == -1)
+			_exit(EXIT_FAILURE);
+		// A copy of a process that may have batch workers running:
+		// neither exit() nor its stdio buffers are safe to use
+		execvp(args->argv[0], &args->argv[0]);
+		perror("execvp");
+		_exit(127);
+	}
+
+	ch->pid = ret;
+	return 0;
 }
 
-#define STACK_SIZE	(1024 * 1024)
-static char child_stack[STACK_SIZE];		// space for child's stack
+/* Batch workers call this concurrently, so use_legacy, which the first
+   of them to find clone3() missing sets for all, is accessed atomically */
+static void launch_child(int flags, struct child_args *args, struct child *ch) {
+	if (!__atomic_load_n(&use_legacy, __ATOMIC_RELAXED) && !use_vfork &&
+	    launch_clone3(flags, args, ch) == 0)
+		return;
+
+	__atomic_store_n(&use_legacy, 1, __ATOMIC_RELAXED);
+	launch_legacy(flags, args, ch);
+}
+
+/* Launch the command. With network setup (only for a new network
+   namespace) the child waits until we have done it; if it fails, the
+   child is told and exits without running the command */
+static void launch(int flags, struct child_args *args, struct child *ch) {
+	struct child_args	a;
+
+	a = *args;
+	a.sync = NULL;
+	if (a.net == NULL || !(flags & CLONE_NEWNET)) {
+		launch_child(flags, &a, ch);
+		return;
+	}
+
+	a.sync = ns_sync_create();
+	if (a.sync == NULL)
+		bail("ns_sync_create");
+	launch_child(flags, &a, ch);
+
+	if (ns_net_setup(ch->pid, a.net) == -1) {
+		fprintf(stderr, "network setup: %s\n", ns_error());
+		ns_sync_fail(a.sync, errno, "network setup");
+	} else {
+		ns_sync_post(a.sync, NS_SYNC_EXEC);
+	}
+	ns_sync_destroy(a.sync);
+}
+
+/* Wait for the child to terminate, and return its exit status, or 128
+   plus the signal number if it was killed. With a pidfd we wait on the
+   pidfd itself, so a recycled PID can never be mistaken for our child.
+   If `ru` is not NULL, the child's resource usage is returned there; we
+   call the raw waitid() system call, since only it reports that */
+static int wait_child(struct child *ch, struct rusage *ru) {
+	siginfo_t	info;
+	int status;
+
+	if (ch->pidfd != -1) {
+		if (syscall(SYS_waitid, P_PIDFD, ch->pidfd, &info, WEXITED, ru) == -1)
+			bail("waitid");
+		close(ch->pidfd);
+		status = (info.si_code == CLD_EXITED) ? info.si_status :
+						        128 + info.si_status;
+	} else {
+		if (wait4(ch->pid, &status, 0, ru) == -1)
+			bail("wait4");
+		status = WIFEXITED(status) ? WEXITSTATUS(status) :
+					     128 + WTERMSIG(status);
+	}
+
+	return status;
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Run the command `iterations` times through the given path and return
+   the mean clone+exec+exit round trip in microseconds */
+static double bench_path(int legacy, int vfork, int flags,
+			 struct child_args *args, int iterations) {
+	struct child ch;
+	double	start;
+	int j;
+
+	use_legacy = legacy;
+	use_vfork = vfork;
+	start = now_us();
+	for (j = 0; j < iterations; j++) {
+		launch(flags, args, &ch);
+		wait_child(&ch, NULL);
+	}
+	if (use_legacy != legacy)
+		return -1;		// clone3() turned out to be unsupported
+
+	return (now_us() - start) / iterations;
+}
+
+/* Compare the launch latency without a root filesystem, and with it built
+   through the new mount API and through mount(2) */
+static void bench_rootfs(int flags, struct child_args *args, int iterations) {
+	struct child_args	a;
+	double	none, api, legacy;
+
+	a = *args;
+	a.rootfs = NULL;
+	none = bench_path(0, 0, flags, &a, iterations);
+	a.rootfs = args->rootfs;
+	a.rootfs_flags = 0;
+	api = bench_path(0, 0, flags, &a, iterations);
+	a.rootfs_flags = NS_ROOTFS_LEGACY;
+	legacy = bench_path(0, 0, flags, &a, iterations);
+
+	printf("no rootfs:  %.1f us/launch\n", none);
+	printf("rootfs, new mount API: %.1f us/launch (%+.1f us)\n", api,
+	       api - none);
+	printf("rootfs, mount(2):      %.1f us/launch (%+.1f us)\n", legacy,
+	       legacy - none);
+}
+
+static void bench(int flags, struct child_args *args, int iterations) {
+	double	c3, legacy, vfork;
+
+	if (args->rootfs != NULL) {
+		bench_rootfs(flags, args, iterations);
+		return;
+	}
+
+	c3 = bench_path(0, 0, flags, args, iterations);
+	legacy = bench_path(1, 0, flags, args, iterations);
+	// A CLONE_VFORK child execs before we could set up its network
+	vfork = args->net ? -1 : bench_path(1, 1, flags, args, iterations);
+
+	printf("iterations: %d\n", iterations);
+	printf("clone():    %.1f us/launch\n", legacy);
+	if (vfork >= 0)
+		printf("clone(CLONE_VM|CLONE_VFORK): %.1f us/launch\n", vfork);
+	if (c3 < 0) {
+		printf("clone3():   not supported by this kernel\n");
+		return;
+	}
+	printf("clone3():   %.1f us/launch\n", c3);
+	printf("delta:      %+.1f us/launch (%+.1f%%)\n",
+	       c3 - legacy, 100 * (c3 - legacy) / legacy);
+}
+
+// One line of a batch manifest
+struct job {
+	char	**argv;
+	int	flags;		// namespaces to create for this job
+	int	line;		// manifest line number, identifies the job
+};
+
+/* A batch worker and its deque of job indices. The owner takes jobs
+   from the tail of its own deque; a worker whose deque is empty steals
+   from the head of another's */
+struct worker {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	int	*queue;
+	int	head, tail;
+	int	id;
+	struct batch	*batch;
+};
+
+struct batch {
+	struct job	*jobs;
+	int	njobs;
+	struct worker	*workers;
+	int	nworkers;
+	int	cgroup_fd;	// cgroup for every job, or -1
+	int	quiet;		// don't stream per-job results
+	struct ns_net	*net;	// network setup for jobs with -n, or NULL
+	struct ns_rootfs	*rootfs;	// root filesystem for every job, or NULL
+	int	rootfs_flags;
+	pthread_mutex_t	out_lock;
+};
+
+/* Read the manifest in `path`: one command per line, words separated by
+   white space. Empty lines and lines starting with `#` are skipped. A
+   leading `+FLAGS` word replaces `default_flags` for that line */
+static struct job *read_manifest(char *path, int default_flags, int *njobs) {
+	FILE	*fp;
+	struct job	*jobs;
+	char	*line, *word, *saveptr;
+	size_t	len;
+	int nalloc, nwords, lineno;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		bail("fopen");
+
+	jobs = NULL;
+	nalloc = *njobs = 0;
+	for (lineno = 1; ; lineno++) {
+		line = NULL;
+		len = 0;
+		if (getline(&line, &len, fp) == -1) {
+			free(line);
+			break;
+		}
+
+		word = strtok_r(line, " \t\n", &saveptr);
+		if (word == NULL || word[0] == '#') {
+			free(line);
+			continue;
+		}
+
+		if (*njobs == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 256;
+			jobs = realloc(jobs, nalloc * sizeof(struct job));
+			if (jobs == NULL)
+				bail("realloc");
+		}
+
+		jobs[*njobs].line = lineno;
+		jobs[*njobs].flags = default_flags;
+		if (word[0] == '+') {
+			jobs[*njobs].flags = ns_parse_letters(word + 1, NS_CLONE);
+			if (jobs[*njobs].flags == -1) {
+				fprintf(stderr, "%s:%d: %s\n", path, lineno,
+					ns_error());
+				exit(EXIT_FAILURE);
+			}
+			word = strtok_r(NULL, " \t\n", &saveptr);
+			if (word == NULL) {
+				fprintf(stderr, "%s:%d: no command\n", path, lineno);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		// Words point into `line`, which the job keeps for its lifetime
+		jobs[*njobs].argv = NULL;
+		for (nwords = 0; word != NULL; nwords++) {
+			jobs[*njobs].argv = realloc(jobs[*njobs].argv,
+						    (nwords + 2) * sizeof(char *));
+			if (jobs[*njobs].argv == NULL)
+				bail("realloc");
+			jobs[*njobs].argv[nwords] = word;
+			word = strtok_r(NULL, " \t\n", &saveptr);
+		}
+		jobs[*njobs].argv[nwords] = NULL;
+		(*njobs)++;
+	}
+
+	fclose(fp);
+	return jobs;
+}
+
+// Take the next job from our own deque, or return -1 if it is empty
+static int take_job(struct worker *w) {
+	int j = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail)
+		j = w->queue[--w->tail];
+	pthread_mutex_unlock(&w->lock);
+
+	return j;
+}
+
+// Steal a job from another worker, or return -1 if no work is left
+static int steal_job(struct worker *self) {
+	struct batch *b = self->batch;
+	struct worker *victim;
+	int k, j;
+
+	for (k = 1; k < b->nworkers; k++) {
+		victim = &b->workers[(self->id + k) % b->nworkers];
+
+		pthread_mutex_lock(&victim->lock);
+		j = (victim->head < victim->tail) ? victim->queue[victim->head++] : -1;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (j != -1)
+			return j;
+	}
+
+	return -1;
+}
+
+static void run_job(struct batch *b, struct job *job) {
+	struct child_args	args;
+	struct child	ch;
+	struct rusage	ru;
+	double	start, wall;
+	int status;
+
+	args.argv = job->argv;
+	args.cgroup_fd = b->cgroup_fd;
+	args.net = b->net;
+	args.rootfs = b->rootfs;		// every job has `m` with -R
+	args.rootfs_flags = b->rootfs_flags;
+
+	start = now_us();
+	launch(job->flags, &args, &ch);
+	status = wait_child(&ch, &ru);
+	wall = now_us() - start;
+
+	if (b->quiet)
+		return;
+
+	pthread_mutex_lock(&b->out_lock);
+	printf("%d\t%ld\t%d\t%.3f\t%.3f\t%.3f\t%s\n", job->line, (long) ch.pid,
+	       status, wall / 1e3,
+	       ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3,
+	       ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3,
+	       job->argv[0]);
+	fflush(stdout);
+	pthread_mutex_unlock(&b->out_lock);
+}
+
+static void *worker_func(void *arg) {
+	struct worker *w = arg;
+	int j;
+
+	while ((j = take_job(w)) != -1 || (j = steal_job(w)) != -1)
+		run_job(w->batch, &w->batch->jobs[j]);
+
+	return NULL;
+}
+
+/* Run every job of the batch on `nworkers` threads and return the
+   elapsed time in seconds. Jobs are dealt round-robin to the workers'
+   deques up front; from then on, work stealing keeps all workers busy
+   however unevenly the job run times are spread */
+static double run_batch(struct batch *b, int nworkers) {
+	struct worker	*w;
+	double	start;
+	int j, s;
+
+	b->nworkers = nworkers;
+	b->workers = calloc(nworkers, sizeof(struct worker));
+	if (b->workers == NULL)
+		bail("calloc");
+
+	for (j = 0; j < nworkers; j++) {
+		w = &b->workers[j];
+		w->id = j;
+		w->batch = b;
+		w->queue = malloc((b->njobs / nworkers + 1) * sizeof(int));
+		if (w->queue == NULL)
+			bail("malloc");
+		pthread_mutex_init(&w->lock, NULL);
+	}
+	for (j = b->njobs - 1; j >= 0; j--) {
+		w = &b->workers[j % nworkers];
+		w->queue[w->tail++] = j;	// owner pops from the tail: job 0 first
+	}
+
+	start = now_us();
+	for (j = 0; j < nworkers; j++) {
+		s = pthread_create(&b->workers[j].thread, NULL, worker_func,
+				   &b->workers[j]);
+		if (s != 0) {
+			errno = s;
+			bail("pthread_create");
+		}
+	}
+	for (j = 0; j < nworkers; j++)
+		pthread_join(b->workers[j].thread, NULL);
+
+	for (j = 0; j < nworkers; j++) {
+		pthread_mutex_destroy(&b->workers[j].lock);
+		free(b->workers[j].queue);
+	}
+	free(b->workers);
+
+	return (now_us() - start) / 1e6;
+}
+
+/* Run the batch once with `nworkers` workers, streaming one line per job,
+   or, if `sweep` is set, with 1, 2, 4, ... up to `nworkers` workers,
+   reporting only the throughput of each run */
+static void batch(struct batch *b, int nworkers, int sweep) {
+	double	secs;
+	int n;
+
+	if (!sweep) {
+		printf("# line\tpid\tstatus\twall_ms\tuser_ms\tsys_ms\tcmd\n");
+		secs = run_batch(b, nworkers);
+		printf("# jobs: %d workers: %d elapsed: %.3f s throughput: %.1f jobs/s\n",
+		       b->njobs, nworkers, secs, b->njobs / secs);
+		return;
+	}
+
+	b->quiet = 1;
+	printf("workers\tjobs\tseconds\tjobs/s\n");
+	for (n = 1; ; n = (n * 2 < nworkers) ? n * 2 : nworkers) {
+		secs = run_batch(b, n);
+		printf("%d\t%d\t%.3f\t%.1f\n", n, b->njobs, secs, b->njobs / secs);
+		fflush(stdout);
+		if (n == nworkers)
+			break;
+	}
+}
 
 int main(int argc, char **argv) {
-	int flags, opt, verbose;
-	pid_t	child_pid;
+	int flags, opt, verbose, iterations, nworkers, sweep, j;
+	char	*cgroup, *manifest, *net_spec, *rootfs_list;
+	struct ns_net	net;
+	struct batch	b;
+	struct child_args	args;
+	struct child	ch;
 
 	flags = 0;
+	args.rootfs_flags = 0;
 	verbose = 0;
+	iterations = 0;
+	cgroup = NULL;
+	manifest = NULL;
+	net_spec = NULL;
+	rootfs_list = NULL;
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	sweep = 0;
 
 	/* Parse command-line options
 	 the initial `+` character in the final getopt() argument
@@ -56,7 +635,7 @@ int main(int argc, char **argv) {
 	 programe itself has command-line options.
 	 We do not want getopt() to treat those as options to this program.
 	*/
-	while ((opt = getopt(argc, argv, "+imnpuUv")) != -1) {
+	while ((opt = getopt(argc, argv, "+imnpuUvc:LVB:f:j:JN:R:O")) != -1) {
 		switch(opt) {
 		case 'i': flags |= CLONE_NEWIPC;	break;
 		case 'm': flags |= CLONE_NEWNS;		break;
@@ -64,24 +643,93 @@ int main(int argc, char **argv) {
 		case 'p': flags |= CLONE_NEWPID;	break;
 		case 'u': flags |= CLONE_NEWUTS;	break;
 		case 'U': flags |= CLONE_NEWUSER;	break;
-		case 'v': verbose = 1;
+		case 'c': cgroup = optarg;		break;
+		case 'L': use_legacy = 1;		break;
+		case 'V': use_vfork = 1;		break;
+		case 'B': iterations = atoi(optarg);	break;
+		case 'f': manifest = optarg;		break;
+		case 'j': nworkers = atoi(optarg);	break;
+		case 'J': sweep = 1;			break;
+		case 'N': net_spec = optarg;		break;
+		case 'R': rootfs_list = optarg;		break;
+		case 'O': args.rootfs_flags = NS_ROOTFS_LEGACY;	break;
+		case 'v': verbose = 1;			break;
 		default: usage(argv[0]);
 		}
 	}
 
-	if (optind >= argc)
+	if ((manifest == NULL) == (optind >= argc) || nworkers < 1)
 		usage(argv[0]);
 
-	child_pid = clone(childFunc, child_stack + STACK_SIZE, flags | SIGCHLD, &argv[optind]);
-	if (child_pid == -1)
-		bail("clone");
+	// A CLONE_VFORK child would exec before its network is set up
+	if (net_spec != NULL && (use_vfork ||
+	    (manifest == NULL && !(flags & CLONE_NEWNET))))
+		usage(argv[0]);
+
+	// Every job gets the root filesystem, so every job needs -m
+	if (rootfs_list != NULL && !(flags & CLONE_NEWNS))
+		usage(argv[0]);
+
+	args.argv = &argv[optind];
+	args.cgroup_fd = -1;
+	args.net = NULL;
+	args.rootfs = NULL;
+	if (rootfs_list != NULL) {
+		args.rootfs = ns_rootfs_load(rootfs_list);
+		if (args.rootfs == NULL) {
+			fprintf(stderr, "-R: %s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (net_spec != NULL) {
+		if (ns_net_parse(net_spec, &net) == -1) {
+			fprintf(stderr, "-N: %s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+		args.net = &net;
+	}
+	if (cgroup != NULL) {
+		args.cgroup_fd = open(cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (args.cgroup_fd == -1)
+			bail("open cgroup");
+	}
+
+	if (manifest != NULL) {
+		memset(&b, 0, sizeof(b));
+		b.jobs = read_manifest(manifest, flags, &b.njobs);
+
+		// Nor may a manifest line leave it out, and run in our root
+		for (j = 0; args.rootfs != NULL && j < b.njobs; j++) {
+			if (!(b.jobs[j].flags & CLONE_NEWNS)) {
+				fprintf(stderr, "%s:%d: -R needs `m` in the "
+					"namespaces of every job\n", manifest,
+					b.jobs[j].line);
+				exit(EXIT_FAILURE);
+			}
+		}
+		b.cgroup_fd = args.cgroup_fd;
+		b.net = args.net;
+		b.rootfs = args.rootfs;
+		b.rootfs_flags = args.rootfs_flags;
+		pthread_mutex_init(&b.out_lock, NULL);
+		batch(&b, nworkers, sweep);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (iterations > 0) {
+		bench(flags, &args, iterations);
+		exit(EXIT_SUCCESS);
+	}
+
+	launch(flags, &args, &ch);
 
 	if (verbose)
-		printf("%s: PId of child created by clone() is %ld\n", argv[0], (long) child_pid);
+		printf("%s: PId of child created by %s is %ld\n", argv[0],
+		       use_vfork ? "clone(CLONE_VM|CLONE_VFORK)" :
+		       use_legacy ? "clone()" : "clone3()", (long) ch.pid);
 
 	// Parent falls through to here
-	if (waitpid(child_pid, NULL, 0) == -1)
-		bail("waitpid");
+	wait_child(&ch, NULL);
 
 	if (verbose)
 		printf("%s: terminating\n", argv[0]);
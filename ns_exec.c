@@ -1,6 +1,12 @@
 /* ns_exec.c
  *
  * Join a namespace and execute a command in the namespace
+ *
+ * Given a PID instead of a /proc/PID/ns/FILE path, join all the
+ * namespaces of that process at once, through a single setns() call on
+ * a pidfd (Linux 5.8 and later), or else one /proc/PID/ns file at a time.
+ *
+ * Build with: cc -o ns_exec ns_exec.c libns.c -pthread
  **/
 
 #define _GNU_SOURCE
@@ -9,6 +15,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include "libns.h"
 
 /* A simple error-handling function: print an error message based
    on the value `errno` and terminate the calling process
@@ -19,19 +27,31 @@
 	} while (0)
 
 int main(int argc, char **argv) {
+	pid_t	pid;
 	int fd;
 
 	if (argc < 3) {
 		fprintf(stderr, "%s /proc/PID/ns/FILE cmd args...\n", argv[0]);
+		fprintf(stderr, "%s PID cmd args...\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	fd = open(argv[1], O_RDONLY);		// get file descriptor for namespace
-	if (fd == -1)
-		bail("open");
-
-	if (setns(fd, 0) == -1)			// join that namespace
-		bail("setns");
+	if (strspn(argv[1], "0123456789") == strlen(argv[1])) {
+		// Join all namespaces of PID that we aren't in already
+		pid = atol(argv[1]);
+		if (ns_join(pid, ns_foreign(pid, NS_ALL),
+			    NS_JOIN_PIDFD | NS_JOIN_FILES) == -1) {
+			fprintf(stderr, "%s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		fd = open(argv[1], O_RDONLY);	// get file descriptor for namespace
+		if (fd == -1)
+			bail("open");
+
+		if (setns(fd, 0) == -1)		// join that namespace
+			bail("setns");
+	}
 
 	execvp(argv[2], &argv[2]);		// execute a command in namespace
 	bail("execvp");
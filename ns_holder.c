@@ -0,0 +1,559 @@
+/* ns_holder.c
+ *
+ * Keep namespaces alive without keeping processes around, and hand them
+ * out by name.
+ *
+ * Run as a server (-s SOCKET), the program holds open file descriptors
+ * for sets of namespaces, which is all that is needed to keep a namespace
+ * alive. A set is either created by the server or adopted from a running
+ * process, and is given a name. Clients get the descriptors of a set over
+ * the Unix domain socket (SCM_RIGHTS), so they can join the namespaces
+ * without looking up a process or resolving /proc/PID/ns paths.
+ * With -b DIR, each held namespace is also bind mounted at DIR/NAME/TYPE,
+ * which keeps it alive even after the server has gone.
+ *
+ * Server requests, sent with -c, are text messages:
+ *
+ *     create NAME TYPES       create new namespaces
+ *     adopt NAME PID TYPES    hold the namespaces of process PID
+ *     get NAME                reply with the descriptors of a set
+ *     drop NAME               release a set
+ *     list                    show all sets
+ *
+ * A PID namespace is only usable while its init is alive, so for created
+ * PID namespaces the server also keeps a process that serves as init.
+ * An adopted PID namespace lives only as long as the adopted init does.
+ *
+ * Held descriptors give access to the namespaces of any process the
+ * server could open, so the socket is created with mode 0600 and only
+ * requests from the server's own user or root are served. Set names are
+ * made of letters, digits, `_`, `.` and `-`, and can't be `.` or `..`,
+ * since with -b they name directories under DIR.
+ *
+ * TYPES is a string of namespace letters: U (user), c (cgroup), i (ipc),
+ * u (uts), n (net), p (pid), T (time, which can only be adopted) and m
+ * (mount).
+ *
+ * Usage examples:
+ *
+ *     ns_holder -s /run/nsh.sock &
+ *     ns_holder -s /run/nsh.sock -c 'create web nu'
+ *     ns_holder -s /run/nsh.sock -j web hostname
+ *
+ * Build with: cc -o ns_holder ns_holder.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+#define MSG_SIZE	4096
+#define NAME_MAX_LEN	64
+#define MAX_SETS	1024
+
+// A named set of held namespaces
+struct ns_set {
+	char	name[NAME_MAX_LEN];
+	int	fds[NS_TYPES];	// by ns_types[]; -1 where not part of the set
+	pid_t	init_pid;	// init we keep for a created PID namespace, or 0
+};
+
+static struct ns_set *sets[MAX_SETS];
+static char *bind_dir;		// -b: where to bind mount held namespaces
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s -s socket [-b dir]\n", name);
+	fprintf(stderr, "       %s -s socket -c request\n", name);
+	fprintf(stderr, "       %s -s socket -j name [-f] cmd [arg...]\n", name);
+	fprintf(stderr, "\t-s socket  Unix domain socket of the server\n");
+	fprintf(stderr, "\t-b dir     Also bind mount held namespaces under dir\n");
+	fprintf(stderr, "\t-c request Send a request to the server, print reply\n");
+	fprintf(stderr, "\t-j name    Join the namespace set `name` and execute cmd\n");
+	fprintf(stderr, "\t-f         Execute cmd in a child process (needed to\n");
+	fprintf(stderr, "\t           actually enter a PID namespace)\n");
+	exit(EXIT_FAILURE);
+}
+
+/* Send the message `msg`, with the `nfds` descriptors in `fds` attached,
+   on the connected socket `sfd` */
+static int send_msg(int sfd, const char *msg, int *fds, int nfds) {
+	struct msghdr	mh;
+	struct iovec	iov;
+	struct cmsghdr	*cm;
+	union {
+		char	buf[CMSG_SPACE(sizeof(int) * NS_TYPES)];
+		struct cmsghdr	align;
+	} control;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = (void *) msg;
+	iov.iov_len = strlen(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+	}
+
+	return sendmsg(sfd, &mh, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/* Receive a message into `buf` (NUL-terminated), and up to NS_TYPES
+   attached descriptors into `fds`. Returns the number of descriptors,
+   or -1 on error */
+static int recv_msg(int sfd, char *buf, size_t size, int *fds) {
+	struct msghdr	mh;
+	struct iovec	iov;
+	struct cmsghdr	*cm;
+	ssize_t	n;
+	int nfds;
+	union {
+		char	buf[CMSG_SPACE(sizeof(int) * NS_TYPES)];
+		struct cmsghdr	align;
+	} control;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = size - 1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(sfd, &mh, MSG_CMSG_CLOEXEC);
+	if (n == -1)
+		return -1;
+	buf[n] = '\0';
+
+	nfds = 0;
+	for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), sizeof(int) * nfds);
+		}
+	}
+
+	return nfds;
+}
+
+// Whether `name` can name a set, and so a directory under bind_dir
+static int valid_name(const char *name) {
+	const char	*p;
+
+	if (strlen(name) >= NAME_MAX_LEN || strcmp(name, ".") == 0 ||
+	    strcmp(name, "..") == 0)
+		return 0;
+	for (p = name; *p != '\0'; p++)
+		if (!isalnum((unsigned char) *p) && strchr("_.-", *p) == NULL)
+			return 0;
+
+	return p != name;
+}
+
+static struct ns_set *find_set(const char *name) {
+	int j;
+
+	for (j = 0; j < MAX_SETS; j++)
+		if (sets[j] != NULL && strcmp(sets[j]->name, name) == 0)
+			return sets[j];
+
+	return NULL;
+}
+
+/* Bind mount each namespace of `set` at bind_dir/NAME/TYPE, so that it
+   stays alive even without us */
+static int pin_set(struct ns_set *set) {
+	char	path[PATH_MAX], src[64];
+	int j, fd;
+
+	snprintf(path, sizeof(path), "%s/%s", bind_dir, set->name);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		return -1;
+
+	for (j = 0; j < NS_TYPES; j++) {
+		if (set->fds[j] == -1)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", bind_dir, set->name,
+			 ns_types[j].name);
+		fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0444);
+		if (fd == -1)
+			return -1;
+		close(fd);
+
+		snprintf(src, sizeof(src), "/proc/self/fd/%d", set->fds[j]);
+		if (mount(src, path, NULL, MS_BIND, NULL) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void unpin_set(struct ns_set *set) {
+	char	path[PATH_MAX];
+	int j;
+
+	for (j = 0; j < NS_TYPES; j++) {
+		if (set->fds[j] == -1)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/%s", bind_dir, set->name,
+			 ns_types[j].name);
+		umount2(path, MNT_DETACH);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/%s", bind_dir, set->name);
+	rmdir(path);
+}
+
+static void close_set(struct ns_set *set) {
+	int j;
+
+	for (j = 0; j < NS_TYPES; j++)
+		if (set->fds[j] != -1)
+			close(set->fds[j]);
+	if (set->init_pid > 0) {
+		kill(set->init_pid, SIGKILL);
+		waitpid(set->init_pid, NULL, 0);
+	}
+	free(set);
+}
+
+// Holder child: tell the server that the namespaces exist, then wait
+static int holdFunc(void *arg) {
+	int *pfd = arg;
+	char ch = 'k';
+
+	close(pfd[0]);
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (write(pfd[1], &ch, 1) != 1)
+		_exit(EXIT_FAILURE);
+	close(pfd[1]);
+	while (1)
+		pause();		// until killed by the server
+}
+
+/* Create new namespaces of the types in `flags`, by clone()ing a child
+   into them. We take hold of the namespaces through /proc/CHILD/ns while
+   the child waits for us. Descriptors are enough for every type but PID:
+   a PID namespace whose init has gone can't be used any more, so for
+   those the child stays around as the namespace's init */
+static int create_ns(struct ns_set *set, int flags) {
+	int	pfd[2], ret, saved_errno;
+	pid_t	pid;
+	char	ch;
+
+	if (pipe(pfd) == -1)
+		return -1;
+
+	pid = ns_clone(holdFunc, pfd, flags);
+	saved_errno = errno;
+	close(pfd[1]);
+	if (pid == -1) {
+		close(pfd[0]);
+		errno = saved_errno;
+		return -1;
+	}
+
+	ret = -1;
+	saved_errno = ECHILD;
+	if (read(pfd[0], &ch, 1) == 1) {
+		ret = ns_open(pid, flags, set->fds);
+		saved_errno = errno;
+	}
+	close(pfd[0]);
+
+	if (ret == 0 && (flags & CLONE_NEWPID)) {
+		set->init_pid = pid;
+	} else {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+
+	errno = saved_errno;
+	return ret;
+}
+
+/* Handle one request in `req`; the reply goes to `reply`, and any
+   descriptors to pass along with it to `fds` */
+static int handle_request(char *req, char *reply, int *fds) {
+	char	*cmd, *name, *arg, *arg2, *saveptr;
+	struct ns_set	*set;
+	int flags, j, n, slot;
+
+	cmd = strtok_r(req, " \t\n", &saveptr);
+	name = strtok_r(NULL, " \t\n", &saveptr);
+	arg = strtok_r(NULL, " \t\n", &saveptr);
+	arg2 = strtok_r(NULL, " \t\n", &saveptr);
+
+	if (cmd != NULL && strcmp(cmd, "list") == 0) {
+		for (n = 0, j = 0; j < MAX_SETS && n < MSG_SIZE - 100; j++) {
+			if (sets[j] == NULL)
+				continue;
+			n += snprintf(reply + n, MSG_SIZE - n, "%s ", sets[j]->name);
+			for (slot = 0; slot < NS_TYPES; slot++)
+				if (sets[j]->fds[slot] != -1)
+					reply[n++] = ns_types[slot].letter;
+			reply[n++] = '\n';
+		}
+		reply[n] = '\0';
+		return 0;
+	}
+
+	if (cmd == NULL || name == NULL || !valid_name(name)) {
+		snprintf(reply, MSG_SIZE, "error bad request\n");
+		return 0;
+	}
+
+	if (strcmp(cmd, "get") == 0) {
+		set = find_set(name);
+		if (set == NULL) {
+			snprintf(reply, MSG_SIZE, "error no such set\n");
+			return 0;
+		}
+
+		// The descriptors follow in ns_types order, as listed in the reply
+		n = snprintf(reply, MSG_SIZE, "ok ");
+		for (j = 0, slot = 0; j < NS_TYPES; j++) {
+			if (set->fds[j] != -1) {
+				reply[n++] = ns_types[j].letter;
+				fds[slot++] = set->fds[j];
+			}
+		}
+		reply[n++] = '\n';
+		reply[n] = '\0';
+		return slot;
+	}
+
+	if (strcmp(cmd, "drop") == 0) {
+		for (j = 0; j < MAX_SETS; j++) {
+			if (sets[j] != NULL && strcmp(sets[j]->name, name) == 0) {
+				if (bind_dir != NULL)
+					unpin_set(sets[j]);
+				close_set(sets[j]);
+				sets[j] = NULL;
+				snprintf(reply, MSG_SIZE, "ok\n");
+				return 0;
+			}
+		}
+		snprintf(reply, MSG_SIZE, "error no such set\n");
+		return 0;
+	}
+
+	if (strcmp(cmd, "create") != 0 && strcmp(cmd, "adopt") != 0) {
+		snprintf(reply, MSG_SIZE, "error unknown request\n");
+		return 0;
+	}
+
+	if (find_set(name) != NULL) {
+		snprintf(reply, MSG_SIZE, "error set exists\n");
+		return 0;
+	}
+	for (slot = 0; slot < MAX_SETS && sets[slot] != NULL; slot++)
+		continue;
+	if (slot == MAX_SETS) {
+		snprintf(reply, MSG_SIZE, "error too many sets\n");
+		return 0;
+	}
+
+	// A time namespace can be adopted, but clone() can't create one
+	if (strcmp(cmd, "create") == 0)
+		flags = ns_parse_letters(arg ? arg : "", NS_CLONE);
+	else
+		flags = ns_parse_letters(arg2 ? arg2 : "", NS_ALL);
+	if (flags <= 0 || (strcmp(cmd, "adopt") == 0 && atol(arg) <= 0)) {
+		snprintf(reply, MSG_SIZE, "error bad namespace types or PID\n");
+		return 0;
+	}
+
+	set = calloc(1, sizeof(struct ns_set));
+	if (set == NULL)
+		bail("calloc");
+	strcpy(set->name, name);
+	for (j = 0; j < NS_TYPES; j++)
+		set->fds[j] = -1;
+
+	if ((strcmp(cmd, "create") == 0 ? create_ns(set, flags) :
+	     ns_open(atol(arg), flags, set->fds)) == -1 ||
+	    (bind_dir != NULL && pin_set(set) == -1)) {
+		snprintf(reply, MSG_SIZE, "error %s\n", strerror(errno));
+		if (bind_dir != NULL)
+			unpin_set(set);
+		close_set(set);
+		return 0;
+	}
+
+	sets[slot] = set;
+	snprintf(reply, MSG_SIZE, "ok\n");
+	return 0;
+}
+
+static void serve(char *path) {
+	struct sockaddr_un	addr;
+	struct ucred	cred;
+	socklen_t	len;
+	char	req[MSG_SIZE], reply[MSG_SIZE];
+	int	lfd, cfd, fds[NS_TYPES], nfds, j;
+	mode_t	old_umask;
+
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lfd == -1)
+		bail("socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	old_umask = umask(077);		// the socket is ours alone
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		bail("bind");
+	umask(old_umask);
+	if (listen(lfd, SOMAXCONN) == -1)
+		bail("listen");
+
+	// Requests are short; handle them one at a time
+	while (1) {
+		cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			bail("accept4");
+		}
+
+		nfds = recv_msg(cfd, req, sizeof(req), fds);
+		if (nfds > 0)			// clients don't send descriptors
+			for (j = 0; j < nfds; j++)
+				close(fds[j]);
+
+		// Only our own user and root may get at what we hold
+		len = sizeof(cred);
+		if (nfds != -1 &&
+		    (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+		     (cred.uid != getuid() && cred.uid != 0))) {
+			send_msg(cfd, "error permission denied\n", NULL, 0);
+		} else if (nfds != -1) {
+			nfds = handle_request(req, reply, fds);
+			send_msg(cfd, reply, fds, nfds);
+		}
+		close(cfd);
+	}
+}
+
+// Send `req` to the server at `path`; return the number of descriptors
+// received with the reply, which is left in `reply`
+static int request(char *path, char *req, char *reply, int *fds) {
+	struct sockaddr_un	addr;
+	int	sfd, nfds;
+
+	sfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sfd == -1)
+		bail("socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(sfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		bail("connect");
+
+	if (send_msg(sfd, req, NULL, 0) == -1)
+		bail("sendmsg");
+	nfds = recv_msg(sfd, reply, MSG_SIZE, fds);
+	if (nfds == -1)
+		bail("recvmsg");
+
+	close(sfd);
+	return nfds;
+}
+
+int main(int argc, char **argv) {
+	char	*sock_path, *req, *join, reply[MSG_SIZE], msg[MSG_SIZE];
+	int	opt, do_fork, fds[NS_TYPES], nfds, j;
+	pid_t	pid;
+
+	sock_path = req = join = NULL;
+	do_fork = 0;
+
+	while ((opt = getopt(argc, argv, "+s:b:c:j:f")) != -1) {
+		switch (opt) {
+		case 's': sock_path = optarg;	break;
+		case 'b': bind_dir = optarg;	break;
+		case 'c': req = optarg;		break;
+		case 'j': join = optarg;	break;
+		case 'f': do_fork = 1;		break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (sock_path == NULL || (req != NULL && join != NULL) ||
+	    ((join != NULL) != (optind < argc)))
+		usage(argv[0]);
+
+	if (req != NULL) {
+		nfds = request(sock_path, req, reply, fds);
+		for (j = 0; j < nfds; j++)
+			close(fds[j]);
+		printf("%s", reply);
+		exit(strncmp(reply, "error", 5) == 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (join == NULL) {
+		serve(sock_path);
+		exit(EXIT_SUCCESS);
+	}
+
+	// The descriptors arrive in joining order, one per letter in the reply
+	snprintf(msg, sizeof(msg), "get %s", join);
+	nfds = request(sock_path, msg, reply, fds);
+	if (strncmp(reply, "ok ", 3) != 0) {
+		fprintf(stderr, "%s: %s", join, reply);
+		exit(EXIT_FAILURE);
+	}
+	for (j = 0; j < nfds; j++) {
+		if (setns(fds[j], 0) == -1)
+			bail("setns");
+		close(fds[j]);
+	}
+
+	// As with ns_run -f: joining a PID namespace only affects children
+	if (do_fork) {
+		pid = fork();
+		if (pid == -1)
+			bail("fork");
+		if (pid != 0) {
+			if (waitpid(pid, NULL, 0) == -1)
+				bail("waitpid");
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	execvp(argv[optind], &argv[optind]);
+	bail("execvp");
+}
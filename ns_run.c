@@ -5,6 +5,14 @@
  *
  * This program is similar in concept to nsenter(1), but has a
  * different command-line interface.
+ *
+ * With "-p PID", several namespaces of a process are joined in a single
+ * setns() call on a pidfd for it (Linux 5.8 and later), so that we can
+ * never end up in a mix of old and new namespaces of a process that
+ * exits half way. On older kernels we fall back to opening and joining
+ * the /proc/PID/ns files one by one.
+ *
+ * Build with: cc -o ns_run ns_run.c libns.c -pthread
  */
 #define _GNU_SOURCE
 #include <fcntl.h>
@@ -12,7 +20,11 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
 #include <sys/wait.h>
+#include "libns.h"
 
 
 
@@ -27,18 +39,132 @@
 
 static void usage( char *pname )
 {
-	fprintf( stderr, "Usage: %s [-f] [-n /proc/PID/ns/FILE] cmd [arg...]\n",
-		 pname );
+	fprintf( stderr, "Usage: %s [-f [-V]] [-n /proc/PID/ns/FILE] "
+		 "[-t TYPES] [-p PID] cmd [arg...]\n", pname );
+	fprintf( stderr, "       %s -B num [-t TYPES] -p PID\n", pname );
 	fprintf( stderr, "\t-f     Execute command in child process\n" );
+	fprintf( stderr, "\t-V     Create that child with CLONE_VM|CLONE_VFORK\n" );
 	fprintf( stderr, "\t-n     Join specified namespace\n" );
+	fprintf( stderr, "\t-p     Join the namespaces of process PID at once\n" );
+	fprintf( stderr, "\t-t     Namespaces joined by a later -p: any of\n" );
+	fprintf( stderr, "\t       U (user), c (cgroup), i (ipc), u (uts),\n" );
+	fprintf( stderr, "\t       n (net), p (pid), T (time), m (mount);\n" );
+	fprintf( stderr, "\t       default: all those not already ours\n" );
+	fprintf( stderr, "\t-B     Time joining 1, 2, ... of the namespaces of\n" );
+	fprintf( stderr, "\t       PID through a pidfd and through /proc/PID/ns\n" );
 
 	exit( EXIT_FAILURE );
 }
 
 
+/* Start function for a child created with CLONE_VM|CLONE_VFORK. The
+ * child borrows our memory until it execs, so on failure it must not
+ * call exit(), which would flush our stdio buffers; it returns instead,
+ * and clone() then terminates it with _exit(). */
+
+static int childFunc( void *arg )
+{
+	char	**argv = arg;
+
+	execvp( argv[0], argv );
+	perror( "execvp" );
+	return EXIT_FAILURE;
+}
+
+
+static double now_us( void )
+{
+	struct timespec	ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/* Time one join in a forked child, so that we stay in our own
+ * namespaces; returns the mean latency in microseconds over `count`
+ * joins, or -1 if joining failed. */
+
+static double time_join( pid_t pid, int flags, int by_pidfd, int count )
+{
+	double	total, start;
+	pid_t	child;
+	int	pfd[2], j, ret;
+
+	total = 0;
+	for ( j = 0; j < count; j++ )
+	{
+		if ( pipe( pfd ) == -1 )
+			bail( "pipe" );
+
+		child = fork();
+		if ( child == -1 )
+			bail( "fork" );
+
+		if ( child == 0 )
+		{
+			start = now_us();
+			ret = ns_join( pid, flags, by_pidfd ? NS_JOIN_PIDFD :
+							      NS_JOIN_FILES );
+			start = ( ret == 0 ) ? now_us() - start : -1;
+			if ( write( pfd[1], &start, sizeof( start ) ) != sizeof( start ) )
+				_exit( EXIT_FAILURE );
+			_exit( EXIT_SUCCESS );
+		}
+
+		close( pfd[1] );
+		if ( read( pfd[0], &start, sizeof( start ) ) != sizeof( start ) )
+			start = -1;
+		close( pfd[0] );
+		if ( waitpid( child, NULL, 0 ) == -1 )
+			bail( "waitpid" );
+
+		if ( start < 0 )
+			return -1;
+		total += start;
+	}
+
+	return total / count;
+}
+
+
+/* Benchmark: time joining the first 1, 2, ... of the selected
+ * namespaces of `pid` through a pidfd and through the /proc files. */
+
+static void bench_join( pid_t pid, int flags, int count )
+{
+	double	by_pidfd, by_files;
+	int	j, n, subset;
+
+	flags = ns_foreign( pid, flags );
+
+	printf( "# namespaces\ttypes\tpidfd_us\tfiles_us\n" );
+	for ( subset = 0, n = 0, j = 0; j < NS_TYPES; j++ )
+	{
+		if ( !( flags & ns_types[j].flag ) )
+			continue;
+		subset |= ns_types[j].flag;
+		n++;
+
+		by_pidfd = time_join( pid, subset, 1, count );
+		by_files = time_join( pid, subset, 0, count );
+		printf( "%d\t%s\t", n, ns_types[j].name );
+		if ( by_pidfd < 0 )
+			printf( "unsupported\t" );
+		else
+			printf( "%.1f\t", by_pidfd );
+		if ( by_files < 0 )
+			printf( "failed\n" );
+		else
+			printf( "%.1f\n", by_files );
+		fflush( stdout );
+	}
+}
+
+
 int main( int argc, char *argv[] )
 {
-	int	fd, opt, do_fork;
+	int	fd, opt, do_fork, use_vfork, types, bench;
 	pid_t	pid;
 
 
@@ -50,7 +176,11 @@ int main( int argc, char *argv[] )
 	 * those as options to this program. */
 
 	do_fork = 0;
-	while ( (opt = getopt( argc, argv, "+fn:" ) ) != -1 )
+	use_vfork = 0;
+	types = NS_ALL;
+	bench = 0;
+	pid = 0;
+	while ( (opt = getopt( argc, argv, "+fn:Vp:t:B:" ) ) != -1 )
 	{
 		switch ( opt )
 		{
@@ -67,11 +197,44 @@ int main( int argc, char *argv[] )
 			do_fork = 1;
 			break;
 
+		case 'V':
+			use_vfork = 1;
+			break;
+
+		case 't':                               /* Types for -p */
+			types = ns_parse_letters( optarg, NS_ALL );
+			if ( types <= 0 )
+				usage( argv[0] );
+			break;
+
+		case 'p':                               /* Join namespaces of a PID */
+			pid = atol( optarg );
+			if ( !bench &&
+			     ns_join( pid, ns_foreign( pid, types ),
+				      NS_JOIN_PIDFD | NS_JOIN_FILES ) == -1 )
+			{
+				fprintf( stderr, "%s\n", ns_error() );
+				exit( EXIT_FAILURE );
+			}
+			break;
+
+		case 'B':
+			bench = atoi( optarg );
+			break;
+
 		default:
 			usage( argv[0] );
 		}
 	}
 
+	if ( bench > 0 )
+	{
+		if ( pid <= 0 )
+			usage( argv[0] );
+		bench_join( pid, types, bench );
+		exit( EXIT_SUCCESS );
+	}
+
 	if ( argc <= optind )
 		usage( argv[0] );
 
@@ -80,13 +243,22 @@ int main( int argc, char *argv[] )
 	 * in a child process. This is mainly useful when working with PID
 	 * namespaces, since setns() to a PID namespace only places
 	 * (subsequently created) child processes in the names, and
-	 * does not affect the PID namespace membership of the caller. */
+	 * does not affect the PID namespace membership of the caller.
+	 *
+	 * With "-V" the child is created as vfork() would create it: it
+	 * shares our memory and we are suspended until it execs, which
+	 * avoids copying our page tables. We install no signal handlers,
+	 * so none can run in the child on our memory. */
 
 	if ( do_fork )
 	{
-		pid = fork();
+		if ( use_vfork )
+			pid = ns_clone( childFunc, &argv[optind],
+					CLONE_VM | CLONE_VFORK );
+		else
+			pid = fork();
 		if ( pid == -1 )
-			bail( "fork" );
+			bail( use_vfork ? "clone" : "fork" );
 
 		if ( pid != 0 )                                 /* Parent */
 		{
@@ -0,0 +1,199 @@
+/* ns_spec.c
+ *
+ * Compile a sandbox spec (see libns.h for the format) into the binary
+ * form that launchers map with ns_spec_open(), show what a compiled spec
+ * holds, or measure what compiling saves each launch.
+ *
+ *   ns_spec spec.txt spec.bin	compile
+ *   ns_spec -c spec.txt		only check the text
+ *   ns_spec -d spec.bin		dump a compiled spec
+ *   ns_spec -b num spec.txt	parse and check spec.txt `num` times, then
+ *				compile it and open the result `num` times
+ *
+ * userns_child_exec takes a compiled spec with -S.
+ *
+ * Build with: cc -o ns_spec ns_spec.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options] spec.txt spec.bin\n", name);
+	fprintf(stderr, "       %s -c spec.txt\n", name);
+	fprintf(stderr, "       %s -d spec.bin\n", name);
+	fprintf(stderr, "       %s -b num spec.txt\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-c	 check spec.txt without compiling it\n");
+	fprintf(stderr, "	-d	 dump the compiled spec spec.bin\n");
+	fprintf(stderr, "	-b num	 compare parsing spec.txt with opening its\n");
+	fprintf(stderr, "		 compiled form, `num` times each\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Print a map's text, one extent per line, indented
+static void dump_map(const char *what, const char *map) {
+	const char	*p, *nl;
+
+	if (map == NULL)
+		return;
+	printf("%s:\n", what);
+	for (p = map; *p != '\0'; p = nl + 1) {
+		nl = strchr(p, '\n');
+		if (nl == NULL)
+			nl = p + strlen(p) - 1;
+		printf("  %.*s\n", (int) (nl - p), p);
+	}
+}
+
+static void dump(const char *path) {
+	static const char	*limits[RLIM_NLIMITS] = {
+		[RLIMIT_AS] = "as", [RLIMIT_CORE] = "core", [RLIMIT_CPU] = "cpu",
+		[RLIMIT_DATA] = "data", [RLIMIT_FSIZE] = "fsize",
+		[RLIMIT_MEMLOCK] = "memlock", [RLIMIT_MSGQUEUE] = "msgqueue",
+		[RLIMIT_NICE] = "nice", [RLIMIT_NOFILE] = "nofile",
+		[RLIMIT_NPROC] = "nproc", [RLIMIT_RSS] = "rss",
+		[RLIMIT_RTPRIO] = "rtprio", [RLIMIT_RTTIME] = "rttime",
+		[RLIMIT_SIGPENDING] = "sigpending", [RLIMIT_STACK] = "stack",
+	};
+	const struct ns_spec	*spec;
+	const struct ns_limit	*l;
+	char	addr[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
+	size_t	j;
+	int k;
+
+	spec = ns_spec_open(path);
+	if (spec == NULL) {
+		fprintf(stderr, "%s\n", ns_error());
+		exit(EXIT_FAILURE);
+	}
+
+	printf("namespaces:");
+	for (j = 0; j < NS_TYPES; j++)
+		if (spec->flags & ns_types[j].flag)
+			printf(" %s", ns_types[j].name);
+	printf("\n");
+	dump_map("uid_map", spec->uid_map);
+	dump_map("gid_map", spec->gid_map);
+	if (spec->hostname != NULL)
+		printf("hostname: %s\n", spec->hostname);
+	if (spec->net != NULL) {
+		if (!spec->net->veth) {
+			printf("net: lo\n");
+		} else {
+			inet_ntop(AF_INET, &spec->net->addr, addr, sizeof(addr));
+			inet_ntop(AF_INET, &spec->net->gateway, gw, sizeof(gw));
+			printf("net: veth %s %s/%d via %s\n", spec->net->host_if,
+			       addr, spec->net->prefix, gw);
+		}
+	}
+	if (spec->rootfs != NULL)
+		printf("rootfs: yes\n");
+	for (k = 0; k < spec->nlimits; k++) {
+		l = &spec->limits[k];
+		if (l->resource >= 0 && l->resource < RLIM_NLIMITS &&
+		    limits[l->resource] != NULL)
+			printf("limit %s:", limits[l->resource]);
+		else
+			printf("limit %d:", l->resource);
+		printf(" %lld %lld\n",
+		       l->rlim.rlim_cur == RLIM_INFINITY ? -1LL :
+		       (long long) l->rlim.rlim_cur,
+		       l->rlim.rlim_max == RLIM_INFINITY ? -1LL :
+		       (long long) l->rlim.rlim_max);
+	}
+
+	ns_spec_close(spec);
+}
+
+/* Time `count` checks of the text spec against `count` opens of its
+   compiled form, which is written next to it */
+static void bench(const char *path, long count) {
+	const struct ns_spec	*spec;
+	char	bin[4096];
+	double	start, parse_us, open_us;
+	long	j;
+
+	snprintf(bin, sizeof(bin), "%s.bin", path);
+	if (ns_spec_compile(path, bin) == -1) {
+		fprintf(stderr, "%s\n", ns_error());
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_us();
+	for (j = 0; j < count; j++)
+		if (ns_spec_compile(path, NULL) == -1) {
+			fprintf(stderr, "%s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+	parse_us = (now_us() - start) / count;
+
+	start = now_us();
+	for (j = 0; j < count; j++) {
+		spec = ns_spec_open(bin);
+		if (spec == NULL) {
+			fprintf(stderr, "%s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+		ns_spec_close(spec);
+	}
+	open_us = (now_us() - start) / count;
+
+	printf("parse text: %8.2f us/spec\n", parse_us);
+	printf("open bin:   %8.2f us/spec (%.1fx)\n", open_us, parse_us / open_us);
+	unlink(bin);
+}
+
+int main(int argc, char **argv) {
+	int opt, check, dump_only;
+	long	count;
+
+	check = 0;
+	dump_only = 0;
+	count = 0;
+	while ((opt = getopt(argc, argv, "cdb:")) != -1) {
+		switch (opt) {
+		case 'c': check = 1;			break;
+		case 'd': dump_only = 1;		break;
+		case 'b': count = atol(optarg);		break;
+		default: usage(argv[0]);
+		}
+	}
+	if (check + dump_only + (count > 0) > 1 ||
+	    argc - optind != (check || dump_only || count > 0 ? 1 : 2))
+		usage(argv[0]);
+
+	if (dump_only) {
+		dump(argv[optind]);
+	} else if (count > 0) {
+		bench(argv[optind], count);
+	} else if (ns_spec_compile(argv[optind], check ? NULL :
+				   argv[optind + 1]) == -1) {
+		fprintf(stderr, "%s\n", ns_error());
+		exit(EXIT_FAILURE);
+	}
+
+	exit(EXIT_SUCCESS);
+}
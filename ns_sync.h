@@ -0,0 +1,154 @@
+/* ns_sync.h
+ *
+ * A staged handshake between a launcher and the child it creates in new
+ * namespaces, used instead of pipe EOF or fixed sleeps.
+ *
+ * Both sides share one page (MAP_SHARED, so it works for fork(), clone()
+ * and CLONE_VM children alike) holding the current stage, a futex word.
+ * Each side advances the stage when it has done its part and waits, on
+ * the futex, for the other side to reach the stage it needs. Stages a
+ * launcher has no use for are simply skipped. Either side can fail the
+ * handshake, which wakes the other with the errno and the step that
+ * failed. A waiter also gives up when the process on the other side has
+ * died, so neither side can hang: the parent watches the child's PID, and
+ * the child a pidfd for the parent, opened before the child was created
+ * (the parent's PID means nothing inside a new PID namespace).
+ *
+ * Everything here is static inline, so a program just includes this file.
+ **/
+
+#ifndef NS_SYNC_H
+#define NS_SYNC_H
+
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Stages, in the order they are reached
+#define NS_SYNC_START		0	// nothing has happened yet
+#define NS_SYNC_CHILD_READY	1	// child: running in its new namespaces
+#define NS_SYNC_MAPS_WRITTEN	2	// parent: UID and GID maps are written
+#define NS_SYNC_MOUNTS_READY	3	// child: mount setup is done
+#define NS_SYNC_EXEC		4	// parent: go ahead and execute
+#define NS_SYNC_ERROR		UINT32_MAX	// one side failed; see err/step
+
+#define NS_SYNC_POLL_MS		50	// how often a waiter checks its peer
+#define NS_SYNC_PARENT		(-1)	// ns_sync_wait() peer: the creator
+
+struct ns_sync {
+	uint32_t	stage;		// futex word
+	int	err;		// errno of the failure, once stage is ERROR
+	char	step[64];	// what failed
+	int	parent_pidfd;	// pidfd for the creator, or -1
+};
+
+// Create a handshake; must be done before the child is created
+static inline struct ns_sync *ns_sync_create(void) {
+	struct ns_sync *s;
+
+	s = mmap(NULL, sizeof(struct ns_sync), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED)
+		return NULL;
+
+	s->stage = NS_SYNC_START;
+	s->parent_pidfd = syscall(SYS_pidfd_open, getpid(), 0);	// close-on-exec
+	return s;
+}
+
+static inline void ns_sync_destroy(struct ns_sync *s) {
+	if (s->parent_pidfd != -1)
+		close(s->parent_pidfd);
+	munmap(s, sizeof(struct ns_sync));
+}
+
+static inline void ns_sync_wake(struct ns_sync *s) {
+	syscall(SYS_futex, &s->stage, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Advance the handshake to `stage`; it never moves backwards
+static inline void ns_sync_post(struct ns_sync *s, uint32_t stage) {
+	uint32_t cur;
+
+	cur = __atomic_load_n(&s->stage, __ATOMIC_ACQUIRE);
+	while (cur < stage &&
+	       !__atomic_compare_exchange_n(&s->stage, &cur, stage, 0,
+					    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		continue;
+	ns_sync_wake(s);
+}
+
+/* Fail the handshake: the other side's ns_sync_wait() returns -1 with
+   errno set to `err`, and ns_sync_error() tells it what failed. Safe to
+   call in a child that is about to _exit() */
+static inline void ns_sync_fail(struct ns_sync *s, int err,
+				const char *step) {
+	s->err = err;
+	strncpy(s->step, step, sizeof(s->step) - 1);
+	__atomic_store_n(&s->stage, NS_SYNC_ERROR, __ATOMIC_RELEASE);
+	ns_sync_wake(s);
+}
+
+static inline const char *ns_sync_error(struct ns_sync *s) {
+	return s->step;
+}
+
+// Has `peer` (a child's PID, or NS_SYNC_PARENT) gone?
+static inline int ns_sync_peer_gone(struct ns_sync *s, pid_t peer) {
+	struct pollfd	pfd;
+	siginfo_t	si;
+
+	if (peer == NS_SYNC_PARENT) {
+		if (s->parent_pidfd == -1)
+			return 0;
+		pfd.fd = s->parent_pidfd;
+		pfd.events = POLLIN;		// readable once it has exited
+		return poll(&pfd, 1, 0) == 1;
+	}
+
+	si.si_pid = 0;
+	if (waitid(P_PID, peer, &si, WEXITED | WNOHANG | WNOWAIT) == 0)
+		return si.si_pid != 0;
+	if (errno == ECHILD)
+		return kill(peer, 0) == -1 && errno == ESRCH;
+	return 0;
+}
+
+/* Wait until the handshake has reached `stage`. If `peer` isn't 0, give
+   up when it has died: the parent passes the child's PID, the child
+   NS_SYNC_PARENT. Returns 0, or -1 with errno set to the peer's error
+   (or ESRCH if it died without reporting one) */
+static inline int ns_sync_wait(struct ns_sync *s, uint32_t stage,
+			       pid_t peer) {
+	struct timespec	ts = { 0, NS_SYNC_POLL_MS * 1000000L };
+	uint32_t	cur;
+
+	while (1) {
+		cur = __atomic_load_n(&s->stage, __ATOMIC_ACQUIRE);
+		if (cur == NS_SYNC_ERROR) {
+			errno = s->err;
+			return -1;
+		}
+		if (cur >= stage)
+			return 0;
+
+		if (syscall(SYS_futex, &s->stage, FUTEX_WAIT, cur,
+			    peer ? &ts : NULL, NULL, 0) == -1 &&
+		    errno == ETIMEDOUT && ns_sync_peer_gone(s, peer) &&
+		    __atomic_load_n(&s->stage, __ATOMIC_ACQUIRE) == cur) {
+			strncpy(s->step, "peer exited", sizeof(s->step) - 1);
+			errno = ESRCH;
+			return -1;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,199 @@
+/* ns_trace.h
+ *
+ * Opt-in tracing of a launch, phase by phase, in the launcher and in the
+ * child it creates.
+ *
+ * Each phase is recorded, by whichever side runs it, as a begin and end
+ * CLOCK_MONOTONIC timestamp in a buffer in one MAP_SHARED mapping, made
+ * before the child is created, so that the child's phases land next to
+ * the parent's whatever way it was created. A phase can be ended by the
+ * other side: the launcher ends the child's execve() phase when the
+ * exec has happened. The buffer is then written as Chrome trace-event
+ * JSON, one track per side, for chrome://tracing or Perfetto.
+ *
+ * Every begin and end is also a USDT probe, ns:phase_begin and
+ * ns:phase_end, with the phase name as argument, when <sys/sdt.h> is
+ * available: bpftrace or perf can then time launches in production,
+ * where no trace is being recorded. Without a trace, a phase costs the
+ * probes' nops and a test of the trace pointer. The probes have USDT
+ * semaphores, which a tracer raises while attached: ns_trace_active()
+ * tells whether anyone is looking, so that work done only to time a
+ * phase, such as waiting for the child's exec, can be skipped otherwise.
+ *
+ * Everything here is static inline, so a program just includes this file.
+ **/
+
+#ifndef NS_TRACE_H
+#define NS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#if !defined(NS_TRACE_PROBE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES	1
+#include <sys/sdt.h>
+#define NS_TRACE_PROBE(probe, name)	DTRACE_PROBE1(ns, probe, name)
+
+// Raised by tracers attached to the probes
+__extension__ static volatile unsigned short ns_phase_begin_semaphore
+	__attribute__((used, section(".probes")));
+__extension__ static volatile unsigned short ns_phase_end_semaphore
+	__attribute__((used, section(".probes")));
+#define NS_TRACE_PROBING()	(ns_phase_begin_semaphore != 0 || \
+				 ns_phase_end_semaphore != 0)
+#endif
+#endif
+#ifndef NS_TRACE_PROBE
+#define NS_TRACE_PROBE(probe, name)	((void) (name))
+#define NS_TRACE_PROBING()	0
+#endif
+#ifndef NS_TRACE_PROBING
+#define NS_TRACE_PROBING()	1	// probes of the build's own making
+#endif
+
+#define NS_TRACE_MAX		128	// phases a trace holds; more are dropped
+#define NS_TRACE_TRACKS		4
+
+struct ns_trace_event {
+	const char	*name;		// a string literal, the same in both sides
+	int	track;
+	uint64_t	begin, end;	// ns; end is 0 while the phase runs
+};
+
+// A phase begun, as ns_trace_end() needs it, whether recorded or not
+struct ns_trace_phase {
+	const char	*name;
+	int	slot;			// in the trace, or -1
+};
+
+struct ns_trace {
+	uint32_t	n;		// events used
+	uint64_t	origin;		// ns, when the trace was created
+	int	pid[NS_TRACE_TRACKS];	// PID shown for each track, as we see it
+	struct ns_trace_event	ev[NS_TRACE_MAX];
+};
+
+static inline uint64_t ns_trace_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Create a trace; must be done before the child is created
+static inline struct ns_trace *ns_trace_create(void) {
+	struct ns_trace *t;
+
+	t = mmap(NULL, sizeof(struct ns_trace), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED)
+		return NULL;
+
+	t->origin = ns_trace_now();
+	return t;
+}
+
+// Whether phases are recorded in `t` or watched through the probes
+static inline int ns_trace_active(struct ns_trace *t) {
+	return t != NULL || NS_TRACE_PROBING();
+}
+
+static inline void ns_trace_destroy(struct ns_trace *t) {
+	munmap(t, sizeof(struct ns_trace));
+}
+
+/* Begin phase `name` (a string literal: the child's pointer is valid in
+   the parent only because they run the same program) on `track`, in `t`
+   if it isn't NULL. Returns the phase, for ns_trace_end() */
+static inline struct ns_trace_phase ns_trace_begin(struct ns_trace *t,
+						   int track, const char *name) {
+	struct ns_trace_phase	phase = { name, -1 };
+	uint32_t	slot;
+
+	NS_TRACE_PROBE(phase_begin, name);
+	if (t == NULL)
+		return phase;
+
+	slot = __atomic_fetch_add(&t->n, 1, __ATOMIC_RELAXED);
+	if (slot >= NS_TRACE_MAX)
+		return phase;
+	t->ev[slot].name = name;
+	t->ev[slot].track = track;
+	t->ev[slot].end = 0;
+	t->ev[slot].begin = ns_trace_now();
+	phase.slot = slot;
+	return phase;
+}
+
+// The probe fires whether or not the phase was recorded
+static inline void ns_trace_end(struct ns_trace *t,
+				struct ns_trace_phase phase) {
+	NS_TRACE_PROBE(phase_end, phase.name);
+	if (t == NULL || phase.slot < 0)
+		return;
+	t->ev[phase.slot].end = ns_trace_now();
+}
+
+/* The latest phase `name` that is still running in `t`; its slot is -1
+   if there is none */
+static inline struct ns_trace_phase ns_trace_find(struct ns_trace *t,
+						  const char *name) {
+	struct ns_trace_phase	phase = { name, -1 };
+	int j;
+
+	if (t == NULL)
+		return phase;
+	for (j = __atomic_load_n(&t->n, __ATOMIC_ACQUIRE) - 1; j >= 0; j--)
+		if (j < NS_TRACE_MAX && t->ev[j].end == 0 &&
+		    t->ev[j].name != NULL && strcmp(t->ev[j].name, name) == 0) {
+			phase.slot = j;
+			break;
+		}
+	return phase;
+}
+
+/* Write the trace to `path` as Chrome trace-event JSON: one complete
+   ("X") event per phase, in microseconds from the trace's creation, on
+   thread `track` of process `pid`, with the tracks named by `tracks`.
+   Phases that never ended, or didn't fit, are left out. Returns 0, or -1
+   with errno set */
+static inline int ns_trace_write(struct ns_trace *t, const char *path,
+				 int pid, const char **tracks, int ntracks) {
+	struct ns_trace_event	*e;
+	const char	*sep;
+	uint32_t	j, n;
+	FILE	*fp;
+	int k;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return -1;
+
+	fprintf(fp, "{\"traceEvents\": [");
+	sep = "";
+	for (k = 0; k < ntracks; k++, sep = ",")
+		fprintf(fp, "%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", "
+			"\"pid\": %d, \"tid\": %d, \"args\": {\"name\": "
+			"\"%s (PID %d)\"}}", sep, pid, k, tracks[k], t->pid[k]);
+
+	n = (t->n < NS_TRACE_MAX) ? t->n : NS_TRACE_MAX;
+	for (j = 0; j < n; j++) {
+		e = &t->ev[j];
+		if (e->end == 0)
+			continue;
+		fprintf(fp, "%s\n  {\"name\": \"%s\", \"ph\": \"X\", "
+			"\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}",
+			sep, e->name, (e->begin - t->origin) / 1e3,
+			(e->end - e->begin) / 1e3, pid, e->track);
+		sep = ",";
+	}
+	fprintf(fp, "\n], \"displayTimeUnit\": \"ns\"}\n");
+
+	return fclose(fp);
+}
+
+#endif
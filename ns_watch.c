@@ -0,0 +1,493 @@
+/* ns_watch.c
+ *
+ * Stream namespace lifecycle events: a namespace appearing (its first
+ * process seen) and becoming empty (its last process gone), without
+ * polling /proc.
+ *
+ * We subscribe to the kernel's process events connector, which reports
+ * every fork, exec and exit as it happens, and keep, for every process,
+ * the inodes of its namespaces and, for every namespace, how many
+ * processes are in it. A fork or exec re-reads the namespaces of the
+ * process concerned (an exec can switch time namespaces, and catches up
+ * with earlier setns() and unshare() calls, for which there is no event;
+ * a fork does the same for the parent); an exit drops the process. The
+ * starting state comes from one scan of /proc, made after subscribing so
+ * that nothing falls in between.
+ *
+ * Each event carries the latency from the kernel's timestamp of the
+ * process event to our output. A namespace whose only process exits
+ * before we could read its links is never seen; an empty namespace may
+ * still be kept alive by a bind mount or an open file descriptor.
+ *
+ * If the kernel drops events because we fell behind, we rescan /proc
+ * and emit the namespaces that appeared or emptied meanwhile, compared
+ * to our old state, with "rescan" in place of the latency and no PID.
+ *
+ * Receiving process events requires CAP_NET_ADMIN.
+ *
+ * Build with: cc -o ns_watch ns_watch.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+#define RCVBUF_SIZE	(8 * 1024 * 1024)
+
+// A process and its namespaces; pid 0 marks a free slot
+struct proc_rec {
+	pid_t	pid;
+	uint64_t	ino[NS_TYPES];	// 0 where unknown
+};
+
+// A namespace and its member count; ino 0 marks a free slot
+struct ns_rec {
+	uint64_t	ino;
+	int	type;
+	int	count;
+};
+
+/* Open-addressed hash tables with linear probing. Deletion shifts later
+   entries of the cluster back, so lookups never need tombstones */
+static struct proc_rec	*procs;
+static unsigned	procs_size, procs_used;
+static struct ns_rec	*nss;
+static unsigned	nss_size, nss_used;
+
+static int proc_fd;
+static int verbose;
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-n num	 exit after `num` namespace events\n");
+	fprintf(stderr, "	-v	 also show every fork, exec and exit\n");
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t hash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key;
+}
+
+static struct proc_rec *proc_find(pid_t pid, int insert);
+static struct ns_rec *ns_find(uint64_t ino, int insert);
+
+// Double a table's size and reinsert its entries
+static void proc_grow(void) {
+	struct proc_rec	*old;
+	unsigned	old_size, j;
+
+	old = procs;
+	old_size = procs_size;
+	procs_size = procs_size ? procs_size * 2 : 4096;
+	procs = calloc(procs_size, sizeof(struct proc_rec));
+	if (procs == NULL)
+		bail("calloc");
+	procs_used = 0;
+	for (j = 0; j < old_size; j++)
+		if (old[j].pid != 0)
+			*proc_find(old[j].pid, 1) = old[j];
+	free(old);
+}
+
+static void ns_grow(void) {
+	struct ns_rec	*old;
+	unsigned	old_size, j;
+
+	old = nss;
+	old_size = nss_size;
+	nss_size = nss_size ? nss_size * 2 : 1024;
+	nss = calloc(nss_size, sizeof(struct ns_rec));
+	if (nss == NULL)
+		bail("calloc");
+	nss_used = 0;
+	for (j = 0; j < old_size; j++)
+		if (old[j].ino != 0)
+			*ns_find(old[j].ino, 1) = old[j];
+	free(old);
+}
+
+static struct proc_rec *proc_find(pid_t pid, int insert) {
+	unsigned	j;
+
+	if (insert && (procs_used + 1) * 2 > procs_size)
+		proc_grow();
+
+	for (j = hash(pid) & (procs_size - 1); procs[j].pid != 0;
+	     j = (j + 1) & (procs_size - 1))
+		if (procs[j].pid == pid)
+			return &procs[j];
+	if (!insert)
+		return NULL;
+
+	memset(&procs[j], 0, sizeof(struct proc_rec));
+	procs[j].pid = pid;
+	procs_used++;
+	return &procs[j];
+}
+
+static void proc_delete(struct proc_rec *p) {
+	unsigned	hole, j, home;
+
+	hole = p - procs;
+	procs[hole].pid = 0;
+	procs_used--;
+	for (j = (hole + 1) & (procs_size - 1); procs[j].pid != 0;
+	     j = (j + 1) & (procs_size - 1)) {
+		home = hash(procs[j].pid) & (procs_size - 1);
+		// Move the entry back if the hole lies between its home and it
+		if (((j - home) & (procs_size - 1)) >= ((j - hole) & (procs_size - 1))) {
+			procs[hole] = procs[j];
+			procs[j].pid = 0;
+			hole = j;
+		}
+	}
+}
+
+static struct ns_rec *ns_find(uint64_t ino, int insert) {
+	unsigned	j;
+
+	if (insert && (nss_used + 1) * 2 > nss_size)
+		ns_grow();
+
+	for (j = hash(ino) & (nss_size - 1); nss[j].ino != 0;
+	     j = (j + 1) & (nss_size - 1))
+		if (nss[j].ino == ino)
+			return &nss[j];
+	if (!insert)
+		return NULL;
+
+	memset(&nss[j], 0, sizeof(struct ns_rec));
+	nss[j].ino = ino;
+	nss_used++;
+	return &nss[j];
+}
+
+static void ns_delete(struct ns_rec *n) {
+	unsigned	hole, j, home;
+
+	hole = n - nss;
+	nss[hole].ino = 0;
+	nss_used--;
+	for (j = (hole + 1) & (nss_size - 1); nss[j].ino != 0;
+	     j = (j + 1) & (nss_size - 1)) {
+		home = hash(nss[j].ino) & (nss_size - 1);
+		if (((j - home) & (nss_size - 1)) >= ((j - hole) & (nss_size - 1))) {
+			nss[hole] = nss[j];
+			nss[j].ino = 0;
+			hole = j;
+		}
+	}
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long events;		// namespace events emitted
+static uint64_t event_ts;	// kernel timestamp of the event at hand
+
+// Output one namespace event; the first column is CLOCK_MONOTONIC
+static void emit(const char *what, int type, uint64_t ino, pid_t pid) {
+	uint64_t	now;
+
+	if (event_ts == 0)		// from a scan of /proc
+		return;
+	events++;
+
+	now = now_ns();
+	printf("%.6f\t%s\t%s\t%llu\t%ld\t%.1f\n", now / 1e9, what,
+	       ns_types[type].name, (unsigned long long) ino, (long) pid,
+	       (now - event_ts) / 1e3);
+	fflush(stdout);
+}
+
+// Output a namespace event found by a rescan, in the same columns
+static void emit_rescan(const char *what, int type, uint64_t ino) {
+	events++;
+	printf("%.6f\t%s\t%s\t%llu\t-\trescan\n", now_ns() / 1e9, what,
+	       ns_types[type].name, (unsigned long long) ino);
+}
+
+static void ns_enter(int type, uint64_t ino, pid_t pid) {
+	struct ns_rec	*n;
+
+	n = ns_find(ino, 1);
+	if (n->count++ == 0) {
+		n->type = type;
+		emit("new", type, ino, pid);
+	}
+}
+
+static void ns_leave(uint64_t ino, pid_t pid) {
+	struct ns_rec	*n;
+
+	n = ns_find(ino, 0);
+	if (n == NULL)
+		return;
+	if (--n->count == 0) {
+		emit("empty", n->type, ino, pid);
+		ns_delete(n);
+	}
+}
+
+/* Read the namespaces of `pid` and update the counts with whatever
+   changed. Returns -1 if the process is gone */
+static int proc_update(pid_t pid) {
+	struct proc_rec	*p;
+	uint64_t	ino[NS_TYPES];
+	char	path[32], target[64], *bracket;
+	ssize_t	n;
+	int fd, t;
+
+	snprintf(path, sizeof(path), "%ld/ns", (long) pid);
+	fd = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	for (t = 0; t < NS_TYPES; t++) {
+		ino[t] = 0;
+		n = readlinkat(fd, ns_types[t].name, target, sizeof(target) - 1);
+		if (n <= 0)
+			continue;
+		target[n] = '\0';		// "net:[4026531840]"
+		bracket = strchr(target, '[');
+		if (bracket != NULL)
+			ino[t] = strtoull(bracket + 1, NULL, 10);
+	}
+	close(fd);
+
+	p = proc_find(pid, 1);
+	for (t = 0; t < NS_TYPES; t++) {
+		if (p->ino[t] == ino[t])
+			continue;
+		if (ino[t] != 0)
+			ns_enter(t, ino[t], pid);
+		if (p->ino[t] != 0)
+			ns_leave(p->ino[t], pid);
+		p = proc_find(pid, 0);		// the table may have moved
+		p->ino[t] = ino[t];
+	}
+
+	return 0;
+}
+
+static void proc_exit(pid_t pid) {
+	struct proc_rec	*p, rec;
+	int t;
+
+	p = proc_find(pid, 0);
+	if (p == NULL)
+		return;
+	rec = *p;
+	proc_delete(p);
+	for (t = 0; t < NS_TYPES; t++)
+		if (rec.ino[t] != 0)
+			ns_leave(rec.ino[t], pid);
+}
+
+static void scan_pid(pid_t pid, void *arg) {
+	proc_update(pid);
+}
+
+// Load the state from /proc, from scratch
+static void scan(void) {
+	free(procs);
+	free(nss);
+	procs = NULL;
+	nss = NULL;
+	procs_size = procs_used = nss_size = nss_used = 0;
+	proc_grow();
+	ns_grow();
+
+	event_ts = 0;
+	if (ns_list_pids(proc_fd, scan_pid, NULL) == -1) {
+		fprintf(stderr, "%s\n", ns_error());
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Whether namespace `ino` is in the table `tab` of `size` slots
+static int ns_in(struct ns_rec *tab, unsigned size, uint64_t ino) {
+	unsigned	j;
+
+	for (j = hash(ino) & (size - 1); tab[j].ino != 0; j = (j + 1) & (size - 1))
+		if (tab[j].ino == ino)
+			return 1;
+	return 0;
+}
+
+/* We missed events, so our state may be stale: rebuild it from /proc,
+   and emit the differences between the old state and the new one */
+static void rescan(void) {
+	struct ns_rec	*old;
+	unsigned	old_size, j;
+
+	old = nss;
+	old_size = nss_size;
+	nss = NULL;			// kept from scan()
+	scan();
+
+	for (j = 0; j < old_size; j++)
+		if (old[j].ino != 0 && ns_find(old[j].ino, 0) == NULL)
+			emit_rescan("empty", old[j].type, old[j].ino);
+	for (j = 0; j < nss_size; j++)
+		if (nss[j].ino != 0 && !ns_in(old, old_size, nss[j].ino))
+			emit_rescan("new", nss[j].type, nss[j].ino);
+	free(old);
+}
+
+// Subscribe to process events; returns the netlink socket
+static int subscribe(void) {
+	struct sockaddr_nl	sa;
+	struct {
+		struct nlmsghdr	nl;
+		struct cn_msg	cn;
+		enum proc_cn_mcast_op	op;
+	} __attribute__((packed)) req;
+	int fd, size;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd == -1)
+		bail("socket");
+
+	// Bursts of forks must not overrun us
+	size = RCVBUF_SIZE;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = CN_IDX_PROC;
+	sa.nl_pid = 0;			// let the kernel pick
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1)
+		bail("bind");
+
+	memset(&req, 0, sizeof(req));
+	req.nl.nlmsg_len = sizeof(req);
+	req.nl.nlmsg_type = NLMSG_DONE;
+	req.cn.id.idx = CN_IDX_PROC;
+	req.cn.id.val = CN_VAL_PROC;
+	req.cn.len = sizeof(enum proc_cn_mcast_op);
+	req.op = PROC_CN_MCAST_LISTEN;
+	if (send(fd, &req, sizeof(req), 0) == -1)
+		bail("send");
+
+	return fd;
+}
+
+static void handle(struct proc_event *ev) {
+	event_ts = ev->timestamp_ns;
+
+	switch (ev->what) {
+	case PROC_EVENT_FORK:
+		if (verbose)
+			printf("# fork %d -> %d\n", ev->event_data.fork.parent_tgid,
+			       ev->event_data.fork.child_tgid);
+		// Threads share their process's namespaces
+		if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+			break;
+		proc_update(ev->event_data.fork.parent_tgid);
+		if (proc_update(ev->event_data.fork.child_tgid) == -1)
+			proc_exit(ev->event_data.fork.child_tgid);
+		break;
+	case PROC_EVENT_EXEC:
+		if (verbose)
+			printf("# exec %d\n", ev->event_data.exec.process_tgid);
+		if (proc_update(ev->event_data.exec.process_tgid) == -1)
+			proc_exit(ev->event_data.exec.process_tgid);
+		break;
+	case PROC_EVENT_EXIT:
+		if (ev->event_data.exit.process_pid !=
+		    ev->event_data.exit.process_tgid)
+			break;
+		if (verbose)
+			printf("# exit %d\n", ev->event_data.exit.process_tgid);
+		proc_exit(ev->event_data.exit.process_tgid);
+		break;
+	default:
+		break;
+	}
+}
+
+int main(int argc, char **argv) {
+	char	buf[64 * 1024] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr	*nl;
+	struct cn_msg	*cn;
+	long	max_events;
+	ssize_t	n;
+	int fd, opt;
+
+	max_events = 0;
+	while ((opt = getopt(argc, argv, "n:v")) != -1) {
+		switch (opt) {
+		case 'n': max_events = atol(optarg);	break;
+		case 'v': verbose = 1;			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
+
+	proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (proc_fd == -1)
+		bail("open /proc");
+
+	fd = subscribe();
+	scan();
+	printf("# tracking %u processes in %u namespaces\n", procs_used, nss_used);
+	printf("# time\tevent\ttype\tns\tpid\tlatency_us\n");
+	fflush(stdout);
+
+	while (max_events == 0 || events < max_events) {
+		n = recv(fd, buf, sizeof(buf), 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOBUFS)
+				bail("recv");
+
+			rescan();
+			printf("# events lost, rescanned: %u processes in %u "
+			       "namespaces\n", procs_used, nss_used);
+			fflush(stdout);
+			continue;
+		}
+
+		for (nl = (struct nlmsghdr *) buf; NLMSG_OK(nl, n);
+		     nl = NLMSG_NEXT(nl, n)) {
+			if (nl->nlmsg_type != NLMSG_DONE)
+				continue;
+			cn = NLMSG_DATA(nl);
+			if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+				continue;
+			handle((struct proc_event *) cn->data);
+		}
+	}
+
+	exit(EXIT_SUCCESS);
+}
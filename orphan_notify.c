@@ -0,0 +1,227 @@
+/* orphan_notify.c
+ *
+ * orphan.c notices that it has been orphaned by polling getppid() every
+ * 100 ms, and waiting for it to become 1, which it never does if an
+ * ancestor is a child subreaper. This measures how soon a child learns
+ * of its parent's death in each of the ways there are:
+ *
+ *   pidfd      poll() a pidfd for the parent, readable once it has exited
+ *   pdeathsig  PR_SET_PDEATHSIG, the signal taken with sigwaitinfo()
+ *   poll       orphan.c's loop, checking every 100 ms whether getppid()
+ *              has changed
+ *
+ * Every round, we fork a parent, which forks a child; once the child is
+ * watching, the parent notes the time and exits, and the child notes
+ * when it found out, and who its parent now is. With -s, we make
+ * ourselves a child subreaper (PR_SET_CHILD_SUBREAPER), so that the
+ * orphan is reparented to us, and reaped by us, instead of by init: no
+ * PID namespace is needed just to keep orphans from escaping.
+ **/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+enum { MODE_PIDFD, MODE_PDEATHSIG, MODE_POLL, NMODES };
+
+static const char *mode_names[] = { "pidfd", "pdeathsig", "poll" };
+
+// What one round found, shared between us and the processes we fork
+struct round {
+	double	died;			// when the parent exited
+	double	noticed;		// when the child found out
+	pid_t	new_parent;		// the child's parent after that
+};
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-m mode	 only measure `mode`: pidfd, pdeathsig or poll\n");
+	fprintf(stderr, "		 (default: all three)\n");
+	fprintf(stderr, "	-n num	 rounds per mode (default: 20)\n");
+	fprintf(stderr, "	-s	 be a child subreaper, adopting the orphans\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Runs in the child: start watching the parent in the way `mode` says,
+   tell it so on `ready`, and wait for it to die */
+static void child(int mode, int ready, struct round *r) {
+	struct pollfd	pfd;
+	sigset_t	mask;
+	pid_t	parent;
+
+	parent = getppid();
+	switch (mode) {
+	case MODE_PIDFD:
+		pfd.fd = syscall(SYS_pidfd_open, parent, 0);
+		if (pfd.fd == -1)
+			bail("pidfd_open");
+		pfd.events = POLLIN;
+		if (write(ready, "", 1) != 1)
+			bail("write");
+		if (poll(&pfd, 1, -1) == -1)
+			bail("poll");
+		break;
+
+	case MODE_PDEATHSIG:
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGUSR1);
+		sigprocmask(SIG_BLOCK, &mask, NULL);
+		if (prctl(PR_SET_PDEATHSIG, SIGUSR1) == -1)
+			bail("prctl");
+		if (write(ready, "", 1) != 1)
+			bail("write");
+		if (sigwaitinfo(&mask, NULL) == -1)
+			bail("sigwaitinfo");
+		break;
+
+	case MODE_POLL:
+		if (write(ready, "", 1) != 1)
+			bail("write");
+		do {
+			usleep(100000);
+		} while (getppid() == parent);	// Am I an orphan yet?
+		break;
+	}
+
+	r->noticed = now_us();
+	r->new_parent = getppid();
+	_exit(EXIT_SUCCESS);
+}
+
+// One round: fork a parent that forks a child, then exits
+static void run_round(int mode, struct round *r) {
+	int ready[2];
+	pid_t	pid;
+	char	c;
+
+	r->noticed = 0;
+	pid = fork();
+	if (pid == -1)
+		bail("fork");
+
+	if (pid == 0) {
+		if (pipe(ready) == -1)
+			bail("pipe");
+		switch (fork()) {
+		case -1:
+			bail("fork");
+		case 0:
+			close(ready[0]);
+			child(mode, ready[1], r);
+		}
+
+		// Wait until the child is watching us, then die
+		close(ready[1]);
+		if (read(ready[0], &c, 1) != 1)
+			bail("read");
+		r->died = now_us();
+		_exit(EXIT_SUCCESS);
+	}
+
+	if (waitpid(pid, NULL, 0) == -1)
+		bail("waitpid");
+
+	// As a subreaper, we get to reap the orphan; otherwise, wait for
+	// it to report
+	if (wait(NULL) == -1)
+		while (r->noticed == 0)
+			usleep(1000);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void measure(int mode, int rounds, struct round *r) {
+	double	*lat;
+	pid_t	me;
+	int j, adopted;
+
+	lat = calloc(rounds, sizeof(double));
+	if (lat == NULL)
+		bail("calloc");
+
+	me = getpid();
+	for (adopted = 0, j = 0; j < rounds; j++) {
+		run_round(mode, r);
+		lat[j] = r->noticed - r->died;
+		if (r->new_parent == me)
+			adopted++;
+	}
+	qsort(lat, rounds, sizeof(double), cmp_double);
+
+	printf("%-10s %6d %10.1f %10.1f %10.1f %8d   %ld\n", mode_names[mode],
+	       rounds, lat[rounds / 2], lat[(rounds * 99) / 100],
+	       lat[rounds - 1], adopted, (long) r->new_parent);
+	free(lat);
+}
+
+int main(int argc, char **argv) {
+	struct round	*r;
+	int opt, mode, only, rounds, subreaper;
+
+	only = -1;
+	rounds = 20;
+	subreaper = 0;
+	while ((opt = getopt(argc, argv, "m:n:s")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (only = 0; only < NMODES; only++)
+				if (strcmp(optarg, mode_names[only]) == 0)
+					break;
+			if (only == NMODES)
+				usage(argv[0]);
+			break;
+		case 'n': rounds = atoi(optarg);	break;
+		case 's': subreaper = 1;		break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc || rounds < 1)
+		usage(argv[0]);
+
+	if (subreaper && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+		bail("prctl");
+
+	r = mmap(NULL, sizeof(struct round), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED)
+		bail("mmap");
+
+	printf("# latency from the parent's exit to the child noticing, in "
+	       "microseconds; we are PID %ld\n", (long) getpid());
+	printf("%-10s %6s %10s %10s %10s %8s   %s\n", "mode", "rounds", "p50",
+	       "p99", "max", "adopted", "new parent");
+	for (mode = 0; mode < NMODES; mode++)
+		if (only == -1 || mode == only)
+			measure(mode, rounds, r);
+
+	exit(EXIT_SUCCESS);
+}
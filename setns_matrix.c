@@ -0,0 +1,531 @@
+/* setns_matrix.c
+ *
+ * userns_setns_test.c grown into a harness: which caller contexts can
+ * setns() into which namespaces, and how long setns() takes when many
+ * callers join at once.
+ *
+ * Targets are namespace files (/proc/PID/ns/TYPE or bind mounts of
+ * them), opened here, up front, and inherited by every caller: we test
+ * the permission to join, not to open. A caller context is built in a
+ * process of its own from a spec such as "depth=2,caps=sys_admin+sys_chroot":
+ *
+ *   depth=N    N nested user namespaces below ours, each mapping the
+ *              caller's IDs to root, which a process may do for itself
+ *   caps=LIST  keep only these capabilities: `none`, `all`, or names
+ *              such as sys_admin, joined by '+'; the default is all
+ *
+ * For every context, target and number of concurrent joiners (-j), the
+ * context forks that many joiners, releases them together, and each
+ * makes one setns() and reports its result and latency. Every attempt
+ * is a fresh process, so that a join never affects the next attempt
+ * (a process cannot leave a user namespace it has joined). This is
+ * repeated -n times.
+ *
+ * The contexts run at the same time, each in its own process, so the
+ * whole matrix takes about as long as one context. Their joiners then
+ * compete for the CPUs, and a cell's latency includes that of the other
+ * contexts' joiners; with -S the contexts run one after another, and
+ * only the joiners of one cell are concurrent.
+ *
+ * The report is a matrix of results (ok, or the error), then one line
+ * per context, target and concurrency with latency percentiles, the
+ * slowdown of the median relative to a single joiner, and a log2
+ * histogram.
+ *
+ * Build with: cc -o setns_matrix setns_matrix.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/nsfs.h>
+#include <linux/capability.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+#define MAX_CONTEXTS	16
+#define MAX_TARGETS	64
+#define MAX_LEVELS	8
+#define HIST_BUCKETS	24		// log2 buckets: <1us, 1-2us, ...
+
+static const struct {
+	const char	*name;
+	int	cap;
+} cap_names[] = {
+	{ "chown",		CAP_CHOWN },
+	{ "dac_override",	CAP_DAC_OVERRIDE },
+	{ "fowner",		CAP_FOWNER },
+	{ "kill",		CAP_KILL },
+	{ "setgid",		CAP_SETGID },
+	{ "setuid",		CAP_SETUID },
+	{ "net_admin",		CAP_NET_ADMIN },
+	{ "sys_chroot",		CAP_SYS_CHROOT },
+	{ "sys_ptrace",		CAP_SYS_PTRACE },
+	{ "sys_admin",		CAP_SYS_ADMIN },
+};
+#define NCAPS	(sizeof(cap_names) / sizeof(cap_names[0]))
+
+struct context {
+	char	*spec;
+	int	depth;			// nested user namespaces
+	uint64_t	caps;		// capabilities kept
+};
+
+struct target {
+	char	*path;
+	int	fd;
+	char	label[48];		// "net:4026531840"
+};
+
+// One setns() attempt
+struct sample {
+	int	err;			// 0, or errno
+	double	us;
+};
+
+// Start line shared by a context and its joiners; one per context
+struct start {
+	uint32_t	ready;
+	uint32_t	go;		// futex word
+};
+
+static struct context	contexts[MAX_CONTEXTS];
+static struct target	targets[MAX_TARGETS];
+static int	levels[MAX_LEVELS];
+static int	ncontexts, ntargets, nlevels, rounds, max_level;
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options] nsfile...\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-c spec	 add a caller context (may be repeated):\n");
+	fprintf(stderr, "		 `depth=N` and/or `caps=LIST` (names joined by\n");
+	fprintf(stderr, "		 `+`, e.g. `caps=sys_admin+sys_chroot`), comma\n");
+	fprintf(stderr, "		 separated;\n");
+	fprintf(stderr, "		 `root` is our own context. Default: root,\n");
+	fprintf(stderr, "		 caps=none, depth=1 and depth=2\n");
+	fprintf(stderr, "	-j list	 comma-separated numbers of concurrent joiners\n");
+	fprintf(stderr, "		 (default: 1,4,16)\n");
+	fprintf(stderr, "	-n num	 rounds per measurement (default: 50)\n");
+	fprintf(stderr, "	-S	 run the contexts one after another, not at\n");
+	fprintf(stderr, "		 the same time\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void parse_context(char *spec, struct context *c) {
+	char	*copy, *item, *name, *saveptr, *saveptr2;
+	size_t	j;
+
+	c->spec = spec;
+	c->depth = 0;
+	c->caps = ~0ULL;
+	if (strcmp(spec, "root") == 0)
+		return;
+
+	copy = strdup(spec);
+	if (copy == NULL)
+		bail("strdup");
+	for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+	     item = strtok_r(NULL, ",", &saveptr)) {
+		if (strncmp(item, "depth=", 6) == 0) {
+			c->depth = atoi(item + 6);
+			continue;
+		}
+		if (strncmp(item, "caps=", 5) != 0)
+			goto bad;
+
+		c->caps = 0;
+		for (name = strtok_r(item + 5, "+", &saveptr2); name != NULL;
+		     name = strtok_r(NULL, "+", &saveptr2)) {
+			if (strcmp(name, "none") == 0)
+				continue;
+			if (strcmp(name, "all") == 0) {
+				c->caps = ~0ULL;
+				continue;
+			}
+			for (j = 0; j < NCAPS; j++)
+				if (strcmp(name, cap_names[j].name) == 0)
+					break;
+			if (j == NCAPS)
+				goto bad;
+			c->caps |= 1ULL << cap_names[j].cap;
+		}
+	}
+	free(copy);
+	return;
+
+bad:
+	fprintf(stderr, "bad context `%s`\n", spec);
+	exit(EXIT_FAILURE);
+}
+
+static void open_target(char *path, struct target *t) {
+	struct stat	st;
+	const char	*type;
+	int nstype;
+	size_t	j;
+
+	t->path = path;
+	t->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (t->fd == -1 || fstat(t->fd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	// Label the target by type and inode, as its ns link would be
+	nstype = ioctl(t->fd, NS_GET_NSTYPE);
+	type = "?";
+	for (j = 0; j < NS_TYPES; j++)
+		if (ns_types[j].flag == nstype)
+			type = ns_types[j].name;
+	snprintf(t->label, sizeof(t->label), "%s:%lu", type,
+		 (unsigned long) st.st_ino);
+
+	// The fd must survive into the joiners, which never exec
+	fcntl(t->fd, F_SETFD, 0);
+}
+
+static int write_file(const char *path, const char *text) {
+	int fd, ret;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	ret = (write(fd, text, strlen(text)) == (ssize_t) strlen(text)) ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* Turn the calling process into context `c`. Returns 0, or -1 with a
+   message printed */
+static int enter_context(struct context *c) {
+	struct __user_cap_header_struct	hdr;
+	struct __user_cap_data_struct	data[2];
+	char	map[32];
+	uid_t	uid;
+	gid_t	gid;
+	int j;
+
+	for (j = 0; j < c->depth; j++) {
+		uid = geteuid();
+		gid = getegid();
+		if (unshare(CLONE_NEWUSER) == -1) {
+			fprintf(stderr, "%s: unshare: %s\n", c->spec, strerror(errno));
+			return -1;
+		}
+		snprintf(map, sizeof(map), "0 %ld 1", (long) uid);
+		if (write_file("/proc/self/uid_map", map) == -1)
+			goto map_fail;
+		if (write_file("/proc/self/setgroups", "deny") == -1 && errno != ENOENT)
+			goto map_fail;
+		snprintf(map, sizeof(map), "0 %ld 1", (long) gid);
+		if (write_file("/proc/self/gid_map", map) == -1)
+			goto map_fail;
+	}
+
+	if (c->caps != ~0ULL) {
+		memset(&hdr, 0, sizeof(hdr));
+		memset(data, 0, sizeof(data));
+		hdr.version = _LINUX_CAPABILITY_VERSION_3;
+		data[0].effective = data[0].permitted = c->caps;
+		data[1].effective = data[1].permitted = c->caps >> 32;
+		if (syscall(SYS_capset, &hdr, data) == -1) {
+			fprintf(stderr, "%s: capset: %s\n", c->spec, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+
+map_fail:
+	fprintf(stderr, "%s: writing ID maps: %s\n", c->spec, strerror(errno));
+	return -1;
+}
+
+// A joiner: wait for the start, make one setns(), report, and exit
+static void joiner(struct start *st, int fd, struct sample *out) {
+	double	t0;
+	int r;
+
+	__atomic_add_fetch(&st->ready, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&st->go, __ATOMIC_ACQUIRE) == 0)
+		syscall(SYS_futex, &st->go, FUTEX_WAIT, 0, NULL, NULL, 0);
+
+	t0 = now_us();
+	r = setns(fd, 0);
+	out->us = now_us() - t0;
+	out->err = (r == -1) ? errno : 0;
+	_exit(EXIT_SUCCESS);
+}
+
+/* One round: `n` joiners of target `t`, released together; their
+   samples go to `out` */
+static void run_round(struct start *st, struct target *t, int n,
+		      struct sample *out) {
+	pid_t	pid;
+	int j;
+
+	st->ready = 0;
+	st->go = 0;
+	for (j = 0; j < n; j++) {
+		out[j].err = ECHILD;		// if the joiner never reports
+		pid = fork();
+		if (pid == -1)
+			bail("fork");
+		if (pid == 0)
+			joiner(st, t->fd, &out[j]);
+	}
+
+	while (__atomic_load_n(&st->ready, __ATOMIC_ACQUIRE) < (uint32_t) n)
+		sched_yield();
+	__atomic_store_n(&st->go, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &st->go, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+
+	for (j = 0; j < n; j++)
+		if (wait(NULL) == -1)
+			bail("wait");
+}
+
+// Where the samples of (context, target, level) start
+static struct sample *samples_of(struct sample *all, int c, int t, int l) {
+	return all + (((size_t) c * ntargets + t) * nlevels + l) *
+		     rounds * max_level;
+}
+
+/* Start everything for context `c` in a process of its own, without
+   waiting for it; a context that cannot be built leaves its samples as
+   ECHILD */
+static void run_context(int c, struct sample *all, struct start *st) {
+	struct sample	*s;
+	pid_t	pid;
+	int t, l, r;
+
+	pid = fork();
+	if (pid == -1)
+		bail("fork");
+	if (pid != 0)
+		return;
+
+	if (enter_context(&contexts[c]) == -1)
+		_exit(EXIT_FAILURE);
+	for (t = 0; t < ntargets; t++) {
+		for (l = 0; l < nlevels; l++) {
+			s = samples_of(all, c, t, l);
+			for (r = 0; r < rounds; r++)
+				run_round(st, &targets[t], levels[l],
+					  s + (size_t) r * max_level);
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* The matrix cell for (context, target): "ok", the error if every
+   attempt failed the same way, or "mixed" */
+static const char *cell(struct sample *all, int c, int t) {
+	struct sample	*s;
+	int l, r, k, err, first;
+
+	first = 1;
+	err = 0;
+	for (l = 0; l < nlevels; l++) {
+		s = samples_of(all, c, t, l);
+		for (r = 0; r < rounds; r++) {
+			for (k = 0; k < levels[l]; k++) {
+				if (first)
+					err = s[r * max_level + k].err;
+				else if (s[r * max_level + k].err != err)
+					return "mixed";
+				first = 0;
+			}
+		}
+	}
+	if (err == ECHILD)
+		return "n/a";
+	return err ? strerrorname_np(err) : "ok";
+}
+
+// Latency of the successful samples of (context, target, level)
+static void report_latency(struct sample *all, int c, int t, int l,
+			   double *lat, double *base) {
+	struct sample	*s;
+	int hist[HIST_BUCKETS];
+	int n, r, k, b;
+
+	s = samples_of(all, c, t, l);
+	memset(hist, 0, sizeof(hist));
+	for (n = 0, r = 0; r < rounds; r++) {
+		for (k = 0; k < levels[l]; k++) {
+			if (s[r * max_level + k].err != 0)
+				continue;
+			lat[n] = s[r * max_level + k].us;
+			for (b = 0; b < HIST_BUCKETS - 1 && lat[n] >= (1 << b); b++)
+				continue;
+			hist[b]++;
+			n++;
+		}
+	}
+	if (n == 0)
+		return;
+
+	qsort(lat, n, sizeof(double), cmp_double);
+	if (l == 0)
+		*base = lat[n / 2];
+
+	printf("%s\t%s\t%d\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.2f\t",
+	       contexts[c].spec, targets[t].label, levels[l], n, lat[n / 2],
+	       lat[n * 9 / 10], lat[n * 99 / 100], lat[n - 1],
+	       *base > 0 ? lat[n / 2] / *base : 0);
+	for (b = HIST_BUCKETS - 1; b > 0 && hist[b] == 0; b--)
+		continue;
+	for (k = 0; k <= b; k++)
+		printf("%s%d", k ? "," : "", hist[k]);
+	printf("\n");
+}
+
+static void report(struct sample *all) {
+	double	*lat, base;
+	int c, t, l, width;
+
+	width = 7;
+	for (c = 0; c < ncontexts; c++)
+		if ((int) strlen(contexts[c].spec) > width)
+			width = strlen(contexts[c].spec);
+
+	printf("# setns() results: context x target\n");
+	printf("%-*s", width, "context");
+	for (t = 0; t < ntargets; t++)
+		printf(" %-22s", targets[t].label);
+	printf("\n");
+	for (c = 0; c < ncontexts; c++) {
+		printf("%-*s", width, contexts[c].spec);
+		for (t = 0; t < ntargets; t++)
+			printf(" %-22s", cell(all, c, t));
+		printf("\n");
+	}
+
+	lat = malloc((size_t) rounds * max_level * sizeof(double));
+	if (lat == NULL)
+		bail("malloc");
+
+	printf("\n# latency of successful setns() calls, in microseconds; "
+	       "hist: counts in [0,1), [1,2), [2,4), ...\n");
+	printf("# context\ttarget\tjoiners\tsamples\tp50\tp90\tp99\tmax\t"
+	       "vs_1\thist\n");
+	for (c = 0; c < ncontexts; c++) {
+		for (t = 0; t < ntargets; t++) {
+			base = 0;
+			for (l = 0; l < nlevels; l++)
+				report_latency(all, c, t, l, lat, &base);
+		}
+	}
+	free(lat);
+}
+
+int main(int argc, char **argv) {
+	struct sample	*all;
+	struct start	*st;
+	char	*tok, *saveptr;
+	size_t	size;
+	int opt, j, serial;
+
+	rounds = 50;
+	serial = 0;
+	while ((opt = getopt(argc, argv, "c:j:n:S")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (ncontexts == MAX_CONTEXTS)
+				usage(argv[0]);
+			parse_context(optarg, &contexts[ncontexts++]);
+			break;
+		case 'j':
+			nlevels = 0;
+			for (tok = strtok_r(optarg, ",", &saveptr); tok != NULL;
+			     tok = strtok_r(NULL, ",", &saveptr)) {
+				if (nlevels == MAX_LEVELS || atoi(tok) < 1)
+					usage(argv[0]);
+				levels[nlevels++] = atoi(tok);
+			}
+			break;
+		case 'n': rounds = atoi(optarg);	break;
+		case 'S': serial = 1;			break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc || argc - optind > MAX_TARGETS || rounds < 1)
+		usage(argv[0]);
+
+	if (ncontexts == 0) {
+		parse_context("root", &contexts[ncontexts++]);
+		parse_context("caps=none", &contexts[ncontexts++]);
+		parse_context("depth=1", &contexts[ncontexts++]);
+		parse_context("depth=2", &contexts[ncontexts++]);
+	}
+	if (nlevels == 0) {
+		levels[nlevels++] = 1;
+		levels[nlevels++] = 4;
+		levels[nlevels++] = 16;
+	}
+	for (j = 0; j < nlevels; j++)
+		if (levels[j] > max_level)
+			max_level = levels[j];
+
+	for (j = optind; j < argc; j++)
+		open_target(argv[j], &targets[ntargets++]);
+
+	// Samples and the start line are shared with every joiner
+	size = (size_t) ncontexts * ntargets * nlevels * rounds * max_level *
+	       sizeof(struct sample);
+	all = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	st = mmap(NULL, ncontexts * sizeof(struct start),
+		  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (all == MAP_FAILED || st == MAP_FAILED)
+		bail("mmap");
+	for (j = 0; j < (int) (size / sizeof(struct sample)); j++)
+		all[j].err = ECHILD;
+
+	fflush(stdout);
+	for (j = 0; j < ncontexts; j++) {
+		run_context(j, all, &st[j]);
+		if (serial && wait(NULL) == -1)
+			bail("wait");
+	}
+	while (wait(NULL) != -1)
+		continue;
+	if (errno != ECHILD)
+		bail("wait");
+
+	report(all);
+	exit(EXIT_SUCCESS);
+}
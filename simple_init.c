@@ -3,6 +3,17 @@
  * A simple init(1)-style program to be used as the init program in
  * PID namespaces. The programe reaps the status of its children and
  * provides a simple shell facility for executing commands
+ *
+ * All events are handled in one epoll loop: SIGCHLD arrives through a
+ * signalfd, each child we create is watched through its pidfd, and
+ * stdin is read as soon as it has input.
+ *
+ * With -r, it also works outside a PID namespace: it becomes a child
+ * subreaper, so that orphaned descendants of its commands are reparented
+ * to it, and reaped, instead of escaping to the host's init, and each
+ * command it starts is killed (PR_SET_PDEATHSIG) if it dies.
+ *
+ * Build with: cc -o simple_init simple_init.c libns.c -pthread
  */
 #define _GNU_SOURCE
 #include <unistd.h>
@@ -13,6 +24,20 @@
 #include <sys/wait.h>
 #include <wordexp.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include "libns.h"
 
 
 /* A simple error-handling function: print an error message based
@@ -26,32 +51,597 @@
 
 static int verbose = 0;
 
-// Display wait status(from waitipd() or similar) given in `status`
-// SIGCHLD handler: reap child processes as they change state
-static void child_handler(int sig)
-{
+/* What we know about a child we created. A zero file descriptor means
+   "none": stdin is always open, so no pidfd or socket can be fd 0 */
+struct child {
+	int	ours;		// created by us, as opposed to adopted
+	int	pidfd;		// pidfd watching the child
+	int	client;		// supervisor mode: socket of the submitter
+	double	start;		// supervisor mode: when the job was started
+};
+
+// A job submitted in supervisor mode, waiting for a free slot
+struct job {
+	struct job	*next;
+	int	client;		// socket to send the result to
+	char	cmd[];		// command line to run
+};
+
+static int epfd;		// epoll instance driving the event loop
+static int sfd;			// signalfd on which SIGCHLD arrives
+static int lfd = -1;		// supervisor mode: listening socket
+static struct child *children;	// tracked children, indexed by PID
+static long pid_max;		// size of `children`
+static pid_t fg_pid;		// command owning the terminal, or 0
+static unsigned long reaped;	// children reaped so far
+static unsigned long orphans;	// of which, adopted descendants
+static struct job *queue_head, *queue_tail;	// jobs waiting to run
+static int running;		// supervisor mode: jobs now running
+
+/* Each epoll event carries the file descriptor in its low 32 bits and,
+   for a pidfd, the PID of the child in the high 32 bits */
+#define EV_DATA(fd, pid)	(((uint64_t) (pid) << 32) | (uint32_t) (fd))
+#define EV_FD(data)		((int) (uint32_t) (data))
+#define EV_PID(data)		((pid_t) ((data) >> 32))
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void epoll_add(int fd, pid_t pid) {
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_DATA(fd, pid);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		bail("epoll_ctl");
+}
+
+/* Note a newly created child as ours, and start watching it through a
+   pidfd. The pidfd becomes readable when the child terminates, which lets
+   us reap exactly that child instead of scanning for it. If no pidfd can
+   be had (old kernel, or out of file descriptors) the child is still
+   reaped via SIGCHLD */
+static void track_child(pid_t pid) {
+	int fd;
+
+	if (pid >= pid_max)
+		return;
+	children[pid].ours = 1;
+
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd == -1)
+		return;
+	children[pid].pidfd = fd;
+	epoll_add(fd, pid);
+}
+
+// Supervisor mode: tell the submitter of the job run by `ch` how it went
+static void send_result(struct child *ch, int status, struct rusage *ru) {
+	char	buf[256];
+	int len;
+
+	len = snprintf(buf, sizeof(buf),
+		"status=%d wall_ms=%.3f user_ms=%.3f sys_ms=%.3f maxrss_kb=%ld\n",
+		status, (now() - ch->start) * 1e3,
+		ru->ru_utime.tv_sec * 1e3 + ru->ru_utime.tv_usec / 1e3,
+		ru->ru_stime.tv_sec * 1e3 + ru->ru_stime.tv_usec / 1e3,
+		ru->ru_maxrss);
+
+	// The submitter may have gone away; that's not our problem
+	send(ch->client, buf, len, MSG_NOSIGNAL);
+	close(ch->client);
+	ch->client = 0;
+	running--;
+}
+
+/* Bookkeeping once child `pid` has been reaped by either path. `status`
+   is its exit status, or 128 plus the number of the signal that killed it */
+static void child_gone(pid_t pid, int status, struct rusage *ru) {
+	int adopted = 0;
+
+	if (pid < pid_max) {
+		adopted = !children[pid].ours;
+		children[pid].ours = 0;
+		if (children[pid].pidfd != 0) {
+			close(children[pid].pidfd);	// also drops it from the epoll set
+			children[pid].pidfd = 0;
+		}
+		if (children[pid].client != 0)
+			send_result(&children[pid], status, ru);
+	}
+	reaped++;
+
+	if (adopted) {
+		orphans++;
+		if (verbose)
+			printf("\tinit: orphan PID %ld terminated with status %d "
+			       "(%lu adopted so far)\n", (long) pid, status, orphans);
+		return;
+	}
+
+	if (verbose)
+		printf("\tinit: PID %ld terminated with status %d\n", (long) pid,
+		       status);
+}
+
+// Give the terminal back to `init` once the foreground command is done
+static void fg_done(void) {
+	fg_pid = 0;
+	if (tcsetpgrp(STDIN_FILENO, getpgrp()) == -1)
+		bail("tcsetpgrp-parent");
+}
+
+/* SIGCHLD arrived on the signalfd: reap or note every child that changed
+   state. Signals coalesce, so we loop until waitpid() has nothing more to
+   report. This is also how orphans that were reparented to us (and that
+   we therefore hold no pidfd for) get reaped */
+static void reap_children(void) {
+	struct signalfd_siginfo	si;
+	struct rusage	ru;
 	pid_t	pid;
 	int status;
 
-	// WUNTRACED and WCONTINUED allow waitpid() to catch stopped and 
+	while (read(sfd, &si, sizeof(si)) == sizeof(si))
+		continue;		// drain; the siginfo itself is not needed
+
+	// WUNTRACED and WCONTINUED allow waitpid() to catch stopped and
 	// continued children (in addition to terminated children)
-	while((pid = waitpid(-1, &status, WNOHANG|WUNTRACED|WCONTINUED)) != 0) {
-		if (pid == -1) {
-			if (errno == ECHILD)  // no more children
-				break;
-			else
-				perror("waitpid");
+	while ((pid = wait4(-1, &status, WNOHANG|WUNTRACED|WCONTINUED, &ru)) > 0) {
+		if (WIFEXITED(status))
+			child_gone(pid, WEXITSTATUS(status), &ru);
+		else if (WIFSIGNALED(status))
+			child_gone(pid, 128 + WTERMSIG(status), &ru);
+
+		if (pid == fg_pid && !WIFCONTINUED(status))
+			fg_done();
+	}
+	if (pid == -1 && errno != ECHILD)
+		perror("wait4");
+}
+
+// The pidfd of child `pid` became readable: reap that child
+static void reap_pidfd(int fd, pid_t pid) {
+	struct rusage	ru;
+	siginfo_t	info;
+
+	if (pid >= pid_max || children[pid].pidfd != fd)
+		return;			// already reaped via SIGCHLD
+
+	// Only the raw waitid() system call reports the child's rusage
+	info.si_pid = 0;
+	if (syscall(SYS_waitid, P_PIDFD, fd, &info, WEXITED | WNOHANG, &ru) == -1) {
+		if (errno != ECHILD)
+			perror("waitid");
+		return;			// already reaped via SIGCHLD
+	}
+	if (info.si_pid == 0)
+		return;
+
+	child_gone(pid, info.si_code == CLD_EXITED ? info.si_status :
+						     128 + info.si_status, &ru);
+	if (pid == fg_pid)
+		fg_done();
+}
+
+/* Set up the event loop: SIGCHLD is blocked and delivered through a
+   signalfd, so a child that changes state before we go to sleep still
+   wakes us up. `children` is indexed directly by PID so that each event
+   is handled in constant time however many children there are; its
+   pages are only populated for PIDs actually used */
+static void events_init(void) {
+	struct rlimit	rl;
+	sigset_t	mask;
+	FILE	*fp;
+
+	// Keep fd 0 taken, so that zero can mean "no descriptor" in `children`
+	if (fcntl(STDIN_FILENO, F_GETFD) == -1 &&
+	    open("/dev/null", O_RDWR) == -1)
+		bail("open");
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		bail("sigprocmask");
+
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd == -1)
+		bail("signalfd");
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		bail("epoll_create1");
+	epoll_add(sfd, 0);
+
+	pid_max = 4194304;
+	fp = fopen("/proc/sys/kernel/pid_max", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld", &pid_max) != 1)
+			pid_max = 4194304;
+		fclose(fp);
+	}
+	pid_max++;
+	children = calloc(pid_max, sizeof(struct child));
+	if (children == NULL)
+		bail("calloc");
+
+	// Every tracked child costs a file descriptor
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+#define	CMD_SIZE	10000
+
+// Supervisor mode: accept new submitters on the listening socket
+static void accept_clients(void) {
+	int cfd;
+
+	while ((cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+		epoll_add(cfd, 0);
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("accept4");
+}
+
+/* Supervisor mode: a submitter sent its job, a command line in a single
+   message. Queue it; the socket stays open to carry back the result */
+static void read_job(int cfd) {
+	char	buf[CMD_SIZE];
+	struct job	*job;
+	ssize_t	n;
+
+	n = recv(cfd, buf, sizeof(buf) - 1, 0);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, cfd, NULL);
+	if (n <= 0) {
+		close(cfd);
+		return;
+	}
+	buf[n] = '\0';
+	if (buf[n - 1] == '\n')
+		buf[n - 1] = '\0';
+
+	job = malloc(sizeof(struct job) + strlen(buf) + 1);
+	if (job == NULL)
+		bail("malloc");
+	job->next = NULL;
+	job->client = cfd;
+	strcpy(job->cmd, buf);
+
+	if (queue_tail != NULL)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+
+	if (verbose)
+		printf("\tinit: queued \"%s\"\n", job->cmd);
+}
+
+#define MAX_EVENTS	256
+
+/* Wait for and handle events other than input on stdin, which is
+   reported through the return value: 1 if stdin is readable, else 0 */
+static int handle_events(int timeout) {
+	struct epoll_event evs[MAX_EVENTS];
+	int n, j, fd, input;
+	pid_t	pid;
+
+	n = epoll_wait(epfd, evs, MAX_EVENTS, timeout);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		bail("epoll_wait");
+	}
+
+	input = 0;
+	for (j = 0; j < n; j++) {
+		fd = EV_FD(evs[j].data.u64);
+		pid = EV_PID(evs[j].data.u64);
+
+		if (pid != 0)
+			reap_pidfd(fd, pid);
+		else if (fd == STDIN_FILENO)
+			input = 1;
+		else if (fd == sfd)
+			reap_children();
+		else if (fd == lfd)
+			accept_clients();
+		else
+			read_job(fd);
+	}
+
+	return input;
+}
+
+/* Fork-storm benchmark: create `total` children that exit at once, in
+   bursts of `burst`, handling events between bursts. Reports reaping
+   throughput and the largest number of unreaped children (zombie
+   backlog) seen between bursts */
+static void fork_storm(unsigned long total, int burst) {
+	unsigned long	forked, backlog, max_backlog;
+	double	start, secs;
+	pid_t	pid;
+	int j;
+
+	forked = max_backlog = 0;
+	start = now();
+	while (forked < total || reaped < forked) {
+		for (j = 0; j < burst && forked < total; j++, forked++) {
+			pid = fork();
+			if (pid == -1)
+				bail("fork");
+			if (pid == 0)
+				_exit(EXIT_SUCCESS);
+			track_child(pid);
 		}
 
-		if (verbose)
-			printf("\tinit: SIGCHLD handler: PID %ld terminated\n", (long)pid);
+		backlog = forked - reaped;
+		if (backlog > max_backlog)
+			max_backlog = backlog;
+
+		handle_events(forked < total ? 0 : -1);
+	}
+	secs = now() - start;
+
+	printf("children: %lu burst: %d seconds: %.3f reaped/s: %.0f "
+	       "max backlog: %lu\n", forked, burst, secs, reaped / secs,
+	       max_backlog);
+}
+
+#define MAX_ARGS	256
+
+// A command line split into words; the words live in `buf`
+struct cmdline {
+	char	*argv[MAX_ARGS + 1];
+	char	buf[CMD_SIZE * 2];
+};
+
+/* Append the value of the environment variable whose name starts at
+   `*pp` ($NAME or ${NAME}, with `*pp` just past the `$`) to the word
+   being built at `*op`. Returns 0, or -1 if the result doesn't fit */
+static int expand_var(const char **pp, char **op, char *end) {
+	const char	*p = *pp, *start;
+	char	name[256], *val;
+	int braced;
+
+	braced = (*p == '{');
+	if (braced)
+		p++;
+	for (start = p; *p == '_' || (*p >= 'A' && *p <= 'Z') ||
+			(*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9'); p++)
+		continue;
+	if ((size_t) (p - start) >= sizeof(name) || (braced && *p != '}'))
+		return -1;
+
+	if (p == start && !braced) {	// a lone `$` is literal
+		if (*op >= end)
+			return -1;
+		*(*op)++ = '$';
+		*pp = p;
+		return 0;
 	}
+
+	memcpy(name, start, p - start);
+	name[p - start] = '\0';
+	*pp = braced ? p + 1 : p;
+
+	val = getenv(name);
+	if (val == NULL)
+		return 0;
+	if (strlen(val) > (size_t) (end - *op))
+		return -1;
+	memcpy(*op, val, strlen(val));
+	*op += strlen(val);
+	return 0;
 }
 
+/* Split `cmd` into words as a shell does for a simple command, without
+   allocating and without forking: words are separated by blanks; single
+   quotes keep everything literally; double quotes keep everything except
+   `$` and `\`; a backslash quotes the next character; $NAME and ${NAME}
+   expand to the value of an environment variable, and a `~` starting a
+   word to $HOME. Unlike wordexp(), there is no globbing or command
+   substitution. Returns 0 on success, or -1 (after printing a message)
+   for a malformed or unsupported command line */
+static int tokenize(const char *cmd, struct cmdline *cl) {
+	const char	*p;
+	char	*o, *end, *home;
+	int argc, in_word;
+
+	o = cl->buf;
+	end = cl->buf + sizeof(cl->buf);
+	argc = 0;
+	in_word = 0;
+
+#define PUT(c)	do { if (o >= end) goto fail; *o++ = (c); } while (0)
+
+	for (p = cmd; *p != '\0'; ) {
+		if (*p == ' ' || *p == '\t' || *p == '\n') {
+			if (in_word)
+				PUT('\0');
+			in_word = 0;
+			p++;
+			continue;
+		}
+
+		if (!in_word) {
+			if (argc == MAX_ARGS)
+				goto fail;
+			cl->argv[argc++] = o;
+			in_word = 1;
+
+			home = getenv("HOME");
+			if (*p == '~' && home != NULL && strchr("/ \t\n", p[1]) != NULL) {
+				if (strlen(home) > (size_t) (end - o))
+					goto fail;
+				memcpy(o, home, strlen(home));
+				o += strlen(home);
+				p++;
+				continue;
+			}
+		}
+
+		switch (*p) {
+		case '\'':
+			for (p++; *p != '\''; p++) {
+				if (*p == '\0')
+					goto fail;
+				PUT(*p);
+			}
+			p++;
+			break;
+
+		case '"':
+			for (p++; *p != '"'; ) {
+				if (*p == '\0')
+					goto fail;
+				if (*p == '\\' && p[1] != '\0' && strchr("$`\"\\", p[1]) != NULL) {
+					PUT(p[1]);
+					p += 2;
+				} else if (*p == '$') {
+					p++;
+					if (expand_var(&p, &o, end) == -1)
+						goto fail;
+				} else {
+					PUT(*p++);
+				}
+			}
+			p++;
+			break;
+
+		case '\\':
+			if (p[1] == '\0')
+				goto fail;
+			PUT(p[1]);
+			p += 2;
+			break;
+
+		case '$':
+			p++;
+			if (expand_var(&p, &o, end) == -1)
+				goto fail;
+			break;
+
+		// Shell syntax that only a real shell can handle
+		case '|': case '&': case ';': case '<': case '>':
+		case '(': case ')': case '{': case '}': case '`':
+			goto fail;
+
+		default:
+			PUT(*p++);
+		}
+	}
+	if (in_word)
+		PUT('\0');
+#undef PUT
+
+	cl->argv[argc] = NULL;
+	if (argc > 0)
+		return 0;
 
-// Perform word expansion on string in `cmd`, allocating and 
-// returning a vector of words on success or NULL on failure
-static char **expand_words(char *cmd) {
+fail:
+	fprintf(stderr, "Word expansion failed\n");
+	return -1;
+}
+
+/* Optional cache (-e) of the executables that commands resolve to, so
+   that a command seen before skips the PATH search that execvp() would
+   repeat every time. Each entry also holds an O_PATH descriptor for the
+   file, which lets the child exec it without walking the path again */
+#define EXEC_CACHE_SIZE	256	// must be a power of two
+
+struct exec_entry {
+	char	*name;		// command name as typed
+	char	*path;		// what it resolved to
+	int	fd;		// O_PATH descriptor for `path`
+};
+
+static struct exec_entry exec_cache[EXEC_CACHE_SIZE];
+static int use_exec_cache = 0;
+
+/* Return the cache entry for command `name`, resolving it through PATH
+   the first time it is seen. Returns NULL if the cache is off, if `name`
+   contains a slash (no PATH search is done for it anyway), or if it can't
+   be resolved; the caller then just uses execvp() */
+static struct exec_entry *exec_lookup(const char *name) {
+	struct exec_entry	*e;
+	char	path[PATH_MAX], *dirs, *dir, *next;
+	unsigned int	h;
+	const char	*c;
+	struct stat	sb;
+	int j;
+
+	if (!use_exec_cache || strchr(name, '/') != NULL)
+		return NULL;
+
+	for (h = 2166136261u, c = name; *c != '\0'; c++)	// FNV-1a
+		h = (h ^ (unsigned char) *c) * 16777619u;
+
+	for (j = 0; j < EXEC_CACHE_SIZE; j++) {
+		e = &exec_cache[(h + j) & (EXEC_CACHE_SIZE - 1)];
+		if (e->name == NULL)
+			break;
+		if (strcmp(e->name, name) == 0)
+			return e;
+	}
+	if (j == EXEC_CACHE_SIZE)
+		return NULL;		// cache full
+
+	dirs = getenv("PATH");
+	if (dirs == NULL)
+		dirs = "/bin:/usr/bin";
+	for (dir = dirs; dir != NULL; dir = next) {
+		next = strchr(dir, ':');
+		snprintf(path, sizeof(path), "%.*s/%s",
+			 next ? (int) (next - dir) : (int) strlen(dir), dir, name);
+		if (next != NULL)
+			next++;
+
+		if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		    access(path, X_OK) == 0)
+			break;
+	}
+	if (dir == NULL)
+		return NULL;
+
+	e->name = strdup(name);
+	e->path = strdup(path);
+	if (e->name == NULL || e->path == NULL)
+		bail("strdup");
+	e->fd = open(path, O_PATH | O_CLOEXEC);
+
+	return e;
+}
+
+/* Execute the command in `cl`. With a cache entry, exec the file through
+   its descriptor, then by its path; execvp() is the fallback for a stale
+   entry, and for scripts, which cannot be run via a close-on-exec fd.
+   On failure we use _exit(): the child may share our memory (see
+   spawn()), and exit() would flush our stdio buffers */
+static void exec_command(struct cmdline *cl, struct exec_entry *e) {
+	if (e != NULL) {
+		if (e->fd != -1)
+			syscall(SYS_execveat, e->fd, "", cl->argv, environ, AT_EMPTY_PATH);
+		execve(e->path, cl->argv, environ);
+	}
+
+	execvp(cl->argv[0], cl->argv);
+	perror("execvp");
+	_exit(EXIT_FAILURE);
+}
+
+// Perform word expansion on string in `cmd` with wordexp(3), allocating
+// and returning a vector of words on success or NULL on failure. This is
+// the old way of splitting commands, kept for the -E benchmark
+static char **wordexp_words(char *cmd) {
 	char **arg_vec;
 	int s;
 	wordexp_t  pwordexp;
@@ -74,33 +664,330 @@ static char **expand_words(char *cmd) {
 	return arg_vec;
 }
 
+/* Benchmark (-E): run the command line `cmd` `count` times in each of
+   three ways: split by wordexp() in the child and run with execvp(), as
+   simple_init used to; split by tokenize() in the parent; and the latter
+   plus the exec cache. The output of the command is discarded */
+static void bench_commands(char *cmd, long count) {
+	static const char	*names[] = {
+		"wordexp+execvp", "tokenize+execvp", "tokenize+cache"
+	};
+	static struct cmdline	cl;
+	struct exec_entry	*e;
+	double	start;
+	pid_t	pid;
+	long	j;
+	int mode, fd;
+
+	for (mode = 0; mode < 3; mode++) {
+		use_exec_cache = (mode == 2);
+		start = now();
+
+		for (j = 0; j < count; j++) {
+			e = NULL;
+			if (mode > 0) {
+				if (tokenize(cmd, &cl) == -1)
+					exit(EXIT_FAILURE);
+				e = exec_lookup(cl.argv[0]);
+			}
+
+			pid = fork();
+			if (pid == -1)
+				bail("fork");
+
+			if (pid == 0) {
+				fd = open("/dev/null", O_WRONLY);
+				if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1)
+					bail("open /dev/null");
+
+				if (mode == 0) {
+					char **arg_vec = wordexp_words(cmd);
+					if (arg_vec == NULL)
+						exit(EXIT_FAILURE);
+					execvp(arg_vec[0], arg_vec);
+					bail("execvp");
+				}
+				exec_command(&cl, e);
+			}
+
+			if (waitpid(pid, NULL, 0) == -1)
+				bail("waitpid");
+		}
+
+		printf("%-16s %8.0f cmds/s\n", names[mode], count / (now() - start));
+	}
+}
+
 
 static void usage(char *name) {
 	fprintf(stderr, "Usage: %s [-q]\n", name);
 	fprintf(stderr, "\t-v\tProvide verbose logging\n");
+	fprintf(stderr, "\t-r\tBecome a child subreaper, adopting orphaned\n");
+	fprintf(stderr, "\t\tdescendants, and kill commands if we die\n");
+	fprintf(stderr, "\t-s path\tSupervisor mode: take jobs from submitters on\n");
+	fprintf(stderr, "\t\tUnix socket `path` instead of from the terminal\n");
+	fprintf(stderr, "\t-k num\tRun up to `num` jobs at once (default: 1)\n");
+	fprintf(stderr, "\t-e\tCache where commands were found in PATH\n");
+	fprintf(stderr, "\t-V\tSpawn commands with CLONE_VM|CLONE_VFORK\n");
+	fprintf(stderr, "\t-E num\tRun command (default: `true`) `num` times with\n");
+	fprintf(stderr, "\t\tthe old and new command parsing and report cmds/s\n");
+	fprintf(stderr, "\t-b num\tFork-storm benchmark: fork `num` children that\n");
+	fprintf(stderr, "\t\texit at once, reap them, and report throughput\n");
+	fprintf(stderr, "\t-B num\tFork children in bursts of `num` (default: 64)\n");
 
 	exit(EXIT_FAILURE);
 }
 
+// Watch stdin for input only while `init` owns the terminal
+static void watch_stdin(int on) {
+	static int watching = -1;
+	struct epoll_event ev;
+
+	if (on == watching)
+		return;
+
+	ev.events = on ? EPOLLIN : 0;
+	ev.data.u64 = EV_DATA(STDIN_FILENO, 0);
+	if (epoll_ctl(epfd, watching == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+		      STDIN_FILENO, &ev) == -1)
+		bail("epoll_ctl");
+	watching = on;
+}
+
+/* How to set up a child created by spawn() before it execs */
+struct spawn_args {
+	struct cmdline	*cl;
+	struct exec_entry	*e;
+	int	foreground;	// give the child the terminal
+	pid_t	parent;		// -r: our PID, to die along with
+	sigset_t	mask;		// signal mask for the command
+};
+
+static int use_vfork = 0;	// -V: spawn with CLONE_VM|CLONE_VFORK
+static int subreaper = 0;	// -r: adopt orphans, take children with us
+
+// Runs in the new child, whichever way it was created
+static int spawn_child(void *arg) {
+	struct spawn_args *sa = arg;
+	int fd;
+
+	// The signal mask survives execve(); don't pass on our blocked SIGCHLD
+	sigprocmask(SIG_SETMASK, &sa->mask, NULL);
+
+	// Die with us; if we died already, the signal will never come
+	if (sa->parent != 0 && (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1 ||
+				getppid() != sa->parent))
+		_exit(EXIT_FAILURE);
+
+	if (sa->foreground) {
+		// make child the leader of a new process group and 
+		// make that process group the foreground process group for the terminal
+
+		if (setpgid(0,0) == -1) {
+			perror("setpgid");
+			_exit(EXIT_FAILURE);
+		}
+
+		if (tcsetpgrp(STDIN_FILENO, getpgrp()) == -1) {
+			perror("tcsetpgrp-child");
+			_exit(EXIT_FAILURE);
+		}
+	} else {
+		// supervisor jobs read from /dev/null, not from our stdin
+		fd = open("/dev/null", O_RDONLY);
+		if (fd == -1 || dup2(fd, STDIN_FILENO) == -1) {
+			perror("open /dev/null");
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	// child executes shell command and terminates
+	exec_command(sa->cl, sa->e);
+	return EXIT_FAILURE;
+}
+
+/* Create a child that runs the command described by `sa`. By default the
+   child is created with fork(). With -V it is created as vfork() and
+   posix_spawn() do: with CLONE_VM|CLONE_VFORK, the child borrows our
+   address space until it execs while we are suspended, so none of our
+   page tables are copied; the stack comes from libns's pool. All signals
+   stay blocked until the child has its own address space, so that no
+   signal handler can run in the child on our memory */
+static pid_t spawn(struct spawn_args *sa) {
+	sigset_t	all, old;
+	pid_t	pid;
+
+	sigfillset(&all);
+	sigprocmask(SIG_BLOCK, &all, &old);
+	sa->mask = old;
+	sigdelset(&sa->mask, SIGCHLD);
+	sa->parent = subreaper ? getpid() : 0;
+
+	if (use_vfork) {
+		pid = ns_clone(spawn_child, sa, CLONE_VM | CLONE_VFORK);
+	} else {
+		pid = fork();
+		if (pid == 0)
+			_exit(spawn_child(sa));
+	}
+
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return pid;
+}
+
+/* Run the shell command `cmd` as the foreground job. The command is
+   split into words here, before fork(), and its executable looked up
+   in the cache if that is enabled */
+static void run_command(char *cmd) {
+	static struct cmdline	cl;
+	struct spawn_args	sa;
+	pid_t	pid;
+
+	if (tokenize(cmd, &cl) == -1)
+		return;
+
+	sa.cl = &cl;
+	sa.e = exec_lookup(cl.argv[0]);
+	sa.foreground = 1;
+	pid = spawn(&sa);		// create child process
+	if (pid == -1)
+		bail(use_vfork ? "clone" : "fork");
+
+	// Parent falls through to here
+	if (verbose)
+		printf("\tinit: created child %ld\n", (long)pid);
+
+	track_child(pid);
+	fg_pid = pid;
+	watch_stdin(0);
+}
+
+/* Supervisor mode: start queued jobs while fewer than `max_jobs` run.
+   Jobs don't get the terminal; their stdin is /dev/null */
+static void start_jobs(int max_jobs) {
+	static struct cmdline	cl;
+	static const char	bad_cmd[] = "status=2 error=syntax\n";
+	struct spawn_args	sa;
+	struct job	*job;
+	pid_t	pid;
+
+	while (running < max_jobs && queue_head != NULL) {
+		job = queue_head;
+		queue_head = job->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+
+		if (tokenize(job->cmd, &cl) == -1) {
+			send(job->client, bad_cmd, strlen(bad_cmd), MSG_NOSIGNAL);
+			close(job->client);
+			free(job);
+			continue;
+		}
+
+		sa.cl = &cl;
+		sa.e = exec_lookup(cl.argv[0]);
+		sa.foreground = 0;
+		pid = spawn(&sa);
+		if (pid == -1)
+			bail(use_vfork ? "clone" : "fork");
+
+		if (verbose)
+			printf("\tinit: started \"%s\" as PID %ld\n", job->cmd,
+			       (long) pid);
+
+		track_child(pid);
+		children[pid].client = job->client;
+		children[pid].start = now();
+		running++;
+		free(job);
+	}
+}
+
+/* Supervisor mode: serve submitters on the SOCK_SEQPACKET socket `path`
+   forever. Each submitter sends one command line and gets back one
+   message with the job's exit status and resource usage. This lets one
+   PID namespace (with us as its init) run any number of short jobs */
+static void supervise(char *path, int max_jobs) {
+	struct sockaddr_un	addr;
+
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lfd == -1)
+		bail("socket");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+		bail("bind");
+	if (listen(lfd, SOMAXCONN) == -1)
+		bail("listen");
+	epoll_add(lfd, 0);
+
+	if (verbose)
+		printf("\tinit: my PID is %ld, serving jobs on %s\n",
+		       (long) getpid(), path);
+
+	while (1) {
+		start_jobs(max_jobs);
+		fflush(stdout);
+		handle_events(-1);
+	}
+}
+
 int main(int argc, char **argv) {
-	struct sigaction	sa;
-#define	CMD_SIZE	10000
 	char cmd[CMD_SIZE];
-	pid_t	pid;
-	int opt;
+	char *nl;
+	size_t	used;
+	ssize_t	n;
+	long	storm, cmd_bench;
+	int opt, burst, eof, prompt, max_jobs;
+	char	*sock_path;
 
-	while ((opt = getopt(argc, argv, "v")) != -1) {
+	storm = 0;
+	cmd_bench = 0;
+	burst = 64;
+	sock_path = NULL;
+	max_jobs = 1;
+	while ((opt = getopt(argc, argv, "vrb:B:s:k:eE:V")) != -1) {
 		switch(opt) {
-		case 'v':	verbose = 1;	break;
+		case 'v':	verbose = 1;		break;
+		case 'r':	subreaper = 1;		break;
+		case 'b':	storm = atol(optarg);	break;
+		case 'B':	burst = atoi(optarg);	break;
+		case 's':	sock_path = optarg;	break;
+		case 'k':	max_jobs = atoi(optarg);	break;
+		case 'e':	use_exec_cache = 1;	break;
+		case 'V':	use_vfork = 1;		break;
+		case 'E':	cmd_bench = atol(optarg);	break;
 		default:	usage(argv[0]);
 		}
 	}
+	if (burst < 1 || max_jobs < 1)
+		usage(argv[0]);
+
+	if (cmd_bench > 0) {
+		bench_commands(optind < argc ? argv[optind] : "true", cmd_bench);
+		exit(EXIT_SUCCESS);
+	}
+
+	events_init();
+
+	if (subreaper && prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+		bail("prctl");
+
+	if (storm > 0) {
+		fork_storm(storm, burst);
+		exit(EXIT_SUCCESS);
+	}
 
-	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_handler = child_handler;
-	if (sigaction(SIGCHLD, &sa, NULL) == -1)
-		bail("sigaction");
+	if (sock_path != NULL)
+		supervise(sock_path, max_jobs);
 
 	if (verbose)
 		printf("\tinit: my PID is %ld\n", (long) getpid());
@@ -120,58 +1007,59 @@ int main(int argc, char **argv) {
 	if (tcsetpgrp(STDIN_FILENO, getpgrp()) == -1)
 		bail("tcsetpgrp-child");
 
+	// Commands are read into `cmd` as input arrives and run one line at a
+	// time, whenever no foreground command holds the terminal
+	used = 0;
+	eof = 0;
+	prompt = 1;
 	while (1) {
-		// Read a shell command; exit on end of file
-		printf("init$ ");
-		if (fgets(cmd, CMD_SIZE, stdin) == NULL) {
-			if (verbose)
-				printf("\tinit: exiting");
-			printf("\n");
-			exit(EXIT_FAILURE);
-		}
-
-		if (cmd[strlen(cmd)-1] == '\n')
-			cmd[strlen(cmd)-1] = '\0';	// Strip trailing `\n`
+		if (fg_pid == 0) {
+			if (prompt) {
+				printf("init$ ");
+				fflush(stdout);
+				prompt = 0;
+			}
 
-		if (strlen(cmd) == 0)
-			continue;	// ignore empty commands
-
-		pid = fork();		// create child process
-		if (pid == -1)
-			bail("fork");
-
-		// child
-		if (pid == 0) {
-			char **arg_vec;
-
-			arg_vec = expand_words(cmd);
-			if (arg_vec == NULL)		// Word expansion failed
+			nl = memchr(cmd, '\n', used);
+			if (nl != NULL) {
+				*nl = '\0';	// Strip trailing `\n`
+				if (strlen(cmd) != 0)	// ignore empty commands
+					run_command(cmd);
+				used -= nl + 1 - cmd;
+				memmove(cmd, nl + 1, used);
+				prompt = 1;
 				continue;
+			}
 
-			// make child the leader of a new process group and 
-			// make that process group the foreground process group for the terminal
-
-			if (setpgid(0,0) == -1)
-				bail("setpgid");
+			// exit on end of file
+			if (eof) {
+				if (verbose)
+					printf("\tinit: exiting");
+				printf("\n");
+				exit(EXIT_FAILURE);
+			}
 
-			if (tcsetpgrp(STDIN_FILENO, getpgrp()) == -1)
-				bail("tcsetpgrp-child");
-
-			// child executes shell command and terminates
-			execvp(arg_vec[0], arg_vec);
-			bail("execvp");
+			watch_stdin(1);
 		}
 
-		// Parent falls through to here
-		if (verbose)
-			printf("\tinit: created child %ld\n", (long)pid);
-
-		pause();		// Will be interrupted by signal handler
+		if (!handle_events(-1) || fg_pid != 0)
+			continue;
 
-		// After child changes state, ensure that the `init` program is 
-		// the foreground process group for the terminal
+		n = read(STDIN_FILENO, cmd + used, CMD_SIZE - 1 - used);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			bail("read");
+		}
+		used += n;
 
-		if (tcsetpgrp(STDIN_FILENO, getpgrp()) == -1)
-			bail("tcsetpgrp-parent");
+		// An unterminated last line, or an overlong one, is run as is
+		if (n == 0) {
+			eof = 1;
+			if (used > 0)
+				cmd[used++] = '\n';
+		} else if (used == CMD_SIZE - 1 && memchr(cmd, '\n', used) == NULL) {
+			cmd[used++] = '\n';
+		}
 	}
 }
@@ -0,0 +1,170 @@
+/* spawn_bench.c
+ *
+ * Measure how the time to spawn a command grows with the resident set
+ * size of the parent, for the two ways the tools in this directory can
+ * create a child:
+ *
+ *   fork   fork() (or clone() without CLONE_VM), which copies the
+ *          parent's page tables
+ *   vfork  clone() with CLONE_VM|CLONE_VFORK, as used by the -V option
+ *          of ns_child_exec, ns_run and simple_init, which does not
+ *
+ * For each requested size the parent first allocates and touches that
+ * much memory, then times spawn+exec+exit of a command (default:
+ * /bin/true) through each path. Sizes larger than MemAvailable are
+ * skipped. Output is tab-separated, with latencies in microseconds.
+ *
+ * Build with: cc -o spawn_bench spawn_bench.c libns.c -pthread
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include "libns.h"
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+static char *cmd_argv[2] = { "/bin/true", NULL };
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-s list	 comma-separated parent RSS sizes in MiB\n");
+	fprintf(stderr, "		 (default: 10,100,1000,10000)\n");
+	fprintf(stderr, "	-n num	 spawns per size and path (default: 200)\n");
+	fprintf(stderr, "	-c cmd	 command to spawn (default: /bin/true)\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// The CLONE_VM child shares our memory: it must _exit(), never exit()
+static int childFunc(void *arg) {
+	execv(cmd_argv[0], cmd_argv);
+	_exit(127);
+}
+
+static double spawn_once(int vfork) {
+	double	start;
+	pid_t	pid;
+
+	start = now_us();
+	if (vfork) {
+		pid = ns_clone(childFunc, NULL, CLONE_VM | CLONE_VFORK);
+	} else {
+		pid = fork();
+		if (pid == 0)
+			childFunc(NULL);
+	}
+	if (pid == -1)
+		bail(vfork ? "clone" : "fork");
+
+	if (waitpid(pid, NULL, 0) == -1)
+		bail("waitpid");
+
+	return now_us() - start;
+}
+
+// MemAvailable from /proc/meminfo, in MiB, or -1 if unknown
+static long mem_available_mb(void) {
+	char	line[256];
+	long	kb = -1;
+	FILE	*fp;
+
+	fp = fopen("/proc/meminfo", "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "MemAvailable: %ld kB", &kb) == 1)
+			break;
+	fclose(fp);
+
+	return kb < 0 ? -1 : kb / 1024;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+	char	*sizes, *tok, *saveptr, *mem;
+	double	*lat, sum;
+	long	mb, avail;
+	int opt, count, vfork, j;
+
+	sizes = "10,100,1000,10000";
+	count = 200;
+
+	while ((opt = getopt(argc, argv, "s:n:c:")) != -1) {
+		switch (opt) {
+		case 's': sizes = optarg;		break;
+		case 'n': count = atoi(optarg);		break;
+		case 'c': cmd_argv[0] = optarg;		break;
+		default: usage(argv[0]);
+		}
+	}
+	if (count < 1 || optind != argc)
+		usage(argv[0]);
+
+	lat = calloc(count, sizeof(double));
+	if (lat == NULL)
+		bail("calloc");
+	sizes = strdup(sizes);
+	if (sizes == NULL)
+		bail("strdup");
+	avail = mem_available_mb();
+
+	printf("# rss_mb\tpath\tsamples\tp50\tp99\tmax\tmean\n");
+
+	for (tok = strtok_r(sizes, ",", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		mb = atol(tok);
+		if (avail != -1 && mb > avail) {
+			printf("%ld\tskipped\t(MemAvailable is %ld MiB)\n", mb, avail);
+			continue;
+		}
+
+		// Touch every page, so that fork() has page tables to copy
+		mem = mmap(NULL, mb << 20, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			bail("mmap");
+		memset(mem, 1, mb << 20);
+
+		for (vfork = 0; vfork <= 1; vfork++) {
+			for (sum = 0, j = 0; j < count; j++)
+				sum += lat[j] = spawn_once(vfork);
+			qsort(lat, count, sizeof(double), cmp_double);
+
+			printf("%ld\t%s\t%d\t%.1f\t%.1f\t%.1f\t%.1f\n", mb,
+			       vfork ? "vfork" : "fork", count, lat[count / 2],
+			       lat[(count * 99 + 99) / 100 - 1], lat[count - 1],
+			       sum / count);
+			fflush(stdout);
+		}
+
+		munmap(mem, mb << 20);
+	}
+
+	exit(EXIT_SUCCESS);
+}
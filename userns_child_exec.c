@@ -3,6 +3,23 @@
  * Create a child process that executes a shell command in new namespaces
  * allow UID and  GID mappings to be specified when creating
  * a user namespace
+ *
+ * With -I, directories are bind mounted into the child's mount namespace
+ * as ID-mapped mounts keyed to its user namespace, so that an image owned
+ * by IDs on the host appears owned by the same IDs inside, whatever the
+ * UID and GID maps shift them to, without a chown'ed copy per map.
+ *
+ * With -S, the settings come from a sandbox spec compiled by ns_spec:
+ * namespaces, maps and network as the options would give them, plus a
+ * hostname, a root filesystem and resource limits for the child. The
+ * spec is mapped read-only, with nothing left to parse or check.
+ *
+ * With -T, the launch is traced (see ns_trace.h): each phase, in parent
+ * and child, from building the maps to the command's execve(), is
+ * timed and written out as Chrome trace-event JSON. The phases are also
+ * USDT probes, which cost nothing when no tracer is attached.
+ *
+ * Build with: cc -o userns_child_exec userns_child_exec.c libns.c -pthread
  **/
 
 #define _GNU_SOURCE
@@ -16,6 +33,14 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include "libns.h"
+#include "ns_sync.h"
+#include "ns_trace.h"
 
 
 /* A simple error-handling function: print an error message based
@@ -27,11 +52,50 @@
 	} while (0)
 
 
+#define MAX_IDMOUNTS	16	// -I options
+
+// Trace tracks (-T)
+#define TRACK_PARENT	0
+#define TRACK_CHILD	1
+
+// An ID-mapped bind mount of `src` on `dst` in the child (-I)
+struct idmount {
+	char	*src;
+	char	*dst;
+	int	ro;
+};
+
+// Namespace and ID-mapping settings shared by every child we create
+struct launch_opts {
+	int	flags;		// CLONE_NEW* flags
+	const char	*uid_map;	// prepared uid_map text (see build_map()), or NULL
+	const char	*gid_map;	// prepared gid_map text, or NULL
+	const struct ns_net	*net;	// network setup (-N), or NULL
+	const struct ns_spec	*spec;	// compiled spec (-S), or NULL
+	struct ns_trace	*trace;	// launch trace (-T), or NULL
+	struct idmount	idmounts[MAX_IDMOUNTS];
+	int	nidmounts;
+};
+
 struct child_args {
 	char **argv;		// command to be execute by child, with arguments
-	int	pipe_fd[2];	// pipe used to synchronize parent and child
+	int	pipe_fd[2];	// command pipe of a pool stub
+	int	pool;		// nonzero if the child is a parked pool stub
+	struct ns_sync	*sync;	// handshake with the parent, if not a stub
+	struct launch_opts	*opts;
+	int	idmount_fds[MAX_IDMOUNTS];	// detached trees for -I
 };
 
+// A pre-created child parked in its namespaces, waiting for a command
+struct stub {
+	pid_t	pid;
+	int	fd;		// write end of the stub's command pipe
+};
+
+#define POOL_CMD_MAX	4096	// maximum size of a command handed to a stub
+#define POOL_ARGV_MAX	256	// maximum number of words in such a command
+#define POOL_REFILL_MS	100	// -R counts stubs created per this interval
+
 static int verbose;
 
 static void usage(char *name) {
@@ -51,6 +115,28 @@ static void usage(char *name) {
 	fprintf(stderr, "			 If -M or -G is specified, -U is required\n");
 	fprintf(stderr, "	-z		 Map user's UID and GID to 0 in user namespace\n");
 	fprintf(stderr, "			(equivalent to: -M '0 <uid> 1' -G '0 <gid> 1')\n");
+	fprintf(stderr, "	-a		 Check that the outside IDs of -M and -G are\n");
+	fprintf(stderr, "			 the caller's own or allowed to the caller by\n");
+	fprintf(stderr, "			 /etc/subuid and /etc/subgid\n");
+	fprintf(stderr, "	-N spec		 Set up the new network namespace (needs -n)\n");
+	fprintf(stderr, "			 before cmd runs: `lo` brings loopback up,\n");
+	fprintf(stderr, "			 `veth:HOSTIF:ADDR/PREFIX:GW` also creates a\n");
+	fprintf(stderr, "			 veth pair (" NS_NET_CHILD_IF " inside with ADDR, HOSTIF\n");
+	fprintf(stderr, "			 outside with GW; \"%%d\" becomes the child's PID)\n");
+	fprintf(stderr, "	-I src:dst[:ro]	 Bind mount `src` on `dst` in the child as an\n");
+	fprintf(stderr, "			 ID-mapped mount for its user namespace (needs\n");
+	fprintf(stderr, "			 -U and -m; may be repeated)\n");
+	fprintf(stderr, "	-S spec		 Take namespaces, maps, network, hostname, root\n");
+	fprintf(stderr, "			 filesystem and limits from a spec compiled by\n");
+	fprintf(stderr, "			 ns_spec (not with -M, -G, -z, -a or -N)\n");
+	fprintf(stderr, "	-T file		 Write a trace of the launch's phases to `file`\n");
+	fprintf(stderr, "			 as Chrome trace-event JSON (not with -P)\n");
+	fprintf(stderr, "	-P size		 Pool mode: keep `size` children parked in\n");
+	fprintf(stderr, "			 mapped namespaces and hand one out per command\n");
+	fprintf(stderr, "			 line read from stdin (cmd is then not given)\n");
+	fprintf(stderr, "	-R count	 In pool mode, create at most `count` new\n");
+	fprintf(stderr, "			 children every 100 ms (default: size);\n");
+	fprintf(stderr, "			 SIGUSR1 prints the pool's counters\n");
 	fprintf(stderr, "	-v		 Display verbose message\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "	If -z, -M, or -G is specified, -U is required.\n");
@@ -61,33 +147,47 @@ static void usage(char *name) {
 	fprintf(stderr, "	ID-inside-ns	ID-outside-ns	len\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "A map string can contain multiple records, separated by commas;\n");
-	fprintf(stderr, "the commas are replaced by newlines before we writing to map files\n");
+	fprintf(stderr, "records are merged where possible (at most %d extents remain)\n",
+		NS_MAP_MAX_EXTENTS);
 
 	exit(EXIT_FAILURE);
 }
 
 
-/* Update the mapping file `map_file`, with the value provided in
-  `mapping`, a string that defines a UID and GID mapping. A UID or GID
-   consists of one or more newline-delimited records of the form:
+/* Turn the map string `spec` into the text to write to a map file (see
+   ns_map_build()): parsed, merged, checked and formatted once, so that
+   every child we create costs a single write(). A map string consists of
+   one or more records of the form:
 
-     ID-inside-ns	Id-outside-ns length
+     ID-inside-ns	ID-outside-ns	length
 
-   Requireing the user to supply a string that contains newlines is
-   of course inconvenient for command-line use. Thuswe permit the
-   use of commas to delimit records in this string, and replace them
-   with newlines befores writing the string to the file
+   Requiring the user to supply a string that contains newlines is of
+   course inconvenient for command-line use, so records may also be
+   separated by commas.
 **/
+static char *build_map(const char *spec, const char *what,
+		       const char *allow_file, uid_t own_id) {
+	char	*text;
+	int	nrecords, nextents;
+
+	text = ns_map_build(spec, allow_file, own_id, &nrecords, &nextents);
+	if (text == NULL) {
+		fprintf(stderr, "ERROR: %s: %s\n", what, ns_error());
+		exit(EXIT_FAILURE);
+	}
+
+	if (verbose)
+		printf("%s: %d records, %d extents\n", what, nrecords, nextents);
+
+	return text;
+}
 
-static void update_map(char *mapping, char *map_file) {
-	int fd, j;
+// Write the prepared map text `mapping` to the map file `map_file`
+static void update_map(const char *mapping, char *map_file) {
+	int fd;
 	size_t	map_len;		// length of `mapping`
 
-	// Replace commas in mapping string with newlines
 	map_len = strlen(mapping);
-	for (j = 0; j < map_len; j++)
-		if (mapping[j] == ',')
-			mapping[j] = '\n';
 
 	fd = open(map_file, O_RDWR);
 	if (fd == -1) {
@@ -143,45 +243,502 @@ static void proc_setgroups_write(pid_t child_pid, char *str){
 	close(fd);
 }
 
-// Start function for cloned child
-static int childFunc(void *arg) {
-	struct child_args *args = (struct child_args*)arg;
-	char ch;
+/* Read exactly `len` bytes from `fd` into `buf`. Returns 0 on success,
+   or -1 on end of file or error */
+static int read_full(int fd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t	n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* ID-mapped mounts. Each source tree is cloned, detached, before the
+   child is created, so that the child inherits a file descriptor for the
+   very same mount. Once the child's maps are written, we (who have the
+   privilege over the source's filesystem that the child lacks) turn the
+   mount into an ID-mapped one keyed to the child's user namespace, and
+   the child attaches it where it belongs in its mount namespace.
+   ID-mapping is done without copying or chown'ing a single file. */
+
+// Clone the source trees of -I for a child about to be created
+static void open_idmounts(struct launch_opts *opts, int *fds) {
+	int j;
+
+	for (j = 0; j < opts->nidmounts; j++) {
+		fds[j] = open_tree(AT_FDCWD, opts->idmounts[j].src,
+				   OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | AT_RECURSIVE);
+		if (fds[j] == -1) {
+			fprintf(stderr, "ERROR: open_tree %s: %s\n",
+				opts->idmounts[j].src, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* ID-map the child's trees to its user namespace, and close our copies
+   of them. Returns 0, or -1 after reporting the error */
+static int map_idmounts(pid_t child_pid, struct launch_opts *opts, int *fds) {
+	struct mount_attr attr;
+	char path[PATH_MAX];
+	int j, userns_fd, ret;
+
+	if (opts->nidmounts == 0)
+		return 0;
+
+	snprintf(path, PATH_MAX, "/proc/%ld/ns/user", (long) child_pid);
+	userns_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (userns_fd == -1)
+		fprintf(stderr, "ERROR: open %s: %s\n", path, strerror(errno));
+
+	ret = (userns_fd == -1) ? -1 : 0;
+	for (j = 0; j < opts->nidmounts; j++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.attr_set = MOUNT_ATTR_IDMAP |
+				(opts->idmounts[j].ro ? MOUNT_ATTR_RDONLY : 0);
+		attr.userns_fd = userns_fd;
+		if (ret == 0 && mount_setattr(fds[j], "", AT_EMPTY_PATH | AT_RECURSIVE,
+					      &attr, sizeof(attr)) == -1) {
+			fprintf(stderr, "ERROR: ID-map %s: %s\n",
+				opts->idmounts[j].src, strerror(errno));
+			ret = -1;
+		}
+		close(fds[j]);
+	}
+	if (userns_fd != -1)
+		close(userns_fd);
 
-	// Wait until the parent has updated the UID and GID mappings.
-	// see comment in main(). We wait for end of file on a pipe that will
-	// be closed by the parent process once it has updated the mappings
+	return ret;
+}
+
+/* In the child: attach the ID-mapped trees. Returns 0, or -1 with errno
+   set after reporting the error */
+static int attach_idmounts(struct child_args *args) {
+	struct launch_opts *opts = args->opts;
+	int j;
+
+	for (j = 0; j < opts->nidmounts; j++) {
+		if (move_mount(args->idmount_fds[j], "", AT_FDCWD,
+			       opts->idmounts[j].dst, MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+			fprintf(stderr, "Failure in child: mount %s: %s\n",
+				opts->idmounts[j].dst, strerror(errno));
+			return -1;
+		}
+		close(args->idmount_fds[j]);
+	}
+
+	return 0;
+}
+
+/* In the child: apply the settings of the spec (-S) that are done from
+   inside, the hostname, limits and root filesystem. Returns 0, or -1
+   with errno set after reporting the error */
+static int apply_spec(struct launch_opts *opts) {
+	const struct ns_spec *spec = opts->spec;
+	int j;
+
+	if (spec == NULL)
+		return 0;
+
+	if (spec->hostname != NULL &&
+	    sethostname(spec->hostname, strlen(spec->hostname)) == -1) {
+		fprintf(stderr, "Failure in child: sethostname: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	for (j = 0; j < spec->nlimits; j++)
+		if (setrlimit(spec->limits[j].resource, &spec->limits[j].rlim) == -1) {
+			fprintf(stderr, "Failure in child: setrlimit %d: %s\n",
+				spec->limits[j].resource, strerror(errno));
+			return -1;
+		}
+	if (spec->rootfs != NULL && ns_rootfs_setup(spec->rootfs, 0) == -1) {
+		fprintf(stderr, "Failure in child: root filesystem: %s\n",
+			ns_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Body of a parked pool stub. The stub already lives in its new namespaces
+   and blocks until the parent has written the UID and GID maps and handed it
+   a command. A command is a 32-bit length followed by that many bytes of
+   NUL-terminated words; a length of zero tells the stub to exit. */
+static void pool_stub(struct child_args *args) {
+	char buf[POOL_CMD_MAX];
+	char *cmd_argv[POOL_ARGV_MAX + 1];
+	uint32_t len;
+	size_t off;
+	int argc;
 
-	// close our descriptor for the write end of the pipe so that we see EOF
-	// when parent closed its descriptor
 	close(args->pipe_fd[1]);
 
-	if (read(args->pipe_fd[0], &ch, 1) != 0) {
-		fprintf(stderr, "Failure in child: read from pipe returned !=0\n");
+	// Don't stay parked forever if the pool owner goes away
+	if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+		bail("prctl");
+
+	if (read_full(args->pipe_fd[0], &len, sizeof(len)) == -1 || len == 0)
+		_exit(EXIT_SUCCESS);
+
+	if (len > POOL_CMD_MAX || read_full(args->pipe_fd[0], buf, len) == -1 ||
+	    buf[len - 1] != '\0') {
+		fprintf(stderr, "Failure in child: bad command from pool\n");
+		_exit(EXIT_FAILURE);
+	}
+	close(args->pipe_fd[0]);
+
+	// The parent ID-mapped our trees before handing us a command
+	if (apply_spec(args->opts) == -1 || attach_idmounts(args) == -1)
+		_exit(EXIT_FAILURE);
+
+	argc = 0;
+	for (off = 0; off < len && argc < POOL_ARGV_MAX; off += strlen(buf + off) + 1)
+		cmd_argv[argc++] = buf + off;
+	cmd_argv[argc] = NULL;
+
+	execvp(cmd_argv[0], cmd_argv);
+	bail("execvp");
+}
+
+// Start function for cloned child
+static int childFunc(void *arg) {
+	struct child_args *args = (struct child_args*)arg;
+	struct ns_trace *trace = args->opts->trace;
+	struct ns_trace_phase	phase;
+
+	if (args->pool)
+		pool_stub(args);
+
+	// Wait until the parent has updated the UID and GID mappings and
+	// tells us to go ahead; see comment in main(). If the parent dies
+	// first, so do we
+	phase = ns_trace_begin(trace, TRACK_CHILD, "wait_parent");
+	if (ns_sync_wait(args->sync, NS_SYNC_EXEC, NS_SYNC_PARENT) == -1) {
+		fprintf(stderr, "Failure in child: parent: %s: %s\n",
+			ns_sync_error(args->sync), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	ns_trace_end(trace, phase);
+
+	phase = ns_trace_begin(trace, TRACK_CHILD, "apply_spec");
+	if (apply_spec(args->opts) == -1) {
+		ns_sync_fail(args->sync, errno, "spec");
 		exit(EXIT_FAILURE);
 	}
+	ns_trace_end(trace, phase);
+	phase = ns_trace_begin(trace, TRACK_CHILD, "attach_idmounts");
+	if (attach_idmounts(args) == -1) {
+		ns_sync_fail(args->sync, errno, "ID-mapped mounts");
+		exit(EXIT_FAILURE);
+	}
+	ns_trace_end(trace, phase);
 
+	// The parent ends this phase once the exec has closed our exec pipe
+	ns_trace_begin(trace, TRACK_CHILD, "execvp");
 	execvp(args->argv[0], args->argv);
+	ns_sync_fail(args->sync, errno, "execvp");	// let the parent know
 	bail("execvp");
 }
 
-#define STACK_SIZE	(1024 * 1024)
-static char child_stack[STACK_SIZE];		// space for child's stack
+/* Set up the child's network namespace as asked by -N. Returns 0, or -1
+   after reporting the error */
+static int setup_net(pid_t child_pid, struct launch_opts *opts) {
+	if (opts->net == NULL)
+		return 0;
+	if (ns_net_setup(child_pid, opts->net) == -1) {
+		fprintf(stderr, "ERROR: network setup: %s\n", ns_error());
+		return -1;
+	}
+	return 0;
+}
+
+// Write the UID and GID maps prepared in `opts` for the child `child_pid`
+static void write_maps(pid_t child_pid, struct launch_opts *opts) {
+	char map_path[PATH_MAX];
+	struct ns_trace_phase	phase;
+
+	if (opts->uid_map != NULL) {
+		phase = ns_trace_begin(opts->trace, TRACK_PARENT, "uid_map");
+		snprintf(map_path, PATH_MAX, "/proc/%ld/uid_map", (long) child_pid);
+		update_map(opts->uid_map, map_path);
+		ns_trace_end(opts->trace, phase);
+	}
+	if (opts->gid_map != NULL) {
+		phase = ns_trace_begin(opts->trace, TRACK_PARENT, "setgroups");
+		proc_setgroups_write(child_pid, "deny");
+		ns_trace_end(opts->trace, phase);
+		phase = ns_trace_begin(opts->trace, TRACK_PARENT, "gid_map");
+		snprintf(map_path, PATH_MAX, "/proc/%ld/gid_map", (long) child_pid);
+		update_map(opts->gid_map, map_path);
+		ns_trace_end(opts->trace, phase);
+	}
+}
+
+/* Create one pool stub: clone it into its namespaces, write its maps and
+   set up its ID-mapped mounts and network. The stub is then parked on
+   its command pipe. The pipe is close-on-exec, so stubs and the commands
+   they run don't hold each other's pipes open. */
+static void create_stub(struct launch_opts *opts, struct stub *st) {
+	struct child_args args;
+
+	args.argv = NULL;
+	args.pool = 1;
+	args.opts = opts;
+	if (pipe2(args.pipe_fd, O_CLOEXEC) == -1)
+		bail("pipe2");
+	open_idmounts(opts, args.idmount_fds);
+
+	st->pid = ns_clone(childFunc, &args, opts->flags);
+	if (st->pid == -1)
+		bail("clone");
+
+	close(args.pipe_fd[0]);
+	write_maps(st->pid, opts);
+	st->fd = args.pipe_fd[1];
+
+	// A stub without its network or mounts would run commands without
+	// them: drop it
+	if (map_idmounts(st->pid, opts, args.idmount_fds) == -1 ||
+	    setup_net(st->pid, opts) == -1) {
+		close(st->fd);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Hand the command line `line` to the stub `st`. The line is split into
+   whitespace-separated words, which are sent as NUL-terminated strings.
+   Returns 0 on success or -1 if the stub could not take the command */
+static int dispatch(struct stub *st, char *line) {
+	char buf[sizeof(uint32_t) + POOL_CMD_MAX];
+	uint32_t len;
+	char *word, *saveptr;
+	size_t wlen;
+
+	len = 0;
+	for (word = strtok_r(line, " \t", &saveptr); word != NULL;
+	     word = strtok_r(NULL, " \t", &saveptr)) {
+		wlen = strlen(word) + 1;
+		if (len + wlen > POOL_CMD_MAX) {
+			fprintf(stderr, "pool: command too long\n");
+			return -1;
+		}
+		memcpy(buf + sizeof(len) + len, word, wlen);
+		len += wlen;
+	}
+	if (len == 0)
+		return -1;
+
+	memcpy(buf, &len, sizeof(len));
+	if (write(st->fd, buf, sizeof(len) + len) != (ssize_t) (sizeof(len) + len)) {
+		perror("pool: write");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Reap terminated children without blocking. Stubs that die while still
+   parked are dropped from the pool */
+static void pool_reap(struct stub *pool, int *avail) {
+	pid_t	pid;
+	int status, j;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (j = 0; j < *avail; j++) {
+			if (pool[j].pid == pid) {
+				close(pool[j].fd);
+				pool[j] = pool[--(*avail)];
+				break;
+			}
+		}
+
+		if (verbose)
+			printf("pool: PID %ld exited with status %d\n",
+				(long) pid, WIFEXITED(status) ?
+				WEXITSTATUS(status) : 128 + WTERMSIG(status));
+	}
+}
+
+static volatile sig_atomic_t	report_pool;	// SIGUSR1 received
+
+static void pool_sigusr1(int sig) {
+	report_pool = 1;
+}
+
+static void pool_stats(int pool_size, int refill, int avail,
+		       unsigned long hits, unsigned long misses,
+		       unsigned long created) {
+	fprintf(stderr, "pool: size=%d refill=%d parked=%d hits=%lu misses=%lu "
+		"created=%lu\n", pool_size, refill, avail, hits, misses, created);
+}
+
+/* Pool mode: keep up to `pool_size` stubs parked, and run each command line
+   read from standard input in one of them. When the pool is empty the
+   command gets a freshly created stub instead (a miss). The pool is topped
+   up one stub at a time, and only while no command is waiting, so that a
+   command never waits behind more than one stub being created; at most
+   `refill` stubs are created every POOL_REFILL_MS. The counters are
+   printed on SIGUSR1 and at the end */
+static void run_pool(struct launch_opts *opts, int pool_size, int refill) {
+	struct stub *pool, st;
+	struct sigaction sa;
+	char line[POOL_CMD_MAX + 1];
+	size_t used;
+	ssize_t	n;
+	char *nl;
+	int avail, j, eof, timeout, burst;
+	unsigned long hits, misses, created;
+	uint64_t now, window;
+	struct pollfd pfd;
+
+	pool = calloc(pool_size, sizeof(struct stub));
+	if (pool == NULL)
+		bail("calloc");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pool_sigusr1;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		bail("sigaction");
+
+	avail = 0;
+	hits = misses = created = 0;
+	used = 0;
+	eof = 0;
+	window = 0;
+	burst = 0;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+
+	while (!eof) {
+		pool_reap(pool, &avail);
+		if (report_pool) {
+			report_pool = 0;
+			pool_stats(pool_size, refill, avail, hits, misses, created);
+		}
+
+		// Don't wait for input while there is refilling to do
+		now = ns_trace_now() / 1000000;
+		if (now - window >= POOL_REFILL_MS) {
+			window = now;
+			burst = 0;
+		}
+		if (avail == pool_size)
+			timeout = POOL_REFILL_MS;
+		else if (burst < refill)
+			timeout = 0;
+		else
+			timeout = window + POOL_REFILL_MS - now;
+
+		n = poll(&pfd, 1, timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			bail("poll");
+		}
+		if (n == 0 || !(pfd.revents & (POLLIN | POLLHUP))) {
+			if (avail < pool_size && burst < refill) {
+				create_stub(opts, &pool[avail++]);
+				created++;
+				burst++;
+			}
+			continue;
+		}
+
+		n = read(STDIN_FILENO, line + used, POOL_CMD_MAX - used);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			bail("read");
+		}
+		if (n == 0) {
+			eof = 1;
+			if (used == 0)
+				break;
+			line[used++] = '\n';	// treat unterminated last line as a command
+		}
+		used += n;
+
+		// Run every complete line now in the buffer
+		while ((nl = memchr(line, '\n', used)) != NULL) {
+			*nl = '\0';
+
+			// ignore empty commands
+			if (strspn(line, " \t") != strlen(line)) {
+				if (avail > 0) {
+					st = pool[--avail];
+					hits++;
+				} else {
+					create_stub(opts, &st);
+					created++;
+					misses++;
+				}
+
+				if (verbose)
+					printf("pool: running \"%s\" in PID %ld\n",
+						line, (long) st.pid);
+				dispatch(&st, line);
+				close(st.fd);	// stub exits if it was given nothing
+			}
+
+			used -= nl + 1 - line;
+			memmove(line, nl + 1, used);
+		}
+
+		if (used == POOL_CMD_MAX) {
+			fprintf(stderr, "pool: command line too long, discarded\n");
+			used = 0;
+		}
+	}
+
+	// Release the parked stubs: they see EOF and exit
+	for (j = 0; j < avail; j++)
+		close(pool[j].fd);
+	free(pool);
+
+	while (waitpid(-1, NULL, 0) != -1 || errno == EINTR)
+		continue;
+
+	pool_stats(pool_size, refill, 0, hits, misses, created);
+}
 
 int main(int argc, char **argv) {
-	int flags, opt, map_zero;
+	static const char *tracks[] = { "parent", "child" };
+	struct ns_trace_phase	launch, phase;
+	int opt, pool_size, refill, map_zero, check;
+	int	exec_pipe[2], watch_exec;
+	char	*uid_spec, *gid_spec, *net_spec, *spec_path, *trace_path, c;
+	char	zero_uid[32], zero_gid[32];
+	struct idmount	*im;
+	struct ns_net	net;
 	pid_t	child_pid;
 	struct child_args	args;
-	char *uid_map, *gid_map;
-	char map_path[PATH_MAX];
-	const int MAP_BUF_SIZE = 100;
-	char map_buf[MAP_BUF_SIZE];
-
-	flags = 0;
-	verbose = 0;
+	struct launch_opts	opts;
+
+	opts.flags = 0;
+	opts.gid_map = NULL;
+	opts.uid_map = NULL;
+	opts.net = NULL;
+	opts.spec = NULL;
+	opts.trace = NULL;
+	opts.nidmounts = 0;
+	uid_spec = gid_spec = net_spec = spec_path = trace_path = NULL;
 	map_zero = 0;
-	gid_map = NULL;
-	uid_map = NULL;
+	check = 0;
+	verbose = 0;
+	pool_size = 0;
+	refill = 0;
 
 	/* Parse command-line options
 	 the initial `+` character in the final getopt() argument
@@ -190,33 +747,132 @@ int main(int argc, char **argv) {
 	 programe itself has command-line options.
 	 We do not want getopt() to treat those as options to this program.
 	*/
-	while ((opt = getopt(argc, argv, "+imnpuUvM:G:z")) != -1) {
+	while ((opt = getopt(argc, argv, "+imnpuUvM:G:zaP:R:N:I:S:T:")) != -1) {
 		switch(opt) {
-		case 'i': flags |= CLONE_NEWIPC;	break;
-		case 'm': flags |= CLONE_NEWNS;		break;
-		case 'n': flags |= CLONE_NEWNET;	break;
-		case 'p': flags |= CLONE_NEWPID;	break;
-		case 'u': flags |= CLONE_NEWUTS;	break;
+		case 'i': opts.flags |= CLONE_NEWIPC;	break;
+		case 'm': opts.flags |= CLONE_NEWNS;	break;
+		case 'n': opts.flags |= CLONE_NEWNET;	break;
+		case 'p': opts.flags |= CLONE_NEWPID;	break;
+		case 'u': opts.flags |= CLONE_NEWUTS;	break;
 		case 'v': verbose = 1;			break;
 		case 'z': map_zero = 1;			break;
-		case 'M': uid_map = optarg;		break;
-		case 'G': gid_map = optarg;		break;
-		case 'U': flags |= CLONE_NEWUSER;	break;
+		case 'a': check = 1;			break;
+		case 'M': uid_spec = optarg;		break;
+		case 'G': gid_spec = optarg;		break;
+		case 'U': opts.flags |= CLONE_NEWUSER;	break;
+		case 'P': pool_size = atoi(optarg);	break;
+		case 'R': refill = atoi(optarg);	break;
+		case 'N': net_spec = optarg;		break;
+		case 'S': spec_path = optarg;		break;
+		case 'T': trace_path = optarg;		break;
+		case 'I':
+			if (opts.nidmounts == MAX_IDMOUNTS)
+				usage(argv[0]);
+			im = &opts.idmounts[opts.nidmounts++];
+			im->src = strtok(optarg, ":");
+			im->dst = strtok(NULL, ":");
+			im->ro = 0;
+			if (im->dst == NULL)
+				usage(argv[0]);
+			if ((optarg = strtok(NULL, ":")) != NULL) {
+				if (strcmp(optarg, "ro") != 0)
+					usage(argv[0]);
+				im->ro = 1;
+			}
+			break;
 		default: usage(argv[0]);
 		}
 	}
 
+	// Tracing covers one launch, from here to its exec
+	if (trace_path != NULL) {
+		if (pool_size > 0)
+			usage(argv[0]);
+		opts.trace = ns_trace_create();
+		if (opts.trace == NULL)
+			bail("ns_trace_create");
+		opts.trace->pid[TRACK_PARENT] = getpid();
+	}
+	launch = ns_trace_begin(opts.trace, TRACK_PARENT, "launch");
+	phase = ns_trace_begin(opts.trace, TRACK_PARENT, "prepare");
+
+	// A spec brings its own namespaces, maps and network
+	if (spec_path != NULL) {
+		if (uid_spec != NULL || gid_spec != NULL || map_zero ||
+		    check || net_spec != NULL)
+			usage(argv[0]);
+		opts.spec = ns_spec_open(spec_path);
+		if (opts.spec == NULL) {
+			fprintf(stderr, "ERROR: -S: %s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+		opts.flags |= opts.spec->flags;
+		opts.uid_map = opts.spec->uid_map;
+		opts.gid_map = opts.spec->gid_map;
+		opts.net = opts.spec->net;
+	}
+
 	// -M or -g without -U is nosensical
-	if (((uid_map != NULL || gid_map != NULL || map_zero) && !(flags & CLONE_NEWUSER)) || 
-		(map_zero && (uid_map != NULL || gid_map != NULL)))
+	if (((uid_spec != NULL || gid_spec != NULL || map_zero) &&
+	     !(opts.flags & CLONE_NEWUSER)) ||
+		(map_zero && (uid_spec != NULL || gid_spec != NULL)))
+		usage(argv[0]);
+
+	// ID-mapped mounts are keyed to the child's user namespace, and
+	// attached in its own mount namespace
+	if (opts.nidmounts > 0 &&
+	    (opts.flags & (CLONE_NEWUSER | CLONE_NEWNS)) !=
+	    (CLONE_NEWUSER | CLONE_NEWNS))
 		usage(argv[0]);
 
+	if (net_spec != NULL) {
+		if (!(opts.flags & CLONE_NEWNET))
+			usage(argv[0]);
+		if (ns_net_parse(net_spec, &net) == -1) {
+			fprintf(stderr, "ERROR: -N: %s\n", ns_error());
+			exit(EXIT_FAILURE);
+		}
+		opts.net = &net;
+	}
+
+	if (map_zero) {
+		snprintf(zero_uid, sizeof(zero_uid), "0 %ld 1", (long) getuid());
+		snprintf(zero_gid, sizeof(zero_gid), "0 %ld 1", (long) getgid());
+		uid_spec = zero_uid;
+		gid_spec = zero_gid;
+	}
+
+	// Prepare the maps once; every child then gets them in one write each
+	if (uid_spec != NULL)
+		opts.uid_map = build_map(uid_spec, "uid_map",
+					 check ? "/etc/subuid" : NULL, getuid());
+	if (gid_spec != NULL)
+		opts.gid_map = build_map(gid_spec, "gid_map",
+					 check ? "/etc/subgid" : NULL, getgid());
+
+	// Pool mode takes its commands from stdin
+	if (pool_size > 0) {
+		if (optind < argc || refill < 0)
+			usage(argv[0]);
+		run_pool(&opts, pool_size, refill > 0 ? refill : pool_size);
+		exit(EXIT_SUCCESS);
+	}
+
 	if (optind >= argc)
 		usage(argv[0]);
 
 	args.argv = &argv[optind];
+	args.pool = 0;
+	args.opts = &opts;
+	open_idmounts(&opts, args.idmount_fds);
 
-	// We use a pipe to synchronize the parent and child. in order to
+	// When traced, we see the exec as the close of this close-on-exec
+	// pipe, and end the execvp phase then; otherwise there is no waiting
+	watch_exec = ns_trace_active(opts.trace);
+	if (watch_exec && pipe2(exec_pipe, O_CLOEXEC) == -1)
+		bail("pipe2");
+
+	// We use a handshake to synchronize the parent and child. in order to
 	// ensure that the parent sets the UID  and GID maps before the child call
 	// execve().
 	// This ensures that the child maintains its capabilities during the execve()
@@ -226,43 +882,71 @@ int main(int argc, char **argv) {
 	// if it performed an execve() with nonzero user IDs
 	// (see the capabilities(7) man page for details of the
 	// transformation of a process's capabilities during execve())
-	if (pipe(args.pipe_fd) == -1)
-		bail("pipe");
-
-	// create the child in new namespaces
-	child_pid = clone(childFunc, child_stack + STACK_SIZE, flags | SIGCHLD, &args);
+	args.sync = ns_sync_create();
+	if (args.sync == NULL)
+		bail("ns_sync_create");
+
+	// create the child in new namespaces (with nothing buffered that both
+	// of us could flush)
+	fflush(stdout);
+	ns_trace_end(opts.trace, phase);
+	phase = ns_trace_begin(opts.trace, TRACK_PARENT, "clone");
+	child_pid = ns_clone(childFunc, &args, opts.flags);
 	if (child_pid == -1)
 		bail("clone");
+	ns_trace_end(opts.trace, phase);
 
 	// Parent falls through to here
 	if (verbose)
 		printf("%s: PID of child created by clone() is %ld\n", argv[0], (long) child_pid);
 
 	// Update the uid and gid maps in the child
-	if (uid_map != NULL || map_zero) {
-		snprintf(map_path, PATH_MAX, "/proc/%ld/uid_map", (long) child_pid);
-		if (map_zero ){
-			snprintf(map_buf, MAP_BUF_SIZE, "0 %ld 1", (long) getuid());
-			uid_map = map_buf;
-		}
-		update_map(uid_map, map_path);
+	write_maps(child_pid, &opts);
+
+	// Then its ID-mapped mounts and network, if asked to; the child
+	// doesn't run the command without them
+	phase = ns_trace_begin(opts.trace, TRACK_PARENT, "map_idmounts");
+	if (map_idmounts(child_pid, &opts, args.idmount_fds) == -1)
+		ns_sync_fail(args.sync, errno, "ID-mapped mounts");
+	ns_trace_end(opts.trace, phase);
+	phase = ns_trace_begin(opts.trace, TRACK_PARENT, "setup_net");
+	if (setup_net(child_pid, &opts) == -1)
+		ns_sync_fail(args.sync, errno, "network setup");
+	ns_trace_end(opts.trace, phase);
+
+	// Nothing else to set up, so skip the later stages: tell the child to
+	// execute the command
+	ns_sync_post(args.sync, NS_SYNC_EXEC);
+
+	if (opts.trace != NULL)
+		opts.trace->pid[TRACK_CHILD] = child_pid;
+	if (watch_exec) {
+		phase = ns_trace_begin(opts.trace, TRACK_PARENT, "wait_exec");
+		close(exec_pipe[1]);
+		while (read(exec_pipe[0], &c, 1) == -1 && errno == EINTR)
+			continue;
+		close(exec_pipe[0]);
+		ns_trace_end(opts.trace, phase);
+		if (__atomic_load_n(&args.sync->stage, __ATOMIC_ACQUIRE) !=
+		    NS_SYNC_ERROR)
+			ns_trace_end(opts.trace,
+				     ns_trace_find(opts.trace, "execvp"));
 	}
-	if (gid_map != NULL || map_zero) {
-		proc_setgroups_write(child_pid, "deny");
-		snprintf(map_path, PATH_MAX, "/proc/%ld/gid_map", (long) child_pid);
-		if (map_zero ){
-			snprintf(map_buf, MAP_BUF_SIZE, "0 %ld 1", (long) getgid());
-			gid_map = map_buf;
-		}
-		update_map(gid_map, map_path);
-	}
-
-	// close the write end of the pipe, to signal to the child that we have
-	// update the UID and GID maps
-	close(args.pipe_fd[1]);
+	ns_trace_end(opts.trace, launch);
 
+	phase = ns_trace_begin(opts.trace, TRACK_PARENT, "run");
 	if (waitpid(child_pid, NULL, 0) == -1)
 		bail("waitpid");
+	ns_trace_end(opts.trace, phase);
+
+	if (opts.trace != NULL &&
+	    ns_trace_write(opts.trace, trace_path, getpid(), tracks, 2) == -1)
+		fprintf(stderr, "ERROR: -T %s: %s\n", trace_path, strerror(errno));
+
+	if (ns_sync_wait(args.sync, NS_SYNC_EXEC, 0) == -1 && verbose)
+		printf("%s: child failed: %s: %s\n", argv[0],
+		       ns_sync_error(args.sync), strerror(errno));
+	ns_sync_destroy(args.sync);
 
 	if (verbose)
 		printf("%s: terminating\n", argv[0]);
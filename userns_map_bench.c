@@ -0,0 +1,401 @@
+/* userns_map_bench.c
+ *
+ * Measure how the shape of a user namespace's UID map affects the cost of
+ * system calls that translate IDs.
+ *
+ * The kernel searches maps of up to 5 extents linearly, in the order they
+ * were written, and larger maps (up to 340 extents) by binary search over
+ * sorted copies. For each number of extents, layout and nesting depth,
+ * this program creates user namespaces whose UID map has that many
+ * extents, and then times tight loops of:
+ *
+ *   getuid  translate our own UID (root, in the first extent)
+ *   stat    report the owner of a file owned by an ID in the last extent
+ *   open    open that file, which takes a CAP_DAC_OVERRIDE check against
+ *           its owner and group
+ *   chown   give the file to IDs in the last extents
+ *
+ * Layouts (all made of single-ID extents, so that none can be merged, and
+ * so that 340 of them fit in the single page the kernel accepts):
+ *
+ *   split    inside IDs contiguous, outside IDs spread out
+ *   scatter  inside IDs spread out, outside IDs in reverse order
+ *
+ * Nested namespaces get identity maps of the same shape at each level.
+ * A row with 0 extents measures the initial user namespace. Output is
+ * tab-separated, in nanoseconds per call. Must be run as root.
+ **/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+/* A simple error-handling function: print an error message based
+   on the value `errno` and terminate the calling process
+*/
+#define bail(msg)				\
+	do { perror(msg);			\
+		exit(EXIT_FAILURE);		\
+	} while (0)
+
+#define MAX_EXTENTS	340
+#define OUTSIDE_BASE	1000	// outside IDs start here, away from real users
+
+#define OP_GETUID	0
+#define OP_STAT		1
+#define OP_OPEN		2
+#define OP_CHOWN	3
+#define NUM_OPS		4
+
+static char *op_names[NUM_OPS] = { "getuid", "stat", "open", "chown" };
+
+// One benchmark case
+struct map_case {
+	int	scatter;		// layout: 0 split, 1 scatter
+	int	extents;		// number of extents, 0 for no user namespace
+	int	depth;			// nesting depth of user namespaces
+	uid_t	inside[MAX_EXTENTS];
+	uid_t	outside[MAX_EXTENTS];
+};
+
+static long iterations = 200000;
+static char file_path[PATH_MAX];
+
+static void usage(char *name) {
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "Options can be:\n");
+	fprintf(stderr, "	-e list	 comma-separated numbers of map extents, 1..%d\n",
+		MAX_EXTENTS);
+	fprintf(stderr, "		 (default: 1,2,4,5,6,8,16,64,340)\n");
+	fprintf(stderr, "	-l list	 layouts: split, scatter (default: both)\n");
+	fprintf(stderr, "	-d list	 nesting depths (default: 1,2,4)\n");
+	fprintf(stderr, "	-n num	 calls per measurement (default: 200000)\n");
+	fprintf(stderr, "	-f dir	 directory for the test file (default: /tmp)\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Lay out the extents of `c`; extent 0 always maps inside ID 0
+static void make_layout(struct map_case *c) {
+	int j;
+
+	for (j = 0; j < c->extents; j++) {
+		if (c->scatter) {
+			c->inside[j] = 2 * j;
+			c->outside[j] = OUTSIDE_BASE + 2 * (c->extents - 1 - j);
+		} else {
+			c->inside[j] = j;
+			c->outside[j] = OUTSIDE_BASE + 2 * j;
+		}
+	}
+}
+
+/* Write the map of `c` to `map_file`, in extent order. With `identity`,
+   inside IDs are mapped to themselves, which is what nested namespaces
+   get: their parent's inside IDs are their outside IDs */
+static void write_map(struct map_case *c, char *map_file, int identity) {
+	char	buf[4096];
+	int	fd, j, len;
+
+	for (len = 0, j = 0; j < c->extents; j++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%u %u 1\n",
+				c->inside[j],
+				identity ? c->inside[j] : c->outside[j]);
+
+	fd = open(map_file, O_WRONLY);
+	if (fd == -1)
+		bail("open map");
+	if (write(fd, buf, len) != len)
+		bail("write map");
+	close(fd);
+}
+
+// Time each operation in the current namespaces; results in ns per call
+static void run_loops(struct map_case *c, double *res) {
+	struct stat	sb;
+	uid_t	owner[2];
+	double	start;
+	long	j;
+	int	fd;
+
+	// The file is owned by the last extent; chown alternates between the
+	// last two (with no namespace, between the file's owner and root)
+	owner[0] = c->extents > 0 ? c->inside[c->extents - 1] : OUTSIDE_BASE;
+	owner[1] = c->extents > 1 ? c->inside[c->extents - 2] : 0;
+
+	start = now_ns();
+	for (j = 0; j < iterations; j++)
+		getuid();
+	res[OP_GETUID] = (now_ns() - start) / iterations;
+
+	start = now_ns();
+	for (j = 0; j < iterations; j++)
+		if (stat(file_path, &sb) == -1)
+			bail("stat");
+	res[OP_STAT] = (now_ns() - start) / iterations;
+	if (sb.st_uid != owner[0]) {
+		fprintf(stderr, "file owner is %ld, expected %ld\n",
+			(long) sb.st_uid, (long) owner[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	start = now_ns();
+	for (j = 0; j < iterations; j++) {
+		fd = open(file_path, O_RDONLY);
+		if (fd == -1)
+			bail("open");
+		close(fd);
+	}
+	res[OP_OPEN] = (now_ns() - start) / iterations;
+
+	start = now_ns();
+	for (j = 0; j < iterations; j++)
+		if (chown(file_path, owner[(j + 1) & 1], -1) == -1)
+			bail("chown");
+	res[OP_CHOWN] = (now_ns() - start) / iterations;
+
+	chown(file_path, owner[0], -1);
+}
+
+/* Create a child in a new user namespace and map it. The child unshare()s
+   and waits; the parent, which is in the namespace above and keeps its
+   capabilities there, writes the maps. Returns the child's PID in the
+   parent and 0 in the child */
+static pid_t fork_mapped(struct map_case *c, int identity) {
+	char	path[PATH_MAX], ch;
+	int	ready[2], go[2], fd;
+	pid_t	pid;
+
+	if (pipe(ready) == -1 || pipe(go) == -1)
+		bail("pipe");
+
+	pid = fork();
+	if (pid == -1)
+		bail("fork");
+
+	if (pid == 0) {
+		close(ready[0]);
+		close(go[1]);
+		if (unshare(CLONE_NEWUSER) == -1)
+			bail("unshare");
+		if (write(ready[1], "r", 1) != 1 || read(go[0], &ch, 1) != 1)
+			_exit(EXIT_FAILURE);
+		close(ready[1]);
+		close(go[0]);
+
+		// Become the namespace's root, so that we are mapped in it and
+		// may create a nested namespace. Changing IDs makes us
+		// undumpable, which would make our /proc files unwritable to the
+		// level above; undo that
+		if (setresgid(0, 0, 0) == -1 || setresuid(0, 0, 0) == -1)
+			bail("setresuid");
+		if (prctl(PR_SET_DUMPABLE, 1) == -1)
+			bail("prctl");
+		return 0;
+	}
+
+	close(ready[1]);
+	close(go[0]);
+	if (read(ready[0], &ch, 1) != 1) {
+		fprintf(stderr, "child failed to create a user namespace\n");
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%ld/uid_map", (long) pid);
+	write_map(c, path, identity);
+
+	// The file's group must be mapped too, for the capability checks
+	snprintf(path, sizeof(path), "/proc/%ld/gid_map", (long) pid);
+	fd = open(path, O_WRONLY);
+	if (fd == -1 || write(fd, "0 0 1\n", 6) != 6)
+		bail("write gid_map");
+	close(fd);
+
+	if (write(go[1], "g", 1) != 1)
+		bail("write");
+	close(ready[0]);
+	close(go[1]);
+	return pid;
+}
+
+// Run one case in a child; the results come back over a pipe
+static int measure(struct map_case *c, double *res) {
+	int	pfd[2], level, status;
+	pid_t	pid;
+
+	if (pipe(pfd) == -1)
+		bail("pipe");
+
+	pid = (c->extents > 0) ? fork_mapped(c, 0) : fork();
+	if (pid == -1)
+		bail("fork");
+
+	if (pid == 0) {
+		close(pfd[0]);
+
+		// Each further level is mapped by the one above it, which then
+		// just waits and passes on the exit status
+		for (level = 1; level < c->depth; level++) {
+			pid = fork_mapped(c, 1);
+			if (pid != 0) {
+				if (waitpid(pid, &status, 0) == -1)
+					bail("waitpid");
+				_exit(WIFEXITED(status) ? WEXITSTATUS(status) :
+				      EXIT_FAILURE);
+			}
+		}
+
+		run_loops(c, res);
+		if (write(pfd[1], res, NUM_OPS * sizeof(double)) !=
+		    NUM_OPS * sizeof(double))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pfd[1]);
+	status = read(pfd[0], res, NUM_OPS * sizeof(double));
+	close(pfd[0]);
+	waitpid(pid, NULL, 0);
+
+	return status == NUM_OPS * sizeof(double) ? 0 : -1;
+}
+
+static void report(struct map_case *c, double *res) {
+	int j;
+
+	printf("%s\t%d\t%d", c->extents == 0 ? "-" : c->scatter ? "scatter" : "split",
+	       c->extents, c->depth);
+	for (j = 0; j < NUM_OPS; j++)
+		printf("\t%.1f", res[j]);
+	printf("\n");
+	fflush(stdout);
+}
+
+// Parse a comma-separated list of positive numbers into `v`
+static int parse_list(char *s, int *v, int max, int limit) {
+	char	*tok, *saveptr;
+	int n = 0;
+
+	for (tok = strtok_r(s, ",", &saveptr); tok != NULL && n < max;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		v[n] = atoi(tok);
+		if (v[n] < 1 || v[n] > limit)
+			return -1;
+		n++;
+	}
+
+	return n;
+}
+
+int main(int argc, char **argv) {
+	int	extents[64], depths[64], nextents, ndepths, layouts;
+	char	*elist, *dlist, *dir, *tok, *saveptr;
+	struct map_case	*c;
+	double	res[NUM_OPS];
+	int	opt, fd, e, d, l, j;
+
+	elist = "1,2,4,5,6,8,16,64,340";
+	dlist = "1,2,4";
+	dir = "/tmp";
+	layouts = 3;			// bit 0: split, bit 1: scatter
+
+	while ((opt = getopt(argc, argv, "e:l:d:n:f:")) != -1) {
+		switch (opt) {
+		case 'e': elist = optarg;		break;
+		case 'd': dlist = optarg;		break;
+		case 'n': iterations = atol(optarg);	break;
+		case 'f': dir = optarg;			break;
+		case 'l':
+			layouts = 0;
+			for (tok = strtok_r(optarg, ",", &saveptr); tok != NULL;
+			     tok = strtok_r(NULL, ",", &saveptr)) {
+				if (strcmp(tok, "split") == 0)
+					layouts |= 1;
+				else if (strcmp(tok, "scatter") == 0)
+					layouts |= 2;
+				else
+					usage(argv[0]);
+			}
+			break;
+		default: usage(argv[0]);
+		}
+	}
+
+	elist = strdup(elist);
+	dlist = strdup(dlist);
+	if (elist == NULL || dlist == NULL)
+		bail("strdup");
+	nextents = parse_list(elist, extents, 64, MAX_EXTENTS);
+	ndepths = parse_list(dlist, depths, 64, 32);
+	if (optind != argc || iterations < 1 || nextents < 1 || ndepths < 1 ||
+	    layouts == 0)
+		usage(argv[0]);
+
+	// The file to stat, open and chown; readable by its owner only, so
+	// that opening it takes a capability check
+	snprintf(file_path, sizeof(file_path), "%s/userns_map_bench.XXXXXX", dir);
+	fd = mkstemp(file_path);
+	if (fd == -1)
+		bail("mkstemp");
+	close(fd);
+	if (chmod(file_path, 0600) == -1)
+		bail("chmod");
+
+	c = calloc(1, sizeof(struct map_case));
+	if (c == NULL)
+		bail("calloc");
+
+	printf("# layout\textents\tdepth");
+	for (j = 0; j < NUM_OPS; j++)
+		printf("\t%s", op_names[j]);
+	printf("\n");
+
+	// Baseline: no user namespace
+	if (chown(file_path, OUTSIDE_BASE, -1) == -1)
+		bail("chown");
+	if (measure(c, res) == -1)
+		fprintf(stderr, "baseline failed\n");
+	else
+		report(c, res);
+
+	for (l = 0; l < 2; l++) {
+		if (!(layouts & (1 << l)))
+			continue;
+		for (e = 0; e < nextents; e++) {
+			for (d = 0; d < ndepths; d++) {
+				c->scatter = l;
+				c->extents = extents[e];
+				c->depth = depths[d];
+				make_layout(c);
+
+				if (chown(file_path, c->outside[c->extents - 1], -1) == -1)
+					bail("chown");
+				if (measure(c, res) == -1) {
+					printf("%s\t%d\t%d\terror\n", l ? "scatter" : "split",
+					       c->extents, c->depth);
+					fflush(stdout);
+				} else
+					report(c, res);
+			}
+		}
+	}
+
+	unlink(file_path);
+	exit(EXIT_SUCCESS);
+}
@@ -16,6 +16,7 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <unistd.h>
+#include "ns_sync.h"
 
 /* A simple error-handling function: print an error message based
    on the value `errno` and terminate the calling process
@@ -50,12 +51,16 @@ static void test_setns(char *pname, int fd) {
 		printf("%s setns() succeeded\n", pname);
 }
 
+static struct ns_sync *handshake;		// handshake with the parent
+
 // Start function for cloned child
 static int childFunc(void *arg) {
 	long fd = (long)arg;
 
-	// Avoid intermingling withparent's output
-	usleep(100000);
+	// Avoid intermingling withparent's output: wait until the parent
+	// has done its test
+	if (ns_sync_wait(handshake, NS_SYNC_EXEC, NS_SYNC_PARENT) == -1)
+		bail("ns_sync_wait");
 
 	// Test whether setns() is possible from the child user namespace
 	test_setns("child: ", fd);
@@ -81,6 +86,10 @@ int main(int argc, char **argv) {
 	if (fd == -1)
 		bail("open");
 
+	handshake = ns_sync_create();
+	if (handshake == NULL)
+		bail("ns_sync_create");
+
 	// Create child process in new user namespace
 	child_pid = clone(childFunc, child_stack+STACK_SIZE, CLONE_NEWUSER | SIGCHLD, (void*)fd);
 	if (child_pid == -1)
@@ -89,6 +98,12 @@ int main(int argc, char **argv) {
 	// Test whether setns() is possible from parent user namespace
 	test_setns("parent: ", fd );
 	printf("\n");
+	fflush(stdout);
+
+	// Now let the child do its test
+	ns_sync_post(handshake, NS_SYNC_EXEC);
+	if (waitpid(child_pid, NULL, 0) == -1)
+		bail("waitpid");
 
 	exit(EXIT_SUCCESS);
 }